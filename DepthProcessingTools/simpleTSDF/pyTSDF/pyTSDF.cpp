@@ -0,0 +1,443 @@
+/* pytsdf: TSDFVolume and the k4a depth registration as a python module (pybind11)
+   - numpy images are read in place through the buffer protocol, nothing is copied on the way in
+   - meshes and point clouds come back as numpy arrays that own the buffers they were built in
+   - the GIL is released while the volume or k4a works, so other python threads keep running
+   build: pyTSDF.vcxproj next to this file (PYTHON_ROOT must point at the python install that has pybind11)
+
+   import pytsdf, cv2
+   cal = [pytsdf.Calibration("client_0/Intrinsics_Calib_0.json"), ...]
+   views = [pytsdf.View(cal[c].intrinsics, ex[c], cv2.imread(rgb[c]), cv2.imread(matte[c]),
+                        cal[c].point_cloud(cv2.imread(depth[c], cv2.IMREAD_ANYDEPTH))) for c in range(n)]
+   vol = pytsdf.Volume(128)
+   vol.integrate(views)
+   verts, faces, colors, normals = vol.extract(normals=True)
+   color, depth, residual = vol.render(views[0])      # raycast preview, no mesh; residual against the captured depth
+   lod1 = vol.downsample()                            # half the resolution, mesh it at the same isolevel as vol
+   vol.save("frame_12.tsdf")                          # later: pytsdf.Volume.load("frame_12.tsdf").extract(isolevel=0)
+*/
+#include <cmath>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include "Eigen/Core"
+#include "TSDFVolume.h"
+#include "VolumeFile.h"
+#include "MeshDecimate.h"
+#include "VolumeRaycast.h"
+#include "VolumePyramid.h"
+
+#include <k4a/k4a.h>
+
+namespace py = pybind11;
+
+/* numpy array that takes over a vector (no copy), shape in elements */
+template <typename T>
+py::array_t<T> VectorToArray(std::vector<T>&& v, std::vector<py::ssize_t> shape) {
+    std::vector<T>* owned = new std::vector<T>(std::move(v));
+    py::capsule free(owned, [](void* p) { delete reinterpret_cast<std::vector<T>*>(p); });
+    return py::array_t<T>(shape, owned->data(), free);
+}
+
+/* small matrices are copied (and converted to double) */
+template <int R, int C>
+Eigen::Matrix<double, R, C> ArrayToMatrix(py::array_t<double, py::array::c_style | py::array::forcecast> a, const char* name) {
+    if (a.ndim() != 2 || a.shape(0) != R || a.shape(1) != C) {
+        throw py::value_error(std::string(name) + " must be " + std::to_string(R) + "x" + std::to_string(C));
+    }
+    Eigen::Matrix<double, R, C> m;
+    for (int r = 0; r < R; r++) {
+        for (int c = 0; c < C; c++) m(r, c) = a.at(r, c);
+    }
+    return m;
+}
+
+/* an image given from python: h x w x channels of T, pixels tightly packed along a row, any row step */
+template <typename T>
+py::buffer_info ImageBuffer(py::buffer b, const char* name, int channels) {
+    py::buffer_info info = b.request();
+    std::string what = std::string(name) + " must be ";
+    if (info.format != py::format_descriptor<T>::format() || info.itemsize != sizeof(T)) {
+        throw py::value_error(what + "of dtype " + py::format_descriptor<T>::format());
+    }
+    int c = (info.ndim == 3) ? (int)info.shape[2] : 1;
+    if (info.ndim < 2 || info.ndim > 3 || (channels > 0 && c != channels)) {
+        throw py::value_error(what + "h x w" + (channels > 1 ? " x " + std::to_string(channels) : std::string(" (x channels)")));
+    }
+    if (info.strides[1] != (py::ssize_t)(c * sizeof(T)) || (info.ndim == 3 && info.strides[2] != (py::ssize_t)sizeof(T))) {
+        throw py::value_error(what + "packed along its rows (np.ascontiguousarray)");
+    }
+    return info;
+}
+
+/* k4a calibration of one camera (an Intrinsics_Calib_N.json), with its depth -> color registration
+   - same depth mode and color resolution as simpleTSDF's LoadIntrinsics
+   - one k4a transformation per calibration, calls on the same calibration are serialised
+*/
+class Calibration {
+public:
+    Calibration(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) throw std::runtime_error("could not open " + path);
+        std::stringstream raw;
+        raw << file.rdbuf();
+        std::string contents = raw.str();
+        if (K4A_RESULT_SUCCEEDED != k4a_calibration_get_from_raw(&contents[0], contents.size() + 1, K4A_DEPTH_MODE_NFOV_UNBINNED, K4A_COLOR_RESOLUTION_720P, &calibration)) {
+            throw std::runtime_error("could not read the k4a calibration in " + path);
+        }
+        transform = k4a_transformation_create(&calibration);
+        if (!transform) throw std::runtime_error("could not create the k4a transformation for " + path);
+    }
+    ~Calibration() {
+        if (transform) k4a_transformation_destroy(transform);
+    }
+    Calibration(const Calibration&) = delete;
+    Calibration& operator=(const Calibration&) = delete;
+
+    int ColorWidth() const { return calibration.color_camera_calibration.resolution_width; }
+    int ColorHeight() const { return calibration.color_camera_calibration.resolution_height; }
+
+    /* color camera intrinsics as a 3x3 matrix */
+    py::array_t<double> Intrinsics() const {
+        auto params = calibration.color_camera_calibration.intrinsics.parameters;
+        std::vector<double> in = { params.param.fx, 0, params.param.cx, 0, params.param.fy, params.param.cy, 0, 0, 1 };
+        return VectorToArray(std::move(in), { 3, 3 });
+    }
+
+    /* depth image (uint16 mm, depth camera) registered to the color camera, written straight into the returned arrays
+       - registered: color sized uint16 depth, cloud: color sized x,y,z int16 mm (what View takes)
+    */
+    void Register(py::buffer depth, py::array_t<uint16_t>* registered, py::array_t<int16_t>* cloud) {
+        py::buffer_info in = ImageBuffer<uint16_t>(depth, "depth", 1);
+        int w = ColorWidth(), h = ColorHeight();
+        py::array_t<uint16_t> reg({ (py::ssize_t)h, (py::ssize_t)w });
+        if (cloud) *cloud = py::array_t<int16_t>({ (py::ssize_t)h, (py::ssize_t)w, (py::ssize_t)3 });
+        uint8_t* regData = (uint8_t*)reg.mutable_data();
+        uint8_t* cloudData = cloud ? (uint8_t*)cloud->mutable_data() : nullptr;
+        bool ok;
+        {
+            py::gil_scoped_release unlocked;
+            std::lock_guard<std::mutex> lock(transformLock);
+            k4a_image_t k4aDepth = nullptr, k4aReg = nullptr, k4aCloud = nullptr;
+            k4a_image_create_from_buffer(K4A_IMAGE_FORMAT_DEPTH16, (int)in.shape[1], (int)in.shape[0], (int)in.strides[0],
+                (uint8_t*)in.ptr, in.strides[0] * in.shape[0], nullptr, nullptr, &k4aDepth);
+            k4a_image_create_from_buffer(K4A_IMAGE_FORMAT_DEPTH16, w, h, w * (int)sizeof(uint16_t),
+                regData, (size_t)w * h * sizeof(uint16_t), nullptr, nullptr, &k4aReg);
+            ok = k4aDepth && k4aReg && K4A_RESULT_SUCCEEDED == k4a_transformation_depth_image_to_color_camera(transform, k4aDepth, k4aReg);
+            if (ok && cloudData) {
+                k4a_image_create_from_buffer(K4A_IMAGE_FORMAT_CUSTOM, w, h, w * 3 * (int)sizeof(int16_t),
+                    cloudData, (size_t)w * h * 3 * sizeof(int16_t), nullptr, nullptr, &k4aCloud);
+                ok = k4aCloud && K4A_RESULT_SUCCEEDED == k4a_transformation_depth_image_to_point_cloud(transform, k4aReg, K4A_CALIBRATION_TYPE_COLOR, k4aCloud);
+            }
+            if (k4aDepth) k4a_image_release(k4aDepth);
+            if (k4aReg) k4a_image_release(k4aReg);
+            if (k4aCloud) k4a_image_release(k4aCloud);
+        }
+        if (!ok) throw std::runtime_error("k4a could not register the depth image (does it match the calibration's depth mode?)");
+        if (registered) *registered = reg;
+    }
+    py::array_t<uint16_t> DepthToColor(py::buffer depth) {
+        py::array_t<uint16_t> reg;
+        Register(depth, &reg, nullptr);
+        return reg;
+    }
+    py::array_t<int16_t> PointCloud(py::buffer depth) {
+        py::array_t<int16_t> cloud;
+        Register(depth, nullptr, &cloud);
+        return cloud;
+    }
+    /* valid samples (z > 0) of the registered cloud as n x 3 float32 meters, in world space when extrinsics (camera -> world) are given
+       - colors (optional, h x w x 3 uint8 BGR at color resolution) returns the matching n x 3 RGB colours too
+       - like PointCloudProcessing::ConvertDepthToCameraSpacePC + FilterVerticesAndTransform, without the fixed bounding box
+    */
+    py::object Points(py::buffer depth, py::object extrinsics, py::object colors) {
+        py::array_t<int16_t> cloud = PointCloud(depth);
+        Eigen::Matrix4d ex = Eigen::Matrix4d::Identity();
+        if (!extrinsics.is_none()) ex = ArrayToMatrix<4, 4>(extrinsics.cast<py::array_t<double>>(), "extrinsics");
+        py::buffer_info bgr;
+        bool withColors = !colors.is_none();
+        if (withColors) {
+            bgr = ImageBuffer<uint8_t>(colors.cast<py::buffer>(), "colors", 3);
+            if (bgr.shape[0] != ColorHeight() || bgr.shape[1] != ColorWidth()) throw py::value_error("colors must be at color camera resolution");
+        }
+        std::vector<float> points;
+        std::vector<uint8_t> rgb;
+        {
+            py::gil_scoped_release unlocked;
+            const int16_t* pc = cloud.data();
+            int w = ColorWidth(), h = ColorHeight();
+            for (int v = 0; v < h; v++) {
+                for (int u = 0; u < w; u++, pc += 3) {
+                    if (pc[2] <= 0) continue;
+                    Eigen::Vector4d p = ex * Eigen::Vector4d(pc[0] / 1000.0, pc[1] / 1000.0, pc[2] / 1000.0, 1);
+                    points.push_back((float)p(0));
+                    points.push_back((float)p(1));
+                    points.push_back((float)p(2));
+                    if (withColors) {
+                        const uint8_t* c = (const uint8_t*)bgr.ptr + v * bgr.strides[0] + u * 3;
+                        rgb.push_back(c[2]);
+                        rgb.push_back(c[1]);
+                        rgb.push_back(c[0]);
+                    }
+                }
+            }
+        }
+        py::ssize_t n = (py::ssize_t)points.size() / 3;
+        py::array_t<float> p = VectorToArray(std::move(points), { n, 3 });
+        if (!withColors) return p;
+        return py::make_tuple(p, VectorToArray(std::move(rgb), { n, 3 }));
+    }
+
+private:
+    k4a_calibration_t calibration;
+    k4a_transformation_t transform = nullptr;
+    std::mutex transformLock;
+};
+
+/* one camera's images of a frame for Volume.integrate()/carve(), see TSDFCameraView
+   - keeps references to the numpy arrays, the volume reads them in place
+   - color: h x w x 3 uint8 BGR (cv2.imread), matte: h x w (x channels) uint8,
+     pointcloud: h x w x 3 int16 mm in the color camera (Calibration.point_cloud), all at the same resolution
+*/
+class View {
+public:
+    View(py::array_t<double> in, py::array_t<double> ex, py::buffer color, py::buffer matte, py::buffer pointcloud)
+        : color(color), matte(matte), pointcloud(pointcloud) {
+        py::buffer_info bgr = ImageBuffer<uint8_t>(color, "color", 3);
+        py::buffer_info m = ImageBuffer<uint8_t>(matte, "matte", 0);
+        py::buffer_info pc = ImageBuffer<int16_t>(pointcloud, "pointcloud", 3);
+        if (m.shape[0] != bgr.shape[0] || m.shape[1] != bgr.shape[1] || pc.shape[0] != bgr.shape[0] || pc.shape[1] != bgr.shape[1]) {
+            throw py::value_error("color, matte and pointcloud must have the same width and height");
+        }
+        if (pc.strides[0] != pc.shape[1] * 3 * (py::ssize_t)sizeof(int16_t)) {
+            throw py::value_error("pointcloud must be contiguous");
+        }
+        Eigen::Matrix4d exM = ArrayToMatrix<4, 4>(ex, "extrinsics");
+        // world -> camera, as MakeCameraView in simpleTSDF
+        Eigen::Matrix4d exInv = exM;
+        Eigen::Matrix3d Rt = exM.block<3, 3>(0, 0).transpose();
+        exInv.block<3, 3>(0, 0) = Rt;
+        exInv.block<3, 1>(0, 3) = -Rt * exM.block<3, 1>(0, 3);
+        view.in = ArrayToMatrix<3, 3>(in, "intrinsics");
+        view.exInv = exInv;
+        view.width = (int)bgr.shape[1];
+        view.height = (int)bgr.shape[0];
+        view.bgr = (const uint8_t*)bgr.ptr;
+        view.bgrStep = bgr.strides[0];
+        view.matte = (const uint8_t*)m.ptr;
+        view.matteStep = m.strides[0];
+        view.matteChannels = (m.ndim == 3) ? (int)m.shape[2] : 1;
+        view.pointcloud = (const int16_t*)pc.ptr;
+    }
+
+    TSDFCameraView view;
+
+private:
+    py::buffer color, matte, pointcloud;
+};
+
+/* TSDFVolume with the settings simpleTSDF uses
+   - truncation and delta are in voxels (simpleTSDF --trunc/--truncdelta)
+   - sparse volumes allocate the truncation band around the views' foreground samples before integrating
+*/
+class Volume {
+public:
+    Volume(int res, std::vector<double> center, std::vector<double> size, bool sparse, bool voxelColors) {
+        if (res <= 0 || center.size() != 3 || size.size() != 3) throw py::value_error("res must be positive, center and size must have 3 values");
+        Eigen::Vector3d c(center[0], center[1], center[2]), s(size[0], size[1], size[2]);
+        vol.reset(new TSDFVolume(res, res, res, c, s, sparse ? TSDF_SPARSE : TSDF_DENSE, voxelColors));
+    }
+    Volume(std::unique_ptr<TSDFVolume> loaded) : vol(std::move(loaded)) {}
+
+    /* volume file (see VolumeFile.h), blocks: only the blocks that hold data */
+    void Save(const std::string& path, bool blocks) {
+        bool ok;
+        {
+            py::gil_scoped_release unlocked;
+            ok = SaveVolume(path, *vol, blocks || vol->storage == TSDF_SPARSE);
+        }
+        if (!ok) throw std::runtime_error("could not save the volume to " + path);
+    }
+    /* mapped, the voxels are read from the file as they are used */
+    static Volume Load(const std::string& path) {
+        std::unique_ptr<TSDFVolume> loaded;
+        {
+            py::gil_scoped_release unlocked;
+            loaded = LoadVolume(path);
+        }
+        if (!loaded) throw std::runtime_error("could not load a volume from " + path);
+        return Volume(std::move(loaded));
+    }
+
+    void Reset() {
+        py::gil_scoped_release unlocked;
+        vol->reset();
+    }
+    void Integrate(const std::vector<View*>& views, int trunc, int delta) {
+        std::vector<TSDFCameraView> v = Views(views);
+        py::gil_scoped_release unlocked;
+        if (vol->storage == TSDF_SPARSE) {
+            for (const TSDFCameraView& view : v) AllocateBand(view, std::max(trunc, delta));
+        }
+        vol->Integrate(v, vol->vSize[0] * trunc, vol->vSize[0] * delta);
+    }
+    /* visual hull of the mattes, returns the share of the volume carved away */
+    double Carve(const std::vector<View*>& views) {
+        std::vector<TSDFCameraView> v = Views(views);
+        py::gil_scoped_release unlocked;
+        int64_t carved = vol->CarveSilhouettes(v);
+        int64_t stored = vol->NumStoredVoxels();
+        return stored > 0 ? (double)carved / stored : 0.0; // a sparse volume without blocks has nothing to carve
+    }
+    void Smooth(int radius, int passes) {
+        py::gil_scoped_release unlocked;
+        vol->Smooth(radius, passes);
+    }
+    /* indexed mesh (isolevel nan: as simpleTSDF): verts n x 3 float32, faces m x 3 uint32, colors n x 3 uint8 RGB, normals n x 3 float32 (or None)
+       - views: colour the vertices from these images (simpleTSDF --vertexcolor) instead of the voxel colours
+       - method: "mc" marching cubes or "nets" surface nets (simpleTSDF --extractor)
+       - target_faces / max_error: decimate the mesh before it is coloured (simpleTSDF --decimate / --decimateerror, 0 = off)
+    */
+    py::tuple Extract(bool normals, double isolevel, py::object views, const std::string& method, int64_t targetFaces, double maxError) {
+        if (method != "mc" && method != "nets") throw py::value_error("method must be mc or nets");
+        if (targetFaces < 0 || maxError < 0) throw py::value_error("target_faces and max_error must not be negative");
+        bool fromViews = !views.is_none();
+        if (!fromViews && !vol->voxelColors) throw py::value_error("the volume has no voxel colours, pass the views to colour the mesh from");
+        std::vector<TSDFCameraView> v;
+        if (fromViews) v = Views(views.cast<std::vector<View*>>());
+        INDEXEDMESH mesh;
+        {
+            py::gil_scoped_release unlocked;
+            if (std::isnan(isolevel)) isolevel = 1.0f / vol->res[0] / 2; // as simpleTSDF
+            if (method == "nets") vol->PolygoniseSurfaceNets(isolevel, mesh, !fromViews, normals || fromViews);
+            else vol->PolygoniseMCIndexed(isolevel, mesh, !fromViews, normals || fromViews);
+            if (targetFaces > 0 || maxError > 0) MeshDecimator::Decimate(mesh, targetFaces, maxError);
+            if (fromViews) vol->ColorVertices(v, mesh);
+        }
+        py::ssize_t numVerts = (py::ssize_t)mesh.verts.size() / 3;
+        py::ssize_t numTris = (py::ssize_t)mesh.indices.size() / 3;
+        py::object n = py::none();
+        if (normals) n = VectorToArray(std::move(mesh.normals), { numVerts, 3 });
+        return py::make_tuple(VectorToArray(std::move(mesh.verts), { numVerts, 3 }), VectorToArray(std::move(mesh.indices), { numTris, 3 }),
+            VectorToArray(std::move(mesh.colors), { numVerts, 3 }), n);
+    }
+
+    /* next level of the volume's mip pyramid: half the resolution, the weighted mean of 2x2x2 voxels (see VolumePyramid.h)
+       - extract it at the isolevel of this volume to get a coarser mesh of the same surface (simpleTSDF --lods)
+    */
+    Volume Downsample() {
+        std::unique_ptr<TSDFVolume> coarse;
+        {
+            py::gil_scoped_release unlocked;
+            coarse = VolumePyramid::Downsample(*vol);
+        }
+        return Volume(std::move(coarse));
+    }
+    /* raycast preview (see VolumeRaycast.h, isolevel nan: as simpleTSDF) from the camera of a View, at its size
+       - returns color h x w x 3 uint8 BGR (black where no surface), depth h x w float32 camera z in metres (0 there)
+         and the rendered depth against the view's captured one: dict of pixel counts and metres (see RaycastResidual)
+    */
+    py::tuple RenderView(const View& view, double isolevel) {
+        RaycastImage img;
+        RaycastResidual r;
+        {
+            py::gil_scoped_release unlocked;
+            Raycast(view.view.in, view.view.exInv, view.view.width, view.view.height, isolevel, img);
+            r = VolumeRaycaster::Residual(img, view.view);
+        }
+        py::dict residual;
+        residual["both"] = r.both;
+        residual["capture_only"] = r.captureOnly;
+        residual["render_only"] = r.renderOnly;
+        residual["mean"] = r.mean;
+        residual["mean_abs"] = r.meanAbs;
+        residual["rms"] = r.rms;
+        py::ssize_t h = img.height, w = img.width;
+        return py::make_tuple(VectorToArray(std::move(img.bgr), { h, w, 3 }), VectorToArray(std::move(img.depth), { h, w }), residual);
+    }
+    /* the same from any pinhole camera: intrinsics 3x3, extrinsics 4x4 camera -> world (as View), width x height pixels */
+    py::tuple Render(py::array_t<double> intrinsics, py::array_t<double> extrinsics, int width, int height, double isolevel) {
+        if (width <= 0 || height <= 0) throw py::value_error("width and height must be positive");
+        Eigen::Matrix3d in = ArrayToMatrix<3, 3>(intrinsics, "intrinsics");
+        Eigen::Matrix4d ex = ArrayToMatrix<4, 4>(extrinsics, "extrinsics");
+        RaycastImage img;
+        {
+            py::gil_scoped_release unlocked;
+            Raycast(in, ex.inverse(), width, height, isolevel, img);
+        }
+        py::ssize_t h = img.height, w = img.width;
+        return py::make_tuple(VectorToArray(std::move(img.bgr), { h, w, 3 }), VectorToArray(std::move(img.depth), { h, w }));
+    }
+
+    std::unique_ptr<TSDFVolume> vol;
+
+private:
+    void Raycast(const Eigen::Matrix3d& in, const Eigen::Matrix4d& exInv, int width, int height, double isolevel, RaycastImage& img) {
+        if (std::isnan(isolevel)) isolevel = 1.0f / vol->res[0] / 2; // as simpleTSDF
+        VolumeRaycaster(*vol, (float)isolevel).Render(in, exInv, width, height, img);
+    }
+    static std::vector<TSDFCameraView> Views(const std::vector<View*>& views) {
+        std::vector<TSDFCameraView> v;
+        for (View* view : views) {
+            if (!view) throw py::value_error("views must not contain None");
+            v.push_back(view->view);
+        }
+        return v;
+    }
+    /* as AllocateTruncationBand in simpleTSDF */
+    void AllocateBand(const TSDFCameraView& view, int bandVoxels) {
+        Eigen::Matrix4d ex = view.exInv.inverse();
+        float margin = vol->vSize[0] * bandVoxels;
+        for (int v = 1; v < view.height; v++) {
+            for (int u = 1; u < view.width; u++) {
+                if (view.matte[v * view.matteStep + (size_t)u * view.matteChannels] <= 200) continue;
+                const int16_t* pc = &view.pointcloud[3 * ((size_t)u + (size_t)v * view.width)];
+                float z = pc[2] / 1000.f;
+                if (z <= 0 || z >= 3) continue;
+                Eigen::Vector4d w = ex * Eigen::Vector4d(pc[0] / 1000.0, pc[1] / 1000.0, z, 1);
+                vol->AllocateBlocksAroundPoint(w.head<3>(), margin);
+            }
+        }
+    }
+};
+
+PYBIND11_MODULE(pytsdf, m) {
+    m.doc() = "simpleTSDF volume integration, mesh extraction and k4a depth registration on numpy arrays";
+
+    py::class_<Calibration>(m, "Calibration")
+        .def(py::init<const std::string&>(), py::arg("path"))
+        .def_property_readonly("intrinsics", &Calibration::Intrinsics)
+        .def_property_readonly("width", &Calibration::ColorWidth)
+        .def_property_readonly("height", &Calibration::ColorHeight)
+        .def("depth_to_color", &Calibration::DepthToColor, py::arg("depth"))
+        .def("point_cloud", &Calibration::PointCloud, py::arg("depth"))
+        .def("points", &Calibration::Points, py::arg("depth"), py::arg("extrinsics") = py::none(), py::arg("colors") = py::none());
+
+    py::class_<View>(m, "View")
+        .def(py::init<py::array_t<double>, py::array_t<double>, py::buffer, py::buffer, py::buffer>(),
+            py::arg("intrinsics"), py::arg("extrinsics"), py::arg("color"), py::arg("matte"), py::arg("pointcloud"));
+
+    py::class_<Volume>(m, "Volume")
+        .def(py::init<int, std::vector<double>, std::vector<double>, bool, bool>(),
+            py::arg("res") = 128, py::arg("center") = std::vector<double>{ 0, 0, 0 }, py::arg("size") = std::vector<double>{ 2, 2, 2 }, py::arg("sparse") = false,
+            py::arg("voxel_colors") = true)
+        .def("reset", &Volume::Reset)
+        .def("integrate", &Volume::Integrate, py::arg("views"), py::arg("trunc") = 3, py::arg("delta") = 5)
+        .def("carve", &Volume::Carve, py::arg("views"))
+        .def("smooth", &Volume::Smooth, py::arg("radius"), py::arg("passes") = 1)
+        .def("extract", &Volume::Extract, py::arg("normals") = false, py::arg("isolevel") = std::nan(""), py::arg("views") = py::none(), py::arg("method") = "mc",
+            py::arg("target_faces") = 0, py::arg("max_error") = 0.0)
+        .def("downsample", &Volume::Downsample)
+        .def("render", &Volume::RenderView, py::arg("view"), py::arg("isolevel") = std::nan(""))
+        .def("render", &Volume::Render, py::arg("intrinsics"), py::arg("extrinsics"), py::arg("width"), py::arg("height"), py::arg("isolevel") = std::nan(""))
+        .def("save", &Volume::Save, py::arg("path"), py::arg("blocks") = false)
+        .def_static("load", &Volume::Load, py::arg("path"));
+}
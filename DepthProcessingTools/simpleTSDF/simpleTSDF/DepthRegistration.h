@@ -0,0 +1,191 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <k4a/k4atypes.h>
+
+/* lens of one k4a camera (Brown-Conrady, as in the k4a calibration), normalized image plane (x/z, y/z) <-> pixel
+- pixel (u,v) is the center of column u, row v, like the intrinsics everywhere else in simpleTSDF
+*/
+struct DepthLensModel {
+	int width = 0, height = 0;
+	double fx, fy, cx, cy;
+	double k1, k2, k3, k4, k5, k6, p1, p2, codx, cody;
+	double maxRadius2; // squared metric radius, points further out have no calibrated projection (0 = no limit)
+	bool rational6KT;  // the old RATIONAL_6KT model leaves out the factor 2 on p1/p2
+
+	void Set(const k4a_calibration_camera_t& cam) {
+		const k4a_calibration_intrinsic_parameters_t& p = cam.intrinsics.parameters;
+		width = cam.resolution_width;
+		height = cam.resolution_height;
+		fx = p.param.fx; fy = p.param.fy; cx = p.param.cx; cy = p.param.cy;
+		k1 = p.param.k1; k2 = p.param.k2; k3 = p.param.k3; k4 = p.param.k4; k5 = p.param.k5; k6 = p.param.k6;
+		p1 = p.param.p1; p2 = p.param.p2; codx = p.param.codx; cody = p.param.cody;
+		maxRadius2 = (double)cam.metric_radius * cam.metric_radius;
+		rational6KT = (cam.intrinsics.type == K4A_CALIBRATION_LENS_DISTORTION_MODEL_RATIONAL_6KT);
+	}
+
+	/* undistorted -> distorted normalized coordinates, false outside the metric radius */
+	bool Distort(double x, double y, double& xd, double& yd) const {
+		x -= codx;
+		y -= cody;
+		double x2 = x * x, y2 = y * y, xy = x * y, rs = x2 + y2;
+		if (maxRadius2 > 0 && rs > maxRadius2) return false;
+		double rss = rs * rs, rsc = rss * rs;
+		double a = 1 + k1 * rs + k2 * rss + k3 * rsc;
+		double b = 1 + k4 * rs + k5 * rss + k6 * rsc;
+		double d = (b != 0) ? a / b : a;
+		double t = rational6KT ? 1 : 2;
+		xd = x * d + (rs + 2 * x2) * p2 + t * xy * p1 + codx;
+		yd = y * d + (rs + 2 * y2) * p1 + t * xy * p2 + cody;
+		return true;
+	}
+	bool Project(double x, double y, float& u, float& v) const {
+		double xd, yd;
+		if (!Distort(x, y, xd, yd)) return false;
+		u = (float)(xd * fx + cx);
+		v = (float)(yd * fy + cy);
+		return true;
+	}
+	/* pixel -> undistorted normalized coordinates, Gauss-Newton on Distort() (only used to build the tables)
+	- false if it does not converge to within a thousandth of a pixel or ends outside the metric radius
+	*/
+	bool Unproject(double u, double v, double& x, double& y) const {
+		double xt = (u - cx) / fx, yt = (v - cy) / fy;
+		x = xt;
+		y = yt;
+		const double h = 1e-6, tol = 1e-3 / std::max(fx, fy);
+		for (int it = 0; it < 20; it++) {
+			double xd, yd, xdx, ydx, xdy, ydy;
+			if (!Distort(x, y, xd, yd) || !Distort(x + h, y, xdx, ydx) || !Distort(x, y + h, xdy, ydy)) return false;
+			double ex = xd - xt, ey = yd - yt;
+			if (ex * ex + ey * ey < tol * tol) return true;
+			double j00 = (xdx - xd) / h, j10 = (ydx - yd) / h, j01 = (xdy - xd) / h, j11 = (ydy - yd) / h;
+			double det = j00 * j11 - j01 * j10;
+			if (fabs(det) < 1e-12) return false;
+			x -= (j11 * ex - j01 * ey) / det;
+			y -= (-j10 * ex + j00 * ey) / det;
+		}
+		return false;
+	}
+};
+
+/* depth -> color registration and color camera point clouds without the k4a transformation engine
+- built once per take from the stored k4a_calibration_t: the rays of every depth pixel corner, already rotated
+  into the color camera, and the rays of every color pixel
+- a frame then costs a multiply-add and the color lens polynomial per depth pixel corner, plus a z-tested
+  rectangle fill: each depth pixel covers the color pixels inside the box of its projected corners (nearest wins),
+  which fills the gaps a point splat would leave when the color image is the larger one
+- PointCloud() turns registered depth into x,y,z int16 mm per color pixel like k4a_transformation_depth_image_to_point_cloud()
+- read only after Build(), one registration can serve any number of threads
+*/
+class DepthRegistration {
+public:
+	void Build(const k4a_calibration_t& calibration) {
+		depthLens.Set(calibration.depth_camera_calibration);
+		colorLens.Set(calibration.color_camera_calibration);
+		const k4a_calibration_extrinsics_t& ex = calibration.extrinsics[K4A_CALIBRATION_TYPE_DEPTH][K4A_CALIBRATION_TYPE_COLOR];
+		for (int r = 0; r < 9; r++) rotation[r] = ex.rotation[r];
+		for (int t = 0; t < 3; t++) translation[t] = ex.translation[t];
+
+		// depth pixel corners (u-0.5, v-0.5) .. (u+0.5, v+0.5), as color camera directions (NaN = no ray)
+		int cw = depthLens.width + 1, ch = depthLens.height + 1;
+		cornerRays.assign((size_t)cw * ch * 3, NAN);
+		for (int v = 0; v < ch; v++) {
+			for (int u = 0; u < cw; u++) {
+				double x, y;
+				if (!depthLens.Unproject(u - 0.5, v - 0.5, x, y)) continue;
+				float* r = &cornerRays[3 * ((size_t)u + (size_t)v * cw)];
+				for (int a = 0; a < 3; a++) r[a] = (float)(rotation[3 * a] * x + rotation[3 * a + 1] * y + rotation[3 * a + 2]);
+			}
+		}
+		// z of the depth pixel centers in the color camera per mm of depth
+		centerZ.assign((size_t)depthLens.width * depthLens.height, NAN);
+		for (int v = 0; v < depthLens.height; v++) {
+			for (int u = 0; u < depthLens.width; u++) {
+				double x, y;
+				if (depthLens.Unproject(u, v, x, y)) centerZ[u + (size_t)v * depthLens.width] = (float)(rotation[6] * x + rotation[7] * y + rotation[8]);
+			}
+		}
+		// color pixel rays (x/z, y/z), NaN = no ray
+		colorRays.assign((size_t)colorLens.width * colorLens.height * 2, NAN);
+		for (int v = 0; v < colorLens.height; v++) {
+			for (int u = 0; u < colorLens.width; u++) {
+				double x, y;
+				if (!colorLens.Unproject(u, v, x, y)) continue;
+				float* r = &colorRays[2 * ((size_t)u + (size_t)v * colorLens.width)];
+				r[0] = (float)x;
+				r[1] = (float)y;
+			}
+		}
+	}
+	int DepthWidth() const { return depthLens.width; }
+	int DepthHeight() const { return depthLens.height; }
+	int ColorWidth() const { return colorLens.width; }
+	int ColorHeight() const { return colorLens.height; }
+
+	/* depth (uint16 mm, depth camera) -> out (uint16 mm, color camera, 0 = no depth), steps in bytes */
+	void DepthToColor(const uint16_t* depth, size_t depthStep, uint16_t* out, size_t outStep) const {
+		int dw = depthLens.width, dh = depthLens.height, cw = colorLens.width, ch = colorLens.height;
+		for (int v = 0; v < ch; v++) memset((uint8_t*)out + v * outStep, 0, cw * sizeof(uint16_t));
+		size_t cornerRow = 3 * ((size_t)dw + 1);
+		for (int v = 0; v < dh; v++) {
+			const uint16_t* drow = (const uint16_t*)((const uint8_t*)depth + v * depthStep);
+			for (int u = 0; u < dw; u++) {
+				if (drow[u] == 0) continue;
+				float d = drow[u];
+				float z = d * centerZ[u + (size_t)v * dw] + translation[2];
+				if (!(z > 0) || z > 65535) continue;
+				const float* corner[4] = {
+					&cornerRays[3 * (size_t)u + v * cornerRow], &cornerRays[3 * (size_t)(u + 1) + v * cornerRow],
+					&cornerRays[3 * (size_t)u + (v + 1) * cornerRow], &cornerRays[3 * (size_t)(u + 1) + (v + 1) * cornerRow] };
+				float u0 = 1e30f, u1 = -1e30f, v0 = 1e30f, v1 = -1e30f;
+				bool ok = true;
+				for (int c = 0; c < 4; c++) {
+					float px = d * corner[c][0] + translation[0];
+					float py = d * corner[c][1] + translation[1];
+					float pz = d * corner[c][2] + translation[2];
+					float cu, cv;
+					ok = (pz > 0) && colorLens.Project(px / pz, py / pz, cu, cv); // NaN rays fail on pz
+					if (!ok) break;
+					u0 = std::min(u0, cu); u1 = std::max(u1, cu);
+					v0 = std::min(v0, cv); v1 = std::max(v1, cv);
+				}
+				if (!ok) continue;
+				int iu0 = std::max(0, (int)ceilf(u0)), iu1 = std::min(cw - 1, (int)floorf(u1));
+				int iv0 = std::max(0, (int)ceilf(v0)), iv1 = std::min(ch - 1, (int)floorf(v1));
+				uint16_t zmm = (uint16_t)(z + 0.5f);
+				for (int y = iv0; y <= iv1; y++) {
+					uint16_t* orow = (uint16_t*)((uint8_t*)out + y * outStep);
+					for (int x = iu0; x <= iu1; x++) {
+						if (orow[x] == 0 || zmm < orow[x]) orow[x] = zmm;
+					}
+				}
+			}
+		}
+	}
+
+	/* registered depth (uint16 mm, color camera) -> x,y,z int16 mm per color pixel (0,0,0 = no point), tightly packed cloud */
+	void PointCloud(const uint16_t* registered, size_t registeredStep, int16_t* cloud) const {
+		int cw = colorLens.width, ch = colorLens.height;
+		for (int v = 0; v < ch; v++) {
+			const uint16_t* zrow = (const uint16_t*)((const uint8_t*)registered + v * registeredStep);
+			const float* ray = &colorRays[2 * (size_t)v * cw];
+			int16_t* out = &cloud[3 * (size_t)v * cw];
+			for (int u = 0; u < cw; u++, ray += 2, out += 3) {
+				float z = zrow[u];
+				bool valid = (z > 0) && (ray[0] == ray[0]);
+				out[0] = valid ? (int16_t)floorf(ray[0] * z + 0.5f) : 0;
+				out[1] = valid ? (int16_t)floorf(ray[1] * z + 0.5f) : 0;
+				out[2] = valid ? (int16_t)z : 0;
+			}
+		}
+	}
+
+private:
+	DepthLensModel depthLens, colorLens;
+	float rotation[9], translation[3]; // depth -> color camera, mm
+	std::vector<float> cornerRays, centerZ, colorRays;
+};
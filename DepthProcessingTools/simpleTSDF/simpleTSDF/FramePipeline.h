@@ -0,0 +1,92 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+/* blocking queues between the stages of the frame loop (decode -> integrate -> write)
+- every queue holds at most 'capacity' items, a full queue blocks the producer (backpressure),
+  so a slow stage throttles the stages in front of it instead of piling frames up in memory
+- Close() is called by the producer side once nothing more will come, Pop() then drains what is left and returns false
+*/
+
+/* first in first out, for a single ordered producer (the integrate -> write hand off) */
+template <typename T>
+class BoundedQueue {
+public:
+	BoundedQueue(size_t capacity) : capacity(capacity < 1 ? 1 : capacity), closed(false) {}
+
+	void Push(T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [&] { return items.size() < capacity || closed; });
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+	}
+	bool Pop(T& item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+		if (items.empty()) return false;
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+	void Close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+		notFull.notify_all();
+	}
+
+private:
+	size_t capacity;
+	bool closed;
+	std::deque<T> items;
+	std::mutex mutex;
+	std::condition_variable notEmpty, notFull;
+};
+
+/* several producers finishing out of order, consumers that must take the items in sequence (0,1,2,...)
+- item 'seq' is only accepted once seq < next + capacity (next = sequence the consumers wait for),
+  so at most capacity items are buffered and the one the consumer needs can always be pushed
+- every sequence number must be pushed exactly once (push a failed item rather than skipping it)
+*/
+template <typename T>
+class ReorderQueue {
+public:
+	ReorderQueue(size_t capacity) : capacity(capacity < 1 ? 1 : capacity), next(0), closed(false) {}
+
+	void Push(int64_t seq, T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [&] { return seq < next + (int64_t)capacity || closed; });
+		items.emplace(seq, std::move(item));
+		if (seq == next) ready.notify_one();
+	}
+	bool Pop(T& item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		ready.wait(lock, [&] { return items.count(next) || closed; });
+		auto it = items.find(next);
+		if (it == items.end()) return false;
+		item = std::move(it->second);
+		items.erase(it);
+		next++;
+		notFull.notify_all();
+		if (items.count(next)) ready.notify_one(); // already there, wake another consumer
+		return true;
+	}
+	void Close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		ready.notify_all();
+		notFull.notify_all();
+	}
+
+private:
+	size_t capacity;
+	int64_t next;
+	bool closed;
+	std::map<int64_t, T> items;
+	std::mutex mutex;
+	std::condition_variable ready, notFull;
+};
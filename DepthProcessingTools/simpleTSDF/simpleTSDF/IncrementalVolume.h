@@ -0,0 +1,246 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "Eigen/Core"
+#include "TSDFVolume.h"
+
+/* a dense volume kept from one frame of a take to the next, only the bricks under changed pixels are redone (simpleTSDF --incremental)
+- every camera's matte and depth are compared with the pixels each tile (tileSize x tileSize) was last refreshed from,
+  a tile changed when a pixel flips in the matte, or its depth sample (foreground, 0 < z < 3m, as FuseSample uses it)
+  appears, disappears or moves by more than depthThreshold mm; only changed tiles are refreshed, so slow drift still adds up
+- a brick is dirty when its voxels project onto a changed tile in any camera (or it reaches behind a camera),
+  dirty bricks are cleared and integrated from the current frame (carved first with carving), the others keep their voxels
+- a voxel only reads the pixel it lands on, so with depthThreshold 0 the volume is the one a full integration gives,
+  above that the depth jitter of still parts is ignored (the kept sdf is off by at most about twice the threshold)
+- the mesh of every brick is kept as well, a brick is extracted again when a brick among its 26 neighbours was dirty
+  (see TSDFVolume::BrickMesh) or the extraction settings changed
+- voxel colours of clean bricks stay those of the frame they were integrated in, colour from the images
+  after extraction (TSDFVolume::ColorVertices) follows every frame
+- frames must come one at a time and in order, Invalidate() starts over (new take, new volume box)
+*/
+class IncrementalVolume {
+public:
+	struct Stats {
+		int numBricks = 0, dirtyBricks = 0, remeshedBricks = 0;
+		double changedTiles = 0; // share of the tiles of all cameras
+	};
+
+	IncrementalVolume(const int res[3], const Eigen::Vector3d& center, const Eigen::Vector3d& size, bool voxelColors, int tileSize, float depthThreshold)
+		: tileSize(std::max(tileSize, 1)), depthThreshold(depthThreshold) {
+		Eigen::Vector3d c = center, s = size;
+		vol.reset(new TSDFVolume(res[0], res[1], res[2], c, s, TSDF_DENSE, voxelColors));
+		numBricks = vol->blockRes[0] * vol->blockRes[1] * vol->blockRes[2];
+	}
+	TSDFVolume* Volume() { return vol.get(); }
+	bool Matches(const int res[3], bool voxelColors) const {
+		return vol->res[0] == res[0] && vol->res[1] == res[1] && vol->res[2] == res[2] && vol->voxelColors == voxelColors;
+	}
+	void Invalidate() {
+		primed = false;
+		references.clear();
+	}
+
+	/* bring the volume up to date with this frame */
+	Stats Integrate(const std::vector<TSDFCameraView>& views, float truncMargin, float delta, bool carve) {
+		Stats stats;
+		stats.numBricks = numBricks;
+		std::vector<std::vector<uint8_t>> changed;
+		bool full = !primed || references.size() != views.size();
+		for (size_t cam = 0; cam < views.size() && !full; cam++) {
+			full = (references[cam].width != views[cam].width || references[cam].height != views[cam].height);
+		}
+		if (full) {
+			references.assign(views.size(), Reference());
+			for (size_t cam = 0; cam < views.size(); cam++) Refresh(views[cam], references[cam]);
+			vol->reset();
+			if (carve) vol->CarveSilhouettes(views);
+			vol->Integrate(views, truncMargin, delta);
+			vol->UpdateBrickRanges();
+			remesh.assign(numBricks, 1);
+			primed = true;
+			stats.dirtyBricks = stats.remeshedBricks = numBricks;
+			stats.changedTiles = 1;
+			return stats;
+		}
+
+		int64_t numTiles = 0, numChanged = 0;
+		changed.resize(views.size());
+		for (size_t cam = 0; cam < views.size(); cam++) {
+			numChanged += Compare(views[cam], references[cam], changed[cam]);
+			numTiles += changed[cam].size();
+		}
+		stats.changedTiles = numTiles ? (double)numChanged / numTiles : 0;
+
+		std::vector<uint8_t> dirty(numBricks, 0);
+#pragma omp parallel for schedule(dynamic, 64)
+		for (int b = 0; b < numBricks; b++) {
+			dirty[b] = BrickSeesChange(views, changed, b) ? 1 : 0;
+		}
+		std::vector<int> dirtyList;
+		for (int b = 0; b < numBricks; b++) {
+			if (dirty[b]) dirtyList.push_back(b);
+		}
+		// every brick whose cells, normals or sdf range read a dirty brick
+		remesh.assign(numBricks, 0);
+		std::vector<int> remeshList;
+		for (int b : dirtyList) {
+			int bi = b % vol->blockRes[0], bj = (b / vol->blockRes[0]) % vol->blockRes[1], bk = b / (vol->blockRes[0] * vol->blockRes[1]);
+			for (int dk = -1; dk <= 1; dk++) {
+				for (int dj = -1; dj <= 1; dj++) {
+					for (int di = -1; di <= 1; di++) {
+						int ni = bi + di, nj = bj + dj, nk = bk + dk;
+						if (ni < 0 || nj < 0 || nk < 0 || ni >= vol->blockRes[0] || nj >= vol->blockRes[1] || nk >= vol->blockRes[2]) continue;
+						int n = IND2LINEAR(ni, nj, nk, vol->blockRes[0], vol->blockRes[1], vol->blockRes[2]);
+						if (!remesh[n]) remeshList.push_back(n);
+						remesh[n] = 1;
+					}
+				}
+			}
+		}
+		if (!dirtyList.empty()) {
+			vol->ExpireBricks(dirtyList);
+			if (carve) vol->CarveSilhouettes(views, &dirtyList);
+			vol->Integrate(views, truncMargin, delta, &dirtyList);
+			vol->UpdateBrickRanges(remeshList);
+		}
+		stats.dirtyBricks = (int)dirtyList.size();
+		stats.remeshedBricks = (int)remeshList.size();
+		return stats;
+	}
+
+	/* the surface of the whole volume, only the bricks marked by Integrate() are extracted again */
+	void Extract(float isolevel, std::vector<TRIANGLE>& triangles) {
+		UpdateBrickMeshes(isolevel, false, false, false);
+		TSDFVolume::AssembleBrickMeshes(brickMeshes, triangles);
+	}
+	void Extract(float isolevel, INDEXEDMESH& mesh, bool withColors, bool withNormals) {
+		UpdateBrickMeshes(isolevel, true, withColors, withNormals);
+		vol->AssembleBrickMeshes(brickMeshes, mesh, withColors, withNormals);
+	}
+
+private:
+	/* what a tile was last refreshed from: matte foreground and the depth FuseSample would use (0 = none), mm */
+	struct Reference {
+		int width = 0, height = 0;
+		std::vector<uint8_t> foreground;
+		std::vector<uint16_t> depth;
+	};
+	static void Sample(const TSDFCameraView& view, int u, int v, uint8_t& fg, uint16_t& z) {
+		fg = view.matte[v * view.matteStep + (size_t)u * view.matteChannels] > 200;
+		int16_t d = view.pointcloud[3 * ((size_t)u + (size_t)v * view.width) + 2];
+		z = (fg && d > 0 && d < 3000) ? (uint16_t)d : 0;
+	}
+	void Refresh(const TSDFCameraView& view, Reference& ref) {
+		ref.width = view.width;
+		ref.height = view.height;
+		ref.foreground.resize((size_t)view.width * view.height);
+		ref.depth.resize((size_t)view.width * view.height);
+#pragma omp parallel for
+		for (int v = 0; v < view.height; v++) {
+			for (int u = 0; u < view.width; u++) {
+				size_t p = u + (size_t)v * view.width;
+				Sample(view, u, v, ref.foreground[p], ref.depth[p]);
+			}
+		}
+	}
+	/* changed tiles of one camera, refreshing them in ref, returns how many changed */
+	int64_t Compare(const TSDFCameraView& view, Reference& ref, std::vector<uint8_t>& changed) {
+		int tilesX = (view.width + tileSize - 1) / tileSize, tilesY = (view.height + tileSize - 1) / tileSize;
+		changed.assign((size_t)tilesX * tilesY, 0);
+		int64_t numChanged = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:numChanged)
+		for (int ty = 0; ty < tilesY; ty++) {
+			int v0 = ty * tileSize, v1 = std::min(v0 + tileSize, view.height);
+			uint8_t* row = &changed[(size_t)ty * tilesX];
+			for (int v = v0; v < v1; v++) {
+				for (int u = 0; u < view.width; u++) {
+					if (row[u / tileSize]) {
+						u = (u / tileSize + 1) * tileSize - 1; // already changed, next tile
+						continue;
+					}
+					size_t p = u + (size_t)v * view.width;
+					uint8_t fg;
+					uint16_t z;
+					Sample(view, u, v, fg, z);
+					bool moved = (fg != ref.foreground[p]) || ((z == 0) != (ref.depth[p] == 0)) || std::abs((int)z - (int)ref.depth[p]) > depthThreshold;
+					if (moved) row[u / tileSize] = 1;
+				}
+			}
+			for (int tx = 0; tx < tilesX; tx++) {
+				if (!row[tx]) continue;
+				numChanged++;
+				for (int v = v0; v < v1; v++) {
+					for (int u = tx * tileSize; u < std::min((tx + 1) * tileSize, view.width); u++) {
+						size_t p = u + (size_t)v * view.width;
+						Sample(view, u, v, ref.foreground[p], ref.depth[p]);
+					}
+				}
+			}
+		}
+		return numChanged;
+	}
+	/* the voxels of brick b land on a changed tile of some camera (their centers project inside the box of the corner voxels) */
+	bool BrickSeesChange(const std::vector<TSDFCameraView>& views, const std::vector<std::vector<uint8_t>>& changed, int b) {
+		int o[3], e[3];
+		vol->BrickOrigin(b, o[0], o[1], o[2]);
+		for (int a = 0; a < 3; a++) e[a] = std::min(o[a] + TSDF_BLOCK_SIZE, vol->res[a]) - 1;
+		Eigen::Vector3d lo, hi;
+		vol->GetVoxelCoordsFromIndex(o[0], o[1], o[2], lo);
+		vol->GetVoxelCoordsFromIndex(e[0], e[1], e[2], hi);
+		for (size_t cam = 0; cam < views.size(); cam++) {
+			const TSDFCameraView& view = views[cam];
+			double uMin = 1e30, uMax = -1e30, vMin = 1e30, vMax = -1e30;
+			for (int c = 0; c < 8; c++) {
+				Eigen::Vector3d p((c & 1) ? hi[0] : lo[0], ((c >> 1) & 1) ? hi[1] : lo[1], (c >> 2) ? hi[2] : lo[2]);
+				Eigen::Vector4d cc;
+				Eigen::Vector3d proj = ProjectToCamera(view, p, cc);
+				if (proj(2) <= 0) return true; // reaches around the camera, no cheap bound
+				uMin = std::min(uMin, proj(0));
+				uMax = std::max(uMax, proj(0));
+				vMin = std::min(vMin, proj(1));
+				vMax = std::max(vMax, proj(1));
+			}
+			if (uMax < 0 || vMax < 0 || uMin >= view.width || vMin >= view.height) continue;
+			int tilesX = (view.width + tileSize - 1) / tileSize;
+			int tx0 = std::max(0, (int)uMin) / tileSize, tx1 = std::min(view.width - 1, (int)uMax) / tileSize;
+			int ty0 = std::max(0, (int)vMin) / tileSize, ty1 = std::min(view.height - 1, (int)vMax) / tileSize;
+			for (int ty = ty0; ty <= ty1; ty++) {
+				for (int tx = tx0; tx <= tx1; tx++) {
+					if (changed[cam][(size_t)ty * tilesX + tx]) return true;
+				}
+			}
+		}
+		return false;
+	}
+	void UpdateBrickMeshes(float isolevel, bool indexed, bool withColors, bool withNormals) {
+		bool same = (brickMeshes.size() == (size_t)numBricks && isolevel == meshIsolevel && indexed == meshIndexed && withColors == meshColors && withNormals == meshNormals);
+		if (!same) {
+			brickMeshes.assign(numBricks, TSDFVolume::BrickMesh());
+			remesh.assign(numBricks, 1);
+			meshIsolevel = isolevel;
+			meshIndexed = indexed;
+			meshColors = withColors;
+			meshNormals = withNormals;
+		}
+		if (!vol->bricksValid) vol->UpdateBrickRanges();
+#pragma omp parallel for schedule(dynamic)
+		for (int b = 0; b < numBricks; b++) {
+			if (remesh[b]) vol->PolygoniseBrick(isolevel, b, brickMeshes[b], indexed, withColors, withNormals);
+		}
+		std::fill(remesh.begin(), remesh.end(), 0);
+	}
+
+	std::unique_ptr<TSDFVolume> vol;
+	int numBricks;
+	int tileSize;
+	float depthThreshold; // mm
+	bool primed = false;
+	std::vector<Reference> references; // per camera
+	std::vector<uint8_t> remesh;       // per brick, extract again
+	std::vector<TSDFVolume::BrickMesh> brickMeshes;
+	float meshIsolevel = NAN;
+	bool meshIndexed = false, meshColors = false, meshNormals = false;
+};
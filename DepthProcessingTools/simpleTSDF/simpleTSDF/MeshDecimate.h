@@ -0,0 +1,553 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include "Eigen/Core"
+#include "Eigen/Dense"
+#include "TSDFVolume.h"
+
+#define DECIMATE_PARTITION_FACES 16384 // faces per partition of a pass
+#define DECIMATE_MAX_PASSES 12
+#define DECIMATE_BOUNDARY_WEIGHT 10.0  // weight of the planes that hold boundary vertices on the boundary
+
+/* quadric error metric (Garland & Heckbert): sum of squared distances to a set of planes, as the symmetric 4x4 matrix */
+struct Quadric {
+	double a[10] = { 0 }; // xx xy xz xd yy yz yd zz zd dd
+
+	void AddPlane(const Eigen::Vector3d& n, double d, double w) {
+		a[0] += w * n[0] * n[0]; a[1] += w * n[0] * n[1]; a[2] += w * n[0] * n[2]; a[3] += w * n[0] * d;
+		a[4] += w * n[1] * n[1]; a[5] += w * n[1] * n[2]; a[6] += w * n[1] * d;
+		a[7] += w * n[2] * n[2]; a[8] += w * n[2] * d;
+		a[9] += w * d * d;
+	}
+	void Add(const Quadric& q) {
+		for (int x = 0; x < 10; x++) a[x] += q.a[x];
+	}
+	double Error(const Eigen::Vector3d& p) const {
+		double x = p[0], y = p[1], z = p[2];
+		double e = a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+			+ a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+			+ a[7] * z * z + 2 * a[8] * z + a[9];
+		return std::max(e, 0.0);
+	}
+	/* the point of least error, false if the planes do not pin one down (flat or straight neighbourhoods) */
+	bool Minimum(Eigen::Vector3d& p) const {
+		Eigen::Matrix3d A;
+		A << a[0], a[1], a[2], a[1], a[4], a[5], a[2], a[5], a[7];
+		double det = A.determinant();
+		double scale = A.trace();
+		if (!(std::abs(det) > 1e-9 * scale * scale * scale)) return false;
+		p = A.inverse() * -Eigen::Vector3d(a[3], a[6], a[8]);
+		return true;
+	}
+};
+
+/* parallel quadric error decimation of an indexed mesh (simpleTSDF --decimate / --decimateerror)
+- edges are collapsed cheapest first, each vertex carries the quadric of the faces merged into it,
+  the kept vertex moves to the quadric minimum (or the best of the edge ends and its midpoint)
+- a pass cuts the mesh into a grid of partitions (DECIMATE_PARTITION_FACES faces each) that are decimated in parallel,
+  faces that straddle partitions and their vertices are locked for the pass; the grid is shifted by half a cell
+  every other pass so the locked borders are decimated in the next one
+- the partitions follow from the mesh alone, so the result is the same whatever the number of threads
+- boundary vertices only slide along boundary edges (held by extra planes through them), non-manifold vertices stay put
+- a collapse is refused when it would fold a face over or pinch the surface (link condition)
+- zero length edges and the shortest edge of zero area faces (marching cubes through voxels exactly at the isolevel)
+  go first, nothing else removes those faces and the fold test cannot judge the collapses around them
+- colours and normals of the kept vertex are blended along the edge, normals are normalised again
+*/
+class MeshDecimator {
+public:
+	struct Stats {
+		int64_t facesBefore = 0, facesAfter = 0;
+		int passes = 0;
+	};
+
+	/* decimate mesh in place down to targetFaces (0 = no target) and/or until the cheapest collapse
+	   costs more than maxError (metres, as the root of the quadric error, 0 = no bound) */
+	static Stats Decimate(INDEXEDMESH& mesh, int64_t targetFaces, double maxError) {
+		MeshDecimator d(mesh);
+		return d.Run(targetFaces, maxError);
+	}
+
+private:
+	enum { VERTEX_INTERIOR = 0, VERTEX_BOUNDARY = 1, VERTEX_LOCKED = 2 };
+
+	struct Candidate {
+		double cost;
+		uint32_t remove, keep;   // collapse remove into keep
+		uint32_t vRemove, vKeep; // versions of the two vertices when the candidate was made
+		float p[3];
+		bool operator<(const Candidate& o) const { // priority_queue: cheapest on top, ties by vertex
+			if (cost != o.cost) return cost > o.cost;
+			if (keep != o.keep) return keep > o.keep;
+			return remove > o.remove;
+		}
+	};
+
+	MeshDecimator(INDEXEDMESH& mesh) : mesh(mesh) {}
+
+	Stats Run(int64_t targetFaces, double maxError) {
+		Stats stats;
+		numVerts = (int64_t)mesh.verts.size() / 3;
+		int64_t numFaces = (int64_t)mesh.indices.size() / 3;
+		stats.facesBefore = stats.facesAfter = numFaces;
+		if (numFaces == 0 || (targetFaces <= 0 && maxError <= 0)) return stats;
+		maxCost = (maxError > 0) ? maxError * maxError : INFINITY;
+		if (targetFaces <= 0) targetFaces = 0;
+		InitQuadrics();
+
+		int stalled = 0;
+		// within 1% of the target is close enough, the passes after that only nibble at the partition borders
+		for (int pass = 0; pass < DECIMATE_MAX_PASSES && numFaces > targetFaces + targetFaces / 100 && stalled < 2; pass++) {
+			if (pass > 0) { // InitQuadrics built them for the first pass
+				BuildAdjacency();
+				ClassifyVertices();
+			}
+			int numParts = Partition(pass & 1);
+			double keepShare = (double)targetFaces / numFaces;
+			std::vector<int64_t> removed(numParts, 0);
+#pragma omp parallel for schedule(dynamic)
+			for (int part = 0; part < numParts; part++) {
+				removed[part] = DecimatePartition(part, keepShare);
+			}
+			int64_t total = 0;
+			for (int64_t r : removed) total += r;
+			Compact();
+			numFaces -= total;
+			stats.passes++;
+			// a pass locks its borders, so only two passes in a row without progress mean there is nothing left
+			stalled = (total < std::max<int64_t>(1, numFaces / 200)) ? stalled + 1 : 0;
+		}
+		stats.facesAfter = (int64_t)mesh.indices.size() / 3;
+		return stats;
+	}
+
+	Eigen::Vector3d Position(uint32_t v) const {
+		return Eigen::Vector3d(mesh.verts[3 * v], mesh.verts[3 * v + 1], mesh.verts[3 * v + 2]);
+	}
+
+	/* plane quadrics of the faces, plus planes through the boundary edges perpendicular to their face */
+	void InitQuadrics() {
+		quadrics.assign(numVerts, Quadric());
+		BuildAdjacency();
+		ClassifyVertices();
+		int64_t numFaces = (int64_t)mesh.indices.size() / 3;
+		for (int64_t f = 0; f < numFaces; f++) {
+			const uint32_t* t = &mesh.indices[3 * f];
+			Eigen::Vector3d p0 = Position(t[0]), p1 = Position(t[1]), p2 = Position(t[2]);
+			Eigen::Vector3d n = (p1 - p0).cross(p2 - p0);
+			double len = n.norm();
+			if (len <= 0) continue;
+			n /= len;
+			for (int c = 0; c < 3; c++) quadrics[t[c]].AddPlane(n, -n.dot(p0), 1);
+			for (int c = 0; c < 3; c++) {
+				uint32_t a = t[c], b = t[(c + 1) % 3];
+				if (kind[a] != VERTEX_BOUNDARY || kind[b] != VERTEX_BOUNDARY || SharedFaces(a, b, noPool) != 1) continue;
+				Eigen::Vector3d pa = Position(a), e = Position(b) - pa;
+				Eigen::Vector3d bn = e.cross(n);
+				double bl = bn.norm();
+				if (bl <= 0) continue;
+				bn /= bl;
+				quadrics[a].AddPlane(bn, -bn.dot(pa), DECIMATE_BOUNDARY_WEIGHT);
+				quadrics[b].AddPlane(bn, -bn.dot(pa), DECIMATE_BOUNDARY_WEIGHT);
+			}
+		}
+	}
+
+	/* faces around every vertex (CSR), replaced by a list in the partition's pool once the vertex takes part in a collapse */
+	void BuildAdjacency() {
+		int64_t numFaces = (int64_t)mesh.indices.size() / 3;
+		faceStart.assign(numVerts + 1, 0);
+		for (uint32_t v : mesh.indices) faceStart[v + 1]++;
+		for (int64_t v = 0; v < numVerts; v++) faceStart[v + 1] += faceStart[v];
+		faceList.resize(mesh.indices.size());
+		std::vector<int64_t> fill(faceStart.begin(), faceStart.end() - 1);
+		for (int64_t f = 0; f < numFaces; f++) {
+			for (int c = 0; c < 3; c++) faceList[fill[mesh.indices[3 * f + c]]++] = (uint32_t)f;
+		}
+		faceDead.assign(numFaces, 0);
+		vertexDead.assign(numVerts, 0);
+		version.assign(numVerts, 0);
+		poolStart.assign(numVerts, -1);
+		poolCount.assign(numVerts, 0);
+	}
+	/* calls fn(f) for the live faces around v, pool: the lists of the partition v belongs to */
+	template <typename F>
+	void ForEachFace(uint32_t v, const std::vector<uint32_t>& pool, F fn) {
+		const uint32_t* x = &faceList[0] + faceStart[v];
+		const uint32_t* end = &faceList[0] + faceStart[v + 1];
+		if (poolStart[v] >= 0) {
+			x = pool.data() + poolStart[v];
+			end = x + poolCount[v];
+		}
+		for (; x < end; x++) {
+			if (!faceDead[*x]) fn(*x);
+		}
+	}
+	static bool FaceHas(const uint32_t* t, uint32_t v) {
+		return t[0] == v || t[1] == v || t[2] == v;
+	}
+	int SharedFaces(uint32_t a, uint32_t b, const std::vector<uint32_t>& pool) {
+		int n = 0;
+		ForEachFace(a, pool, [&](uint32_t f) { if (FaceHas(&mesh.indices[3 * f], b)) n++; });
+		return n;
+	}
+	/* interior: one closed fan, boundary: one open fan, anything else (non-manifold) is locked */
+	void ClassifyVertices() {
+		kind.assign(numVerts, VERTEX_LOCKED);
+#pragma omp parallel
+		{
+			std::vector<uint32_t> ends;
+#pragma omp for schedule(dynamic, 4096)
+			for (int64_t v = 0; v < numVerts; v++) {
+				ends.clear();
+				int numFaces = 0;
+				ForEachFace((uint32_t)v, noPool, [&](uint32_t f) {
+					const uint32_t* t = &mesh.indices[3 * f];
+					for (int c = 0; c < 3; c++) {
+						if (t[c] != v) ends.push_back(t[c]);
+					}
+					numFaces++;
+				});
+				if (numFaces == 0) continue;
+				std::sort(ends.begin(), ends.end());
+				int single = 0, multiple = 0, distinct = 0;
+				for (size_t x = 0; x < ends.size();) {
+					size_t y = x;
+					while (y < ends.size() && ends[y] == ends[x]) y++;
+					if (y - x == 1) single++;
+					else if (y - x > 2) multiple++;
+					distinct++;
+					x = y;
+				}
+				if (multiple == 0 && single == 0 && distinct == numFaces) kind[v] = VERTEX_INTERIOR;
+				else if (multiple == 0 && single == 2 && distinct == numFaces + 1) kind[v] = VERTEX_BOUNDARY;
+			}
+		}
+	}
+
+	/* grid of partitions over the vertices (shifted by half a cell when shift), faces grouped by partition,
+	   vertices of faces that cross partitions are locked; returns the number of partitions */
+	int Partition(bool shift) {
+		int64_t numFaces = (int64_t)mesh.indices.size() / 3;
+		Eigen::Vector3d lo(INFINITY, INFINITY, INFINITY), hi(-INFINITY, -INFINITY, -INFINITY);
+		for (int64_t v = 0; v < numVerts; v++) {
+			lo = lo.cwiseMin(Position((uint32_t)v));
+			hi = hi.cwiseMax(Position((uint32_t)v));
+		}
+		Eigen::Vector3d extent = (hi - lo).cwiseMax(1e-3 * (hi - lo).maxCoeff()).cwiseMax(1e-9);
+		double cells = std::max(1.0, (double)numFaces / DECIMATE_PARTITION_FACES);
+		double s = std::cbrt(cells / (extent[0] * extent[1] * extent[2]));
+		int dims[3];
+		Eigen::Vector3d cell;
+		for (int a = 0; a < 3; a++) {
+			dims[a] = std::max(1, (int)std::lround(extent[a] * s));
+			cell[a] = extent[a] / dims[a];
+			if (shift && dims[a] > 1) dims[a]++; // the shifted grid needs one more cell to cover the mesh
+		}
+		Eigen::Vector3d origin = lo - (shift ? 0.5 : 0.0) * cell;
+		int numParts = dims[0] * dims[1] * dims[2];
+		std::vector<int> vertexPart(numVerts);
+#pragma omp parallel for schedule(static)
+		for (int64_t v = 0; v < numVerts; v++) {
+			Eigen::Vector3d q = (Position((uint32_t)v) - origin).cwiseQuotient(cell);
+			int c[3];
+			for (int a = 0; a < 3; a++) {
+				c[a] = std::min(std::max((dims[a] > 1 || !shift) ? (int)std::floor(q[a]) : 0, 0), dims[a] - 1);
+			}
+			vertexPart[v] = IND2LINEAR(c[0], c[1], c[2], dims[0], dims[1], dims[2]);
+		}
+		partStart.assign(numParts + 1, 0);
+		std::vector<int> facePart(numFaces);
+		for (int64_t f = 0; f < numFaces; f++) {
+			const uint32_t* t = &mesh.indices[3 * f];
+			int p = vertexPart[t[0]];
+			if (vertexPart[t[1]] != p || vertexPart[t[2]] != p) {
+				for (int c = 0; c < 3; c++) kind[t[c]] = VERTEX_LOCKED;
+				facePart[f] = -1;
+				continue;
+			}
+			facePart[f] = p;
+			partStart[p + 1]++;
+		}
+		for (int p = 0; p < numParts; p++) partStart[p + 1] += partStart[p];
+		partFaces.resize(partStart[numParts]);
+		std::vector<int64_t> fill(partStart.begin(), partStart.end() - 1);
+		for (int64_t f = 0; f < numFaces; f++) {
+			if (facePart[f] >= 0) partFaces[fill[facePart[f]]++] = (uint32_t)f;
+		}
+		return numParts;
+	}
+
+	/* greedy collapses inside one partition until keepShare of its faces are left (or maxCost), returns the faces removed */
+	int64_t DecimatePartition(int part, double keepShare) {
+		int64_t first = partStart[part], last = partStart[part + 1];
+		int64_t numFaces = last - first;
+		if (numFaces == 0) return 0;
+		int64_t budget = numFaces - (int64_t)std::ceil(numFaces * keepShare);
+		if (keepShare <= 0) budget = numFaces;
+		if (budget <= 0) return 0;
+
+		std::vector<uint64_t> edges;
+		edges.reserve(3 * numFaces);
+		for (int64_t x = first; x < last; x++) {
+			const uint32_t* t = &mesh.indices[3 * partFaces[x]];
+			for (int c = 0; c < 3; c++) {
+				uint32_t a = t[c], b = t[(c + 1) % 3];
+				if (kind[a] == VERTEX_LOCKED && kind[b] == VERTEX_LOCKED) continue;
+				edges.push_back(((uint64_t)std::min(a, b) << 32) | std::max(a, b));
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+		edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+		Scratch s;
+		std::vector<Candidate> heap;
+		heap.reserve(edges.size());
+		for (uint64_t e : edges) {
+			Candidate c;
+			if (MakeCandidate((uint32_t)(e >> 32), (uint32_t)e, s.pool, c)) heap.push_back(c);
+		}
+		std::vector<uint64_t>().swap(edges);
+		std::priority_queue<Candidate> queue(std::less<Candidate>(), std::move(heap));
+
+		int64_t removed = 0;
+		while (removed < budget && !queue.empty()) {
+			Candidate c = queue.top();
+			queue.pop();
+			if (c.cost > maxCost) break;
+			if (vertexDead[c.remove] || vertexDead[c.keep] || version[c.remove] != c.vRemove || version[c.keep] != c.vKeep) continue;
+			int gone = Collapse(c, s);
+			if (gone == 0) continue;
+			removed += gone;
+			for (uint32_t n : s.neighbours) {
+				Candidate nc;
+				if (MakeCandidate(c.keep, n, s.pool, nc)) queue.push(nc);
+			}
+		}
+		return removed;
+	}
+
+	/* the collapse of edge (a,b): the more constrained end is kept (in place), otherwise the quadric minimum
+	   - a boundary vertex only moves along a boundary edge, never inward into a boundary or locked vertex (see Collapse)
+	   - degenerate edges (see Degenerate) cost -1 so they come first, a zero length one keeps its position
+	*/
+	bool MakeCandidate(uint32_t a, uint32_t b, const std::vector<uint32_t>& pool, Candidate& c) {
+		if (kind[a] == VERTEX_LOCKED && kind[b] == VERTEX_LOCKED) return false;
+		uint32_t keep = std::min(a, b), remove = std::max(a, b);
+		if (kind[remove] > kind[keep]) std::swap(keep, remove);
+		if (kind[remove] == VERTEX_BOUNDARY && SharedFaces(remove, keep, pool) != 1) return false;
+		Quadric q = quadrics[a];
+		q.Add(quadrics[b]);
+		Eigen::Vector3d pk = Position(keep), pr = Position(remove), p;
+		if (kind[keep] != kind[remove]) {
+			p = pk;
+		}
+		else if (!q.Minimum(p) || (p - 0.5 * (pk + pr)).squaredNorm() > 0.25 * (pk - pr).squaredNorm()) {
+			// no unique minimum (or a far one): the best of the ends and the midpoint
+			Eigen::Vector3d options[3] = { pk, pr, 0.5 * (pk + pr) };
+			p = options[0];
+			for (int o = 1; o < 3; o++) {
+				if (q.Error(options[o]) < q.Error(p)) p = options[o];
+			}
+		}
+		c.cost = q.Error(p);
+		if (Degenerate(a, b, pool)) {
+			if (pk == pr) p = pk;
+			c.cost = -1;
+		}
+		c.keep = keep;
+		c.remove = remove;
+		c.vKeep = version[keep];
+		c.vRemove = version[remove];
+		for (int x = 0; x < 3; x++) c.p[x] = (float)p[x];
+		return true;
+	}
+
+	/* edge (a,b) has zero length or is the shortest edge of a zero area face */
+	bool Degenerate(uint32_t a, uint32_t b, const std::vector<uint32_t>& pool) {
+		Eigen::Vector3d pa = Position(a), pb = Position(b);
+		if (pa == pb) return true;
+		bool degenerate = false;
+		ForEachFace(a, pool, [&](uint32_t f) {
+			const uint32_t* t = &mesh.indices[3 * f];
+			if (degenerate || !FaceHas(t, b)) return;
+			uint32_t o = t[0] ^ t[1] ^ t[2] ^ a ^ b; // the third corner
+			Eigen::Vector3d po = Position(o);
+			if ((pb - pa).cross(po - pa).squaredNorm() > 0) return;
+			double e = (pb - pa).squaredNorm();
+			degenerate = e <= (po - pa).squaredNorm() && e <= (po - pb).squaredNorm();
+		});
+		return degenerate;
+	}
+
+	struct Scratch {
+		std::vector<uint32_t> pool; // face lists of the vertices changed by the collapses of the partition
+		std::vector<uint32_t> facesRemove, facesKeep, ringRemove, ringKeep, neighbours;
+	};
+	/* apply the collapse if it keeps the surface a manifold and folds no face, returns the faces removed (0 = refused) */
+	int Collapse(const Candidate& c, Scratch& s) {
+		uint32_t r = c.remove, k = c.keep;
+		s.facesRemove.clear();
+		s.facesKeep.clear();
+		s.ringRemove.clear();
+		s.ringKeep.clear();
+		ForEachFace(r, s.pool, [&](uint32_t f) { s.facesRemove.push_back(f); });
+		ForEachFace(k, s.pool, [&](uint32_t f) { s.facesKeep.push_back(f); });
+		int shared = 0;
+		for (uint32_t f : s.facesRemove) {
+			const uint32_t* t = &mesh.indices[3 * f];
+			if (FaceHas(t, k)) shared++;
+			for (int x = 0; x < 3; x++) {
+				if (t[x] != r) s.ringRemove.push_back(t[x]);
+			}
+		}
+		for (uint32_t f : s.facesKeep) {
+			const uint32_t* t = &mesh.indices[3 * f];
+			for (int x = 0; x < 3; x++) {
+				if (t[x] != k) s.ringKeep.push_back(t[x]);
+			}
+		}
+		if (shared == 0 || shared > 2) return 0;
+		if (kind[r] == VERTEX_BOUNDARY && shared != 1) return 0; // would pinch the boundary or drag it inward
+		if (kind[r] == VERTEX_INTERIOR && shared != 2) return 0;
+		// link condition: the two rings may only share the opposite vertices of the shared faces
+		std::sort(s.ringRemove.begin(), s.ringRemove.end());
+		s.ringRemove.erase(std::unique(s.ringRemove.begin(), s.ringRemove.end()), s.ringRemove.end());
+		std::sort(s.ringKeep.begin(), s.ringKeep.end());
+		s.ringKeep.erase(std::unique(s.ringKeep.begin(), s.ringKeep.end()), s.ringKeep.end());
+		int common = 0;
+		for (size_t x = 0, y = 0; x < s.ringRemove.size() && y < s.ringKeep.size();) {
+			if (s.ringRemove[x] < s.ringKeep[y]) x++;
+			else if (s.ringRemove[x] > s.ringKeep[y]) y++;
+			else { if (s.ringRemove[x] != k) common++; x++; y++; }
+		}
+		if (common != shared) return 0;
+		// no face may fold over, against its old normal when that is reliable and against the surface around
+		// the edge (marching cubes slivers have noisy normals of their own); a face that already faced away from
+		// that surface (or had no area) cannot be folded by the collapse, the test would only keep it forever
+		Eigen::Vector3d p(c.p[0], c.p[1], c.p[2]);
+		Eigen::Vector3d around(0, 0, 0);
+		for (int side = 0; side < 2; side++) {
+			for (uint32_t f : (side ? s.facesKeep : s.facesRemove)) {
+				const uint32_t* t = &mesh.indices[3 * f];
+				Eigen::Vector3d q0 = Position(t[0]);
+				around += (Position(t[1]) - q0).cross(Position(t[2]) - q0);
+			}
+		}
+		for (int side = 0; side < 2; side++) {
+			uint32_t moved = side ? k : r;
+			for (uint32_t f : (side ? s.facesKeep : s.facesRemove)) {
+				const uint32_t* t = &mesh.indices[3 * f];
+				if (FaceHas(t, r) && FaceHas(t, k)) continue;
+				Eigen::Vector3d q[3], qn[3];
+				for (int x = 0; x < 3; x++) {
+					q[x] = Position(t[x]);
+					qn[x] = (t[x] == moved) ? p : q[x];
+				}
+				Eigen::Vector3d before = (q[1] - q[0]).cross(q[2] - q[0]);
+				Eigen::Vector3d after = (qn[1] - qn[0]).cross(qn[2] - qn[0]);
+				double longest = std::max({ (q[1] - q[0]).squaredNorm(), (q[2] - q[1]).squaredNorm(), (q[0] - q[2]).squaredNorm() });
+				bool reliable = before.norm() > 0.05 * longest;
+				if ((reliable && after.dot(before) <= 0) || (before.dot(around) > 0 && after.dot(around) <= 0)) return 0;
+			}
+		}
+
+		// apply, the faces of k are now its own minus the shared ones plus the other faces of r
+		for (uint32_t f : s.facesRemove) {
+			uint32_t* t = &mesh.indices[3 * f];
+			if (FaceHas(t, k)) {
+				faceDead[f] = 1;
+				continue;
+			}
+			for (int x = 0; x < 3; x++) {
+				if (t[x] == r) t[x] = k;
+			}
+		}
+		poolStart[k] = (int64_t)s.pool.size();
+		for (uint32_t f : s.facesKeep) {
+			if (!faceDead[f]) s.pool.push_back(f);
+		}
+		for (uint32_t f : s.facesRemove) {
+			if (!faceDead[f]) s.pool.push_back(f);
+		}
+		poolCount[k] = (uint32_t)(s.pool.size() - poolStart[k]);
+		Eigen::Vector3d pk = Position(k), pr = Position(r), e = pr - pk;
+		double along = e.squaredNorm() > 0 ? std::min(std::max((p - pk).dot(e) / e.squaredNorm(), 0.0), 1.0) : 0;
+		for (int x = 0; x < 3; x++) mesh.verts[3 * k + x] = c.p[x];
+		if (!mesh.colors.empty()) {
+			for (int x = 0; x < 3; x++) {
+				mesh.colors[3 * k + x] = (uint8_t)((1 - along) * mesh.colors[3 * k + x] + along * mesh.colors[3 * r + x] + 0.5);
+			}
+		}
+		if (!mesh.normals.empty()) {
+			Eigen::Vector3d nk(mesh.normals[3 * k], mesh.normals[3 * k + 1], mesh.normals[3 * k + 2]);
+			Eigen::Vector3d nr(mesh.normals[3 * r], mesh.normals[3 * r + 1], mesh.normals[3 * r + 2]);
+			Eigen::Vector3d n = (1 - along) * nk + along * nr;
+			double len = n.norm();
+			if (len > 0) n /= len;
+			for (int x = 0; x < 3; x++) mesh.normals[3 * k + x] = (float)n[x];
+		}
+		quadrics[k].Add(quadrics[r]);
+		vertexDead[r] = 1;
+		version[k]++;
+
+		s.neighbours.clear();
+		for (uint32_t v : s.ringRemove) {
+			if (v != k) s.neighbours.push_back(v);
+		}
+		s.neighbours.insert(s.neighbours.end(), s.ringKeep.begin(), s.ringKeep.end());
+		std::sort(s.neighbours.begin(), s.neighbours.end());
+		s.neighbours.erase(std::unique(s.neighbours.begin(), s.neighbours.end()), s.neighbours.end());
+		s.neighbours.erase(std::remove(s.neighbours.begin(), s.neighbours.end(), r), s.neighbours.end());
+		return shared;
+	}
+
+	/* drop the dead faces and the vertices no face uses any more, in their original order */
+	void Compact() {
+		int64_t numFaces = (int64_t)mesh.indices.size() / 3;
+		std::vector<int64_t> remap(numVerts, -1);
+		int64_t kept = 0;
+		for (int64_t f = 0; f < numFaces; f++) {
+			if (faceDead[f]) continue;
+			for (int c = 0; c < 3; c++) mesh.indices[3 * kept + c] = mesh.indices[3 * f + c];
+			kept++;
+		}
+		mesh.indices.resize(3 * kept);
+		for (uint32_t v : mesh.indices) remap[v] = 0;
+		int64_t numUsed = 0;
+		for (int64_t v = 0; v < numVerts; v++) {
+			if (remap[v] < 0) continue;
+			remap[v] = numUsed;
+			for (int x = 0; x < 3; x++) {
+				mesh.verts[3 * numUsed + x] = mesh.verts[3 * v + x];
+				if (!mesh.colors.empty()) mesh.colors[3 * numUsed + x] = mesh.colors[3 * v + x];
+				if (!mesh.normals.empty()) mesh.normals[3 * numUsed + x] = mesh.normals[3 * v + x];
+			}
+			quadrics[numUsed] = quadrics[v];
+			numUsed++;
+		}
+		for (uint32_t& v : mesh.indices) v = (uint32_t)remap[v];
+		mesh.verts.resize(3 * numUsed);
+		if (!mesh.colors.empty()) mesh.colors.resize(3 * numUsed);
+		if (!mesh.normals.empty()) mesh.normals.resize(3 * numUsed);
+		quadrics.resize(numUsed);
+		numVerts = numUsed;
+	}
+
+	INDEXEDMESH& mesh;
+	int64_t numVerts = 0;
+	double maxCost = INFINITY;
+	std::vector<Quadric> quadrics;
+	std::vector<uint8_t> kind;                // VERTEX_*, for the current pass
+	std::vector<int64_t> faceStart;           // CSR faces around each vertex at the start of the pass
+	std::vector<uint32_t> faceList;
+	std::vector<uint8_t> faceDead, vertexDead;
+	std::vector<uint32_t> version;            // bumped when a vertex moves, older candidates are stale
+	std::vector<int64_t> poolStart;           // -1: the faces of the vertex are still those of the CSR
+	std::vector<uint32_t> poolCount;
+	const std::vector<uint32_t> noPool;
+	std::vector<int64_t> partStart;           // faces of each partition
+	std::vector<uint32_t> partFaces;
+};
@@ -0,0 +1,212 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <charconv>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "TSDFVolume.h"
+
+#define MESHIO_BUFFER_SIZE (8 << 20) // bytes formatted before each write
+
+/* buffered mesh file output
+- everything is formatted into one reusable buffer that goes to the file in large writes
+- numbers are formatted with std::to_chars (shortest round trip, no locale)
+- binary PLY is written in host byte order, which is little endian on every platform we build for
+*/
+class MeshFileWriter {
+public:
+	MeshFileWriter() : file(nullptr), used(0), failed(false) {}
+	~MeshFileWriter() { Close(); }
+
+	bool Open(const std::string& path) {
+		Close();
+		file = fopen(path.c_str(), "wb");
+		if (!file) {
+			std::cout << "MESHIO: could not open " << path << " for writing" << std::endl;
+			return false;
+		}
+		buffer.resize(MESHIO_BUFFER_SIZE);
+		used = 0;
+		failed = false;
+		return true;
+	}
+	bool Close() {
+		if (!file) return true;
+		Flush();
+		bool ok = (fclose(file) == 0) && !failed;
+		file = nullptr;
+		return ok;
+	}
+	/* false once any write so far came up short (a full disk), it stays so until the next Open() */
+	bool Flush() {
+		if (used > 0 && fwrite(buffer.data(), 1, used, file) != used) failed = true;
+		used = 0;
+		return !failed;
+	}
+
+	void Bytes(const void* p, size_t n) {
+		if (used + n > buffer.size()) {
+			Flush();
+			if (n > buffer.size()) { // larger than the buffer, write straight through
+				if (fwrite(p, 1, n, file) != n) failed = true;
+				return;
+			}
+		}
+		memcpy(&buffer[used], p, n);
+		used += n;
+	}
+	template <typename T>
+	void Binary(T v) { Bytes(&v, sizeof(T)); }
+	void Text(const char* s) { Bytes(s, strlen(s)); }
+	void Char(char c) {
+		if (used + 1 > buffer.size()) Flush();
+		buffer[used++] = c;
+	}
+	template <typename T>
+	void Number(T v) {
+		if (used + 32 > buffer.size()) Flush();
+		auto r = std::to_chars(&buffer[used], &buffer[used] + 32, v);
+		used = r.ptr - buffer.data();
+	}
+
+private:
+	FILE* file;
+	std::vector<char> buffer;
+	size_t used;
+	bool failed;
+};
+
+/* PLY header shared by both meshes, colours are rgb8 and faces are int lists */
+inline void WritePLYHeader(MeshFileWriter& w, bool binary, size_t numVerts, size_t numTris, bool normals, bool colors) {
+	w.Text("ply\n");
+	w.Text(binary ? "format binary_little_endian 1.0\n" : "format ascii 1.0\n");
+	w.Text("comment author: hogue\n");
+	w.Text("element vertex ");
+	w.Number(numVerts);
+	w.Text("\nproperty float x\nproperty float y\nproperty float z\n");
+	if (normals) w.Text("property float nx\nproperty float ny\nproperty float nz\n");
+	if (colors) w.Text("property uchar red\nproperty uchar green\nproperty uchar blue\n");
+	w.Text("element face ");
+	w.Number(numTris);
+	w.Text("\nproperty list uchar int vertex_indices\nend_header\n");
+}
+/* one vertex (normal and colour optional) */
+inline void WritePLYVertex(MeshFileWriter& w, bool binary, const float* p, const float* n, const uint8_t* c) {
+	if (binary) {
+		w.Bytes(p, 3 * sizeof(float));
+		if (n) w.Bytes(n, 3 * sizeof(float));
+		if (c) w.Bytes(c, 3);
+		return;
+	}
+	w.Number(p[0]); w.Char(' '); w.Number(p[1]); w.Char(' '); w.Number(p[2]);
+	if (n) { w.Char(' '); w.Number(n[0]); w.Char(' '); w.Number(n[1]); w.Char(' '); w.Number(n[2]); }
+	if (c) { w.Char(' '); w.Number((int)c[0]); w.Char(' '); w.Number((int)c[1]); w.Char(' '); w.Number((int)c[2]); }
+	w.Char('\n');
+}
+inline void WritePLYFace(MeshFileWriter& w, bool binary, int32_t i0, int32_t i1, int32_t i2) {
+	if (binary) {
+		uint8_t rec[13];
+		rec[0] = 3;
+		memcpy(&rec[1], &i0, 4);
+		memcpy(&rec[5], &i1, 4);
+		memcpy(&rec[9], &i2, 4);
+		w.Bytes(rec, sizeof(rec));
+		return;
+	}
+	w.Text("3 "); w.Number(i0); w.Char(' '); w.Number(i1); w.Char(' '); w.Number(i2); w.Char('\n');
+}
+
+/* triangle soup: 3 vertices per triangle carrying the triangle colour */
+inline bool WriteMeshPLY(const std::string& path, const std::vector<TRIANGLE>& mesh, bool binary = true) {
+	MeshFileWriter w;
+	if (!w.Open(path)) return false;
+	WritePLYHeader(w, binary, mesh.size() * 3, mesh.size(), false, true);
+	for (size_t t = 0; t < mesh.size(); t++) {
+		const TRIANGLE& tri = mesh[t];
+		uint8_t c[3] = { (uint8_t)(int)(255.f * tri.c.x()), (uint8_t)(int)(255.f * tri.c.y()), (uint8_t)(int)(255.f * tri.c.z()) };
+		for (int v = 0; v < 3; v++) {
+			float p[3] = { (float)tri.p[v].x(), (float)tri.p[v].y(), (float)tri.p[v].z() };
+			WritePLYVertex(w, binary, p, nullptr, c);
+		}
+	}
+	for (size_t t = 0; t < mesh.size(); t++) {
+		WritePLYFace(w, binary, (int32_t)(3 * t), (int32_t)(3 * t + 1), (int32_t)(3 * t + 2));
+	}
+	return w.Close();
+}
+/* indexed mesh, normals/colours are written if the mesh has them */
+inline bool WriteMeshPLY(const std::string& path, const INDEXEDMESH& mesh, bool binary = true) {
+	MeshFileWriter w;
+	if (!w.Open(path)) return false;
+	size_t numVerts = mesh.verts.size() / 3;
+	size_t numTris = mesh.indices.size() / 3;
+	bool hasNormals = (mesh.normals.size() == mesh.verts.size());
+	bool hasColors = (mesh.colors.size() == mesh.verts.size());
+	WritePLYHeader(w, binary, numVerts, numTris, hasNormals, hasColors);
+	for (size_t v = 0; v < numVerts; v++) {
+		WritePLYVertex(w, binary, &mesh.verts[3 * v], hasNormals ? &mesh.normals[3 * v] : nullptr, hasColors ? &mesh.colors[3 * v] : nullptr);
+	}
+	for (size_t t = 0; t < numTris; t++) {
+		WritePLYFace(w, binary, (int32_t)mesh.indices[3 * t], (int32_t)mesh.indices[3 * t + 1], (int32_t)mesh.indices[3 * t + 2]);
+	}
+	return w.Close();
+}
+
+/* compact OBJ: shortest float formatting, 1 based face indices */
+inline bool WriteMeshOBJ(const std::string& path, const std::vector<TRIANGLE>& mesh) {
+	MeshFileWriter w;
+	if (!w.Open(path)) return false;
+	for (size_t t = 0; t < mesh.size(); t++) {
+		for (int v = 0; v < 3; v++) {
+			w.Text("v ");
+			w.Number((float)mesh[t].p[v].x()); w.Char(' ');
+			w.Number((float)mesh[t].p[v].y()); w.Char(' ');
+			w.Number((float)mesh[t].p[v].z()); w.Char('\n');
+		}
+	}
+	for (size_t t = 0; t < mesh.size(); t++) {
+		w.Text("f "); w.Number(3 * t + 1); w.Char(' '); w.Number(3 * t + 2); w.Char(' '); w.Number(3 * t + 3); w.Char('\n');
+	}
+	return w.Close();
+}
+/* indexed OBJ, colours follow the position on the v line (common extension), normals as vn */
+inline bool WriteMeshOBJ(const std::string& path, const INDEXEDMESH& mesh) {
+	MeshFileWriter w;
+	if (!w.Open(path)) return false;
+	size_t numVerts = mesh.verts.size() / 3;
+	bool hasNormals = (mesh.normals.size() == mesh.verts.size());
+	bool hasColors = (mesh.colors.size() == mesh.verts.size());
+	for (size_t v = 0; v < numVerts; v++) {
+		w.Text("v ");
+		w.Number(mesh.verts[3 * v]); w.Char(' ');
+		w.Number(mesh.verts[3 * v + 1]); w.Char(' ');
+		w.Number(mesh.verts[3 * v + 2]);
+		if (hasColors) {
+			for (int c = 0; c < 3; c++) {
+				w.Char(' ');
+				w.Number(mesh.colors[3 * v + c] / 255.f);
+			}
+		}
+		w.Char('\n');
+	}
+	if (hasNormals) {
+		for (size_t v = 0; v < numVerts; v++) {
+			w.Text("vn ");
+			w.Number(mesh.normals[3 * v]); w.Char(' ');
+			w.Number(mesh.normals[3 * v + 1]); w.Char(' ');
+			w.Number(mesh.normals[3 * v + 2]); w.Char('\n');
+		}
+	}
+	for (size_t t = 0; t < mesh.indices.size(); t += 3) {
+		w.Text("f ");
+		for (int c = 0; c < 3; c++) {
+			uint32_t ind = mesh.indices[t + c] + 1;
+			w.Number(ind);
+			if (hasNormals) { w.Text("//"); w.Number(ind); }
+			w.Char(c < 2 ? ' ' : '\n');
+		}
+	}
+	return w.Close();
+}
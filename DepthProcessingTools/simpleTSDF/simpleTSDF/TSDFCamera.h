@@ -0,0 +1,185 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "Eigen/Core"
+#include "Eigen/LU"
+
+#define TSDF_PROJ_DEPTH_SCALE 10000.f // projection table depth units per meter (0.1mm, up to 6.5m)
+#define TSDF_PROJ_NO_PIXEL 0xffffffffu
+
+/* voxel -> pixel table of one camera, for a rig and a (dense) grid that stay fixed for a whole take
+- built once by TSDFVolume::BuildProjection(), then TSDFVolume::Integrate() streams through it instead of projecting
+- the voxels of a row (j,k) that land in the image form one run (the frustum is convex), runs are stored row after row
+- about 6 bytes per in-frustum voxel
+*/
+struct TSDFCameraProjection {
+	std::vector<int64_t> runStart; // first entry of row j + k*resY, plus one past the last entry
+	std::vector<int> runFirstI;    // i of the first entry of each row
+	std::vector<uint32_t> pixel;   // (v << 16) | u, TSDF_PROJ_NO_PIXEL for voxels inside a run that still miss the image
+	std::vector<uint16_t> depth;   // camera space z * TSDF_PROJ_DEPTH_SCALE
+	int res[3] = { 0, 0, 0 };      // grid the table was built for
+};
+
+/* one camera's view of the current frame, used by TSDFVolume::Integrate()
+- holds raw pointers into images owned by the caller (so the volume does not depend on opencv/k4a)
+- every image is at color camera resolution (width x height), step is the row size in bytes
+*/
+struct TSDFCameraView {
+	Eigen::Matrix3d in;    // intrinsics
+	Eigen::Matrix4d exInv; // world -> camera (inverse of the extrinsics)
+	int width, height;
+	const uint8_t* bgr;    // colour image, 3 bytes per pixel
+	size_t bgrStep;
+	const uint8_t* matte;  // matte image, only the first channel is used
+	size_t matteStep;
+	int matteChannels;
+	const int16_t* pointcloud; // x,y,z in mm per pixel (k4a point cloud in the color camera), tightly packed
+	const TSDFCameraProjection* projection = nullptr; // optional per take projection table
+};
+
+/* project world point p into the camera
+- returns the camera space point in cc, and (u, v, depth from camera)
+*/
+inline Eigen::Vector3d ProjectToCamera(const TSDFCameraView& view, const Eigen::Vector3d& p, Eigen::Vector4d& cc) {
+	cc = view.exInv * Eigen::Vector4d(p(0), p(1), p(2), 1);
+	Eigen::Vector3d pp;
+	float invz = 1.0f / cc(2);
+	float fx, fy, cx, cy;
+	fx = view.in(0, 0);
+	fy = view.in(1, 1);
+	cx = view.in(0, 2);
+	cy = view.in(1, 2);
+	pp(0) = cc(0) * fx * invz + cx;  // u
+	pp(1) = cc(1) * fy * invz + cy;  // v
+	pp(2) = cc(2); // depth from camera
+	return pp;
+}
+
+/* summed area table of a camera's matte foreground (matte > 200), (width+1) x (height+1) entries
+- the number of foreground pixels in any rectangle is then 4 lookups
+*/
+struct TSDFMatteSAT {
+	int width = 0, height = 0;
+	std::vector<uint32_t> sum;
+};
+inline void BuildMatteSAT(const TSDFCameraView& view, TSDFMatteSAT& sat) {
+	sat.width = view.width;
+	sat.height = view.height;
+	sat.sum.assign((size_t)(view.width + 1) * (view.height + 1), 0);
+	for (int v = 0; v < view.height; v++) {
+		const uint8_t* m = &view.matte[v * view.matteStep];
+		uint32_t rowSum = 0;
+		uint32_t* above = &sat.sum[(size_t)v * (view.width + 1)];
+		uint32_t* out = above + (view.width + 1);
+		for (int u = 0; u < view.width; u++) {
+			rowSum += (m[(size_t)u * view.matteChannels] > 200) ? 1 : 0;
+			out[u + 1] = above[u + 1] + rowSum;
+		}
+	}
+}
+/* foreground pixels in the inclusive rectangle [u0,u1] x [v0,v1] */
+inline uint32_t MatteForegroundCount(const TSDFMatteSAT& sat, int u0, int v0, int u1, int v1) {
+	size_t w = (size_t)sat.width + 1;
+	return sat.sum[(v1 + 1) * w + (u1 + 1)] - sat.sum[(size_t)v0 * w + (u1 + 1)] - sat.sum[(v1 + 1) * w + u0] + sat.sum[(size_t)v0 * w + u0];
+}
+
+/* tight world box of the foreground from the silhouettes
+- every camera bounds the subject by the frustum of its matte bounding rectangle, from the nearest foreground
+  depth out to the 3m depth limit (the far side of the subject is only seen by the other cameras)
+- the box is the intersection of those frusta's world boxes with the box of all foreground depth samples,
+  so the frusta reject stray samples and the samples tighten what the frusta leave open
+- cameras without foreground are ignored, returns false if no camera has any or the boxes do not overlap
+*/
+inline bool SilhouetteBounds(const std::vector<TSDFCameraView>& views, Eigen::Vector3d& lo, Eigen::Vector3d& hi) {
+	Eigen::Vector3d frustaLo = Eigen::Vector3d::Constant(-1e30), frustaHi = Eigen::Vector3d::Constant(1e30);
+	Eigen::Vector3d pointsLo = Eigen::Vector3d::Constant(1e30), pointsHi = Eigen::Vector3d::Constant(-1e30);
+	int numUsed = 0;
+	for (size_t cam = 0; cam < views.size(); cam++) {
+		const TSDFCameraView& view = views[cam];
+		Eigen::Matrix4d ex = view.exInv.inverse();
+		int u0 = view.width, u1 = -1, v0 = view.height, v1 = -1;
+		float zMin = 1e30f;
+		for (int v = 0; v < view.height; v++) {
+			const uint8_t* m = &view.matte[v * view.matteStep];
+			for (int u = 0; u < view.width; u++) {
+				if (m[(size_t)u * view.matteChannels] <= 200) continue;
+				u0 = std::min(u0, u);
+				u1 = std::max(u1, u);
+				v0 = std::min(v0, v);
+				v1 = std::max(v1, v);
+				const int16_t* pc = &view.pointcloud[3 * ((size_t)u + (size_t)v * view.width)];
+				float z = (float)pc[2] / 1000.f;
+				if (z <= 0 || z >= 3) continue;
+				zMin = std::min(zMin, z);
+				Eigen::Vector4d w = ex * Eigen::Vector4d(pc[0] / 1000.0, pc[1] / 1000.0, z, 1);
+				pointsLo = pointsLo.cwiseMin(w.head<3>());
+				pointsHi = pointsHi.cwiseMax(w.head<3>());
+			}
+		}
+		if (u1 < 0 || zMin >= 3) continue;
+		// back project the corners of the rectangle at both depths
+		double fx = view.in(0, 0), fy = view.in(1, 1), cx = view.in(0, 2), cy = view.in(1, 2);
+		Eigen::Vector3d camLo = Eigen::Vector3d::Constant(1e30), camHi = Eigen::Vector3d::Constant(-1e30);
+		for (int c = 0; c < 8; c++) {
+			double u = (c & 1) ? u1 + 1 : u0;
+			double v = ((c >> 1) & 1) ? v1 + 1 : v0;
+			double z = (c >> 2) ? 3.0 : zMin;
+			Eigen::Vector4d w = ex * Eigen::Vector4d((u - cx) * z / fx, (v - cy) * z / fy, z, 1);
+			camLo = camLo.cwiseMin(w.head<3>());
+			camHi = camHi.cwiseMax(w.head<3>());
+		}
+		frustaLo = frustaLo.cwiseMax(camLo);
+		frustaHi = frustaHi.cwiseMin(camHi);
+		numUsed++;
+	}
+	lo = frustaLo.cwiseMax(pointsLo);
+	hi = frustaHi.cwiseMin(pointsHi);
+	return numUsed > 0 && (hi - lo).minCoeff() > 0;
+}
+
+/* colour of the surface point p (world) with outward normal n, straight from the images (meshes coloured after extraction)
+- a camera contributes where p lands on matte foreground and faces it, weighted by cos^2 of the view angle
+- depthTolerance > 0: the depth sample under p must also be within depthTolerance of p, so cameras that see
+  another surface in front of p are left out (0 = no visibility test)
+- bilinear colour sample, returns false (rgb untouched) if no camera sees p
+*/
+inline bool SampleSurfaceColor(const std::vector<TSDFCameraView>& views, const Eigen::Vector3d& p, const Eigen::Vector3d& n, float depthTolerance, uint8_t rgb[3]) {
+	double sum[3] = { 0, 0, 0 }, weightSum = 0;
+	for (size_t cam = 0; cam < views.size(); cam++) {
+		const TSDFCameraView& view = views[cam];
+		Eigen::Vector4d cc;
+		Eigen::Vector3d proj = ProjectToCamera(view, p, cc);
+		if (cc(2) <= 0) continue;
+		int u = (int)proj(0);
+		int v = (int)proj(1);
+		if (u <= 0 || u >= view.width - 1 || v <= 0 || v >= view.height - 1) continue;
+		if ((int)view.matte[v * view.matteStep + (size_t)u * view.matteChannels] <= 200) continue;
+		if (depthTolerance > 0) {
+			float z = (float)(view.pointcloud[3 * ((size_t)u + (size_t)v * view.width) + 2]) / 1000.f;
+			if (z <= 0 || fabs(z - cc(2)) > depthTolerance) continue;
+		}
+		// facing: the normal (in camera space) points back at the camera
+		Eigen::Vector3d nc = view.exInv.block<3, 3>(0, 0) * n;
+		double facing = -nc.dot(cc.head<3>()) / cc.head<3>().norm();
+		if (facing <= 0) continue;
+		double w = facing * facing;
+		// bilinear between the 4 nearest pixel centers
+		double x = proj(0) - 0.5, y = proj(1) - 0.5;
+		int x0 = std::max(0, std::min((int)floor(x), view.width - 2));
+		int y0 = std::max(0, std::min((int)floor(y), view.height - 2));
+		double fx = std::max(0.0, std::min(1.0, x - x0)), fy = std::max(0.0, std::min(1.0, y - y0));
+		const uint8_t* row0 = &view.bgr[y0 * view.bgrStep + (size_t)x0 * 3];
+		const uint8_t* row1 = row0 + view.bgrStep;
+		for (int c = 0; c < 3; c++) {
+			double top = (1 - fx) * row0[c] + fx * row0[c + 3];
+			double bottom = (1 - fx) * row1[c] + fx * row1[c + 3];
+			sum[2 - c] += w * ((1 - fy) * top + fy * bottom); // bgr -> rgb
+		}
+		weightSum += w;
+	}
+	if (weightSum <= 0) return false;
+	for (int c = 0; c < 3; c++) rgb[c] = (uint8_t)(sum[c] / weightSum + 0.5);
+	return true;
+}
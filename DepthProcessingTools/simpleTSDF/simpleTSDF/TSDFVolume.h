@@ -1,9 +1,16 @@
 #pragma once
 #include <iostream>
 #include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include "Eigen/Core"
 #include "Eigen/Geometry"
 #include "polygonizedata.h"
+#include "TSDFCamera.h"
 
 typedef struct {
 	Eigen::Vector3d p[3];
@@ -15,6 +22,14 @@ typedef struct {
 	double val[8];
 } GRIDCELL;
 
+/* indexed triangle mesh, vertices are shared between triangles */
+typedef struct {
+	std::vector<float> verts;      // x,y,z per vertex
+	std::vector<float> normals;    // nx,ny,nz per vertex (empty if not extracted)
+	std::vector<uint8_t> colors;   // r,g,b per vertex (empty if not extracted)
+	std::vector<uint32_t> indices; // 3 per triangle
+} INDEXEDMESH;
+
 enum {
 	VOXEL_EMPTY=0,
 	VOXEL_FULL=1,
@@ -22,21 +37,92 @@ enum {
 };
 static float VOXEL_MAXDIST = 0.5f;
 
+/* storage modes for the voxel grid */
+enum {
+	TSDF_DENSE=0,  // one Voxel for every cell of the grid
+	TSDF_SPARSE=1  // fixed size blocks of voxels allocated through a spatial hash
+};
+
 /* a very very naive and simple version of a TSDF Voxel grid
-- currently just a dense grid to get basic silhouette carving and sdf estimation working
+- dense mode: a plain linear grid to get basic silhouette carving and sdf estimation working
+- sparse mode: TSDF_BLOCK_SIZE^3 blocks allocated only where they are needed (i.e. the truncation band)
+  unallocated space reads back as an unseen voxel at VOXEL_MAXDIST
 */
 #define IND2LINEAR(i,j,k, w,h,d) (((k)*(w)*(h)) + ((j)*(w)) + (i))
+#define TSDF_BLOCK_SHIFT 3
+#define TSDF_BLOCK_SIZE (1<<TSDF_BLOCK_SHIFT)
+#define TSDF_BLOCK_MASK (TSDF_BLOCK_SIZE-1)
+#define TSDF_BLOCK_VOXELS (TSDF_BLOCK_SIZE*TSDF_BLOCK_SIZE*TSDF_BLOCK_SIZE)
 
+/* sdf values are stored as int16 over [-TSDF_SDF_RANGE, TSDF_SDF_RANGE]
+- near the surface the sdf is normalized to [-1,1], further out it holds metric distances (< 3m)
+*/
+#define TSDF_SDF_RANGE 4.0f
+#define TSDF_SDF_SCALE (32767.f / TSDF_SDF_RANGE)
+#define TSDF_MAX_WEIGHT 65535.f
+
+/* unpacked copy of one voxel, the volume itself stores each channel in its own array (see TSDFVolume) */
 class Voxel {
 public:
 	/* store sdf and weight/flag */
 	int flag;
 	float sdf;
 	float weight;
-	Eigen::Vector3d c;
 	float r, g, b;
 };
 
+/* one voxel channel of the volume: an array it owns, or a read mostly view into a mapped volume file (see VolumeFile.h)
+- a mapped channel is used in place (the pages are read on first access), writes go to private copy on write pages
+- resizing or swapping a mapped channel first copies it into memory the channel owns
+*/
+template <typename T>
+class VoxelChannel {
+public:
+	T& operator[](size_t i) { return ptr[i]; }
+	const T& operator[](size_t i) const { return ptr[i]; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	T* begin() { return ptr; }
+	T* end() { return ptr + count; }
+	const T* begin() const { return ptr; }
+	const T* end() const { return ptr + count; }
+	bool Mapped() const { return (bool)mapping; }
+
+	void resize(size_t n, T value) {
+		Own();
+		owned.resize(n, value);
+		Sync();
+	}
+	void swap(std::vector<T>& other) {
+		Own();
+		owned.swap(other);
+		Sync();
+	}
+	/* use n values at p, which stay valid as long as mapping is held */
+	void Map(T* p, size_t n, std::shared_ptr<void> mapping) {
+		std::vector<T>().swap(owned);
+		ptr = p;
+		count = n;
+		this->mapping = mapping;
+	}
+
+private:
+	void Own() {
+		if (!mapping) return;
+		owned.assign(ptr, ptr + count);
+		mapping.reset();
+		Sync();
+	}
+	void Sync() {
+		ptr = owned.data();
+		count = owned.size();
+	}
+	std::vector<T> owned;
+	T* ptr = nullptr;
+	size_t count = 0;
+	std::shared_ptr<void> mapping;
+};
+
 class TSDFVolume
 {
 public:
@@ -44,119 +130,898 @@ public:
 	- takes in values of resolution (x,y,z), and world size (x,y,z)
 	*/
 
-	TSDFVolume(int resX, int resY, int resZ, Eigen::Vector3d &_center, Eigen::Vector3d &_sz) {
+	TSDFVolume(int resX, int resY, int resZ, Eigen::Vector3d &_center, Eigen::Vector3d &_sz, int _storage = TSDF_DENSE, bool _voxelColors = true) {
 		res[0] = resX;
 		res[1] = resY;
 		res[2] = resZ;
 		center = _center;
 		sz = _sz;
-		grid = NULL;
+		storage = _storage;
+		voxelColors = _voxelColors;
 		vSize[0] = sz[0] / (float)res[0];
 		vSize[1] = sz[1] / (float)res[1];
 		vSize[2] = sz[2] / (float)res[2];
-
-		this->AllocateDense();
+		for (int a = 0; a < 3; a++) {
+			blockRes[a] = (res[a] + TSDF_BLOCK_SIZE - 1) / TSDF_BLOCK_SIZE;
+		}
+		background.flag = VOXEL_UNSEEN;
+		background.sdf = DecodeSDF(EncodeSDF(VOXEL_MAXDIST)); // same value a stored voxel would read back
+		background.weight = 0;
+		background.r = background.g = background.b = 0;
+		int numBricks = blockRes[0] * blockRes[1] * blockRes[2]; // also the most blocks a sparse volume can hold
+		storedMin.reset(new std::atomic<int16_t>[numBricks]);
+		storedMax.reset(new std::atomic<int16_t>[numBricks]);
+		for (int b = 0; b < numBricks; b++) ResetStoredRange(b);
+
+		if (storage == TSDF_DENSE) this->AllocateDense();
 	}
 
 	~TSDFVolume() {}
+	/* back to an empty (unseen) volume, O(1) when dense (see TouchBrick) */
 	void reset() {
-		this->SetAllVoxels(VOXEL_UNSEEN, VOXEL_MAXDIST, 0);
-		this->ComputeAllVoxelCenters();
+		bricksValid = false;
+		storedRangesValid = true; // every voxel reads as background, bricks restart their stored range when written
+		if (storage == TSDF_SPARSE) {
+			// blocks follow the surface, so they are re-allocated every frame
+			this->ClearBlocks();
+			return;
+		}
+		NewEpoch();
+	}
+	/* move/scale the grid without reallocating it (the resolution stays), call reset() afterwards */
+	void Place(const Eigen::Vector3d& _center, const Eigen::Vector3d& _sz) {
+		center = _center;
+		sz = _sz;
+		for (int a = 0; a < 3; a++) vSize[a] = sz[a] / (float)res[a];
+		InvalidateBrickRanges();
 	}
 	void makeSphereSDF(float radius) {
 		for (int k = 0; k < res[2]; k++) {
 			for (int j = 0; j < res[1]; j++) {
 				for (int i = 0; i < res[0]; i++) {
-					int ind = IND2LINEAR(i, j, k, res[0], res[1], res[2]);
+					int64_t ind = TouchVoxel(i, j, k);
+					if (ind < 0) continue;
 					// compute distance from center of voxel to surface of the sphere 
-					grid[ind].sdf = (center - grid[ind].c).norm() - radius;
+					Eigen::Vector3d c;
+					GetVoxelCoordsFromIndex(i, j, k, c);
+					SetSDF(ind, (center - c).norm() - radius);
 				}
 			}
 		}
+		InvalidateBrickRanges();
 	}
 
 	bool AllocateDense() {
-		if (grid) return false;
-		grid = new Voxel[res[0]*res[1]*res[2]];
-		if (!grid)
-		{
+		if (!sdfs.empty()) return false;
+		try {
+			ResizeChannels((size_t)res[0] * res[1] * res[2]);
+			int numBricks = blockRes[0] * blockRes[1] * blockRes[2];
+			brickEpochs.reset(new std::atomic<uint32_t>[numBricks]);
+			for (int b = 0; b < numBricks; b++) brickEpochs[b].store(epoch); // channels start out as background
+		}
+		catch (const std::bad_alloc&) {
 			std::cout << "VOXEL: allocateDense() not enough memory " << std::endl;
 			return false;
 		}
 		return true;
 	}
-	bool AllocateDense2() {
-		if (grid2) return false;
-		grid2 = new Voxel[res[0] * res[1] * res[2]];
-		if (!grid2)
-		{
-			std::cout << "VOXEL: allocateDense2() not enough memory " << std::endl;
-			return false;
-		}
-		return true;
+	/* grow (or shrink) every channel, new voxels get the background value */
+	void ResizeChannels(size_t numVoxels) {
+		sdfs.resize(numVoxels, EncodeSDF(background.sdf));
+		weights.resize(numVoxels, 0);
+		flags.resize(numVoxels, (uint8_t)background.flag);
+		colors.resize(voxelColors ? numVoxels * 3 : 0, 0);
+	}
+	size_t NumStoredVoxels() {
+		return sdfs.size();
 	}
 	void SetAllVoxels(int flag, float sdf, float weight) {
-		int numVoxels = res[0] * res[1] * res[2];
-		for (int i = 0; i < numVoxels; i++) {
-			grid[i].flag = flag;
-			grid[i].sdf = sdf;
-			grid[i].weight = weight;
+		std::fill(sdfs.begin(), sdfs.end(), EncodeSDF(sdf));
+		std::fill(weights.begin(), weights.end(), (uint16_t)std::min(weight, TSDF_MAX_WEIGHT));
+		std::fill(flags.begin(), flags.end(), (uint8_t)flag);
+		if (storage == TSDF_DENSE) {
+			for (int b = 0; b < blockRes[0] * blockRes[1] * blockRes[2]; b++) brickEpochs[b].store(epoch);
+		}
+		InvalidateBrickRanges();
+	}
+
+	/* dense bricks and the O(1) reset
+	- every brick is stamped with the epoch it was last cleared in, reset() only starts a new epoch
+	- a brick stamped with an older epoch is stale: it reads back as background (like an unallocated
+	  sparse block) and is cleared by the first write into it, so a frame pays only for the bricks it writes
+	- reads go through VoxelIndex() or check VoxelLive(), writes through TouchVoxel() or TouchBrick()
+	- sparse volumes drop their blocks on reset, every allocated block is live
+	*/
+	int DenseBrick(int i, int j, int k) {
+		return ((k >> TSDF_BLOCK_SHIFT) * blockRes[1] + (j >> TSDF_BLOCK_SHIFT)) * blockRes[0] + (i >> TSDF_BLOCK_SHIFT);
+	}
+	bool BrickLive(int b) {
+		return brickEpochs[b].load(std::memory_order_acquire) == epoch;
+	}
+	bool VoxelLive(int i, int j, int k) {
+		return storage == TSDF_SPARSE || BrickLive(DenseBrick(i, j, k));
+	}
+	/* make brick b live, clearing it to the background first if it is stale (thread safe) */
+	void TouchBrick(int b) {
+		if (BrickLive(b)) return;
+		std::lock_guard<std::mutex> lock(brickLock);
+		if (brickEpochs[b].load(std::memory_order_relaxed) == epoch) return;
+		int o[3];
+		BrickOrigin(b, o[0], o[1], o[2]);
+		int n = std::min(TSDF_BLOCK_SIZE, res[0] - o[0]);
+		for (int k = o[2]; k < std::min(o[2] + TSDF_BLOCK_SIZE, res[2]); k++) {
+			for (int j = o[1]; j < std::min(o[1] + TSDF_BLOCK_SIZE, res[1]); j++) {
+				size_t ind = IND2LINEAR((size_t)o[0], j, k, res[0], res[1], res[2]);
+				std::fill(&sdfs[ind], &sdfs[ind] + n, EncodeSDF(background.sdf));
+				std::fill(&weights[ind], &weights[ind] + n, 0);
+				std::fill(&flags[ind], &flags[ind] + n, (uint8_t)background.flag);
+				if (voxelColors) std::fill(&colors[ind * 3], &colors[ind * 3] + 3 * n, 0);
+			}
+		}
+		ResetStoredRange(b);
+		brickEpochs[b].store(epoch, std::memory_order_release);
+	}
+	/* address of voxel (i,j,k) for writing, -1 if it lives in an unallocated sparse block */
+	int64_t TouchVoxel(int i, int j, int k) {
+		if (storage == TSDF_DENSE) TouchBrick(DenseBrick(i, j, k));
+		return VoxelIndex(i, j, k);
+	}
+	void NewEpoch() {
+		if (++epoch == 0) { // wrapped around, restamp everything as stale
+			for (int b = 0; b < blockRes[0] * blockRes[1] * blockRes[2]; b++) brickEpochs[b].store(0);
+			epoch = 1;
+		}
+	}
+	/* back to background for the listed dense bricks only (stale until written again), the others keep their voxels */
+	void ExpireBricks(const std::vector<int>& bricks) {
+		for (int b : bricks) brickEpochs[b].store(epoch - 1);
+		bricksValid = false; // stale bricks read as background whatever their stored range
+	}
+
+	/* sparse block storage
+	- blocks are keyed by their linear index in the (coarse) block grid
+	- allocation is NOT thread safe, do it in a pre-pass before any parallel integration
+	*/
+	int64_t BlockKey(int bi, int bj, int bk) {
+		return ((int64_t)bk * blockRes[0] * blockRes[1]) + ((int64_t)bj * blockRes[0]) + bi;
+	}
+	void GetBlockCoords(int slot, int& bi, int& bj, int& bk) {
+		int64_t key = blockKeys[slot];
+		bi = (int)(key % blockRes[0]);
+		bj = (int)((key / blockRes[0]) % blockRes[1]);
+		bk = (int)(key / ((int64_t)blockRes[0] * blockRes[1]));
+	}
+	int FindBlock(int bi, int bj, int bk) {
+		auto it = blockMap.find(BlockKey(bi, bj, bk));
+		if (it == blockMap.end()) return -1;
+		return it->second;
+	}
+	int AllocateBlock(int bi, int bj, int bk) {
+		int64_t key = BlockKey(bi, bj, bk);
+		auto it = blockMap.find(key);
+		if (it != blockMap.end()) return it->second;
+
+		int slot = (int)blockKeys.size();
+		blockMap[key] = slot;
+		blockKeys.push_back(key);
+		ResizeChannels(blockKeys.size() * TSDF_BLOCK_VOXELS);
+		ResetStoredRange(slot);
+		bricksValid = false;
+		return slot;
+	}
+	/* allocate every block touched by the axis aligned box of half size margin around world point p */
+	void AllocateBlocksAroundPoint(const Eigen::Vector3d& p, float margin) {
+		int lo[3], hi[3];
+		for (int a = 0; a < 3; a++) {
+			double o = center[a] - sz[a] / 2;
+			lo[a] = (int)floor((p[a] - margin - o) / vSize[a]);
+			hi[a] = (int)floor((p[a] + margin - o) / vSize[a]);
+			if (hi[a] < 0 || lo[a] >= res[a]) return; // entirely outside the volume
+			lo[a] = std::max(lo[a], 0) >> TSDF_BLOCK_SHIFT;
+			hi[a] = std::min(hi[a], res[a] - 1) >> TSDF_BLOCK_SHIFT;
+		}
+		for (int bk = lo[2]; bk <= hi[2]; bk++)
+			for (int bj = lo[1]; bj <= hi[1]; bj++)
+				for (int bi = lo[0]; bi <= hi[0]; bi++)
+					AllocateBlock(bi, bj, bk);
+	}
+	void ClearBlocks() {
+		blockMap.clear();
+		blockKeys.clear();
+		ResizeChannels(0);
+		bricksValid = false;
+		storedRangesValid = true; // nothing left to range over
+	}
+	int NumAllocatedBlocks() {
+		return (int)blockKeys.size();
+	}
+
+	/* address of voxel (i,j,k) in the channel arrays, -1 if it lives in an unallocated block (or a stale dense brick) */
+	int64_t VoxelIndex(int i, int j, int k) {
+		if (storage == TSDF_DENSE) {
+			if (!BrickLive(DenseBrick(i, j, k))) return -1;
+			return IND2LINEAR((int64_t)i, j, k, res[0], res[1], res[2]);
+		}
+		int slot = FindBlock(i >> TSDF_BLOCK_SHIFT, j >> TSDF_BLOCK_SHIFT, k >> TSDF_BLOCK_SHIFT);
+		if (slot < 0) return -1;
+		return ((int64_t)slot * TSDF_BLOCK_VOXELS) + IND2LINEAR(i & TSDF_BLOCK_MASK, j & TSDF_BLOCK_MASK, k & TSDF_BLOCK_MASK, TSDF_BLOCK_SIZE, TSDF_BLOCK_SIZE, TSDF_BLOCK_SIZE);
+	}
+
+	/* packed channel access by address (see VoxelIndex) */
+	static int16_t EncodeSDF(float d) {
+		float q = d * TSDF_SDF_SCALE;
+		q = (q < -32767.f) ? -32767.f : (q > 32767.f) ? 32767.f : q;
+		return (int16_t)lrintf(q);
+	}
+	static float DecodeSDF(int16_t q) {
+		return (float)q * (1.f / TSDF_SDF_SCALE);
+	}
+	float GetSDF(int64_t ind) { return DecodeSDF(sdfs[ind]); }
+	void SetSDF(int64_t ind, float d) { sdfs[ind] = EncodeSDF(d); }
+	float GetWeight(int64_t ind) { return (float)weights[ind]; }
+	void SetWeight(int64_t ind, float w) { weights[ind] = (uint16_t)std::min(w, TSDF_MAX_WEIGHT); }
+	int GetFlag(int64_t ind) { return flags[ind]; }
+	void SetFlag(int64_t ind, int f) { flags[ind] = (uint8_t)f; }
+	uint8_t* GetColor(int64_t ind) { return &colors[ind * 3]; } // r,g,b
+	/* sdf at (i,j,k), background value outside the allocated blocks */
+	float GetSDF(int i, int j, int k) {
+		int64_t ind = VoxelIndex(i, j, k);
+		if (ind < 0) return background.sdf;
+		return GetSDF(ind);
+	}
+
+	/* fuse every camera of a frame into the volume in a single sweep
+	- each voxel is loaded once, the cameras are applied in order on local copies of sdf/weight/colour
+	  and the result is written back once (same running average as applying the cameras one by one)
+	- a camera updates the voxel if it projects inside the image onto a foreground (matte > 200) depth sample
+	  (0 < z < 3m) and lies less than truncMargin behind the surface, within delta of it the sdf is normalised by truncMargin
+	- threads own z slabs (blocks when sparse), only allocated blocks are visited
+	- dense volumes whose views all carry a projection table (see BuildProjection) skip the projection
+	  and only visit the voxels inside at least one camera's frustum
+	- bricks (dense, optional): only these bricks are integrated, in parallel (incremental frames, see ExpireBricks)
+	*/
+	void Integrate(const std::vector<TSDFCameraView>& views, float truncMargin, float delta, const std::vector<int>* bricks = nullptr) {
+		this->truncMargin = truncMargin;
+		truncDelta = delta;
+		if (bricks && storage == TSDF_DENSE) {
+#pragma omp parallel for schedule(dynamic)
+			for (int n = 0; n < (int)bricks->size(); n++) {
+				int o[3];
+				BrickOrigin((*bricks)[n], o[0], o[1], o[2]);
+				for (int k = o[2]; k < std::min(o[2] + TSDF_BLOCK_SIZE, res[2]); k++) {
+					for (int j = o[1]; j < std::min(o[1] + TSDF_BLOCK_SIZE, res[1]); j++) {
+						int64_t ind = IND2LINEAR((int64_t)o[0], j, k, res[0], res[1], res[2]);
+						for (int i = o[0]; i < std::min(o[0] + TSDF_BLOCK_SIZE, res[0]); i++, ind++) {
+							IntegrateVoxel(views, truncMargin, delta, i, j, k, ind);
+						}
+					}
+				}
+			}
+			bricksValid = false; // the stored ranges were kept by StoreFused()
+			return;
+		}
+		bool cached = (storage == TSDF_DENSE && !views.empty());
+		for (size_t cam = 0; cam < views.size(); cam++) {
+			const TSDFCameraProjection* proj = views[cam].projection;
+			if (!proj || proj->res[0] != res[0] || proj->res[1] != res[1] || proj->res[2] != res[2]) cached = false;
+		}
+		if (cached) {
+			IntegrateCached(views, truncMargin, delta);
+		}
+		else if (storage == TSDF_SPARSE) {
+#pragma omp parallel for schedule(dynamic)
+			for (int slot = 0; slot < NumAllocatedBlocks(); slot++) {
+				int o[3];
+				BrickOrigin(slot, o[0], o[1], o[2]);
+				int64_t ind = (int64_t)slot * TSDF_BLOCK_VOXELS;
+				for (int kk = 0; kk < TSDF_BLOCK_SIZE; kk++) {
+					for (int jj = 0; jj < TSDF_BLOCK_SIZE; jj++) {
+						for (int ii = 0; ii < TSDF_BLOCK_SIZE; ii++, ind++) {
+							int i = o[0] + ii, j = o[1] + jj, k = o[2] + kk;
+							if (i < res[0] && j < res[1] && k < res[2]) IntegrateVoxel(views, truncMargin, delta, i, j, k, ind);
+						}
+					}
+				}
+			}
+		}
+		else {
+#pragma omp parallel for schedule(dynamic)
+			for (int k = 0; k < res[2]; k++) {
+				for (int j = 0; j < res[1]; j++) {
+					int64_t ind = IND2LINEAR((int64_t)0, j, k, res[0], res[1], res[2]);
+					for (int i = 0; i < res[0]; i++, ind++) {
+						IntegrateVoxel(views, truncMargin, delta, i, j, k, ind);
+					}
+				}
+			}
+		}
+		bricksValid = false; // the stored ranges were kept by StoreFused()
+	}
+	void IntegrateVoxel(const std::vector<TSDFCameraView>& views, float truncMargin, float delta, int i, int j, int k, int64_t ind) {
+		// if the current voxel is already carved in any image then it should be empty for sure
+		bool live = VoxelLive(i, j, k);
+		if (live && flags[ind] == VOXEL_EMPTY) return;
+		Eigen::Vector3d c;
+		GetVoxelCoordsFromIndex(i, j, k, c);
+		FusedVoxel fv;
+		LoadFused(live ? ind : -1, fv);
+		for (size_t cam = 0; cam < views.size(); cam++) {
+			const TSDFCameraView& view = views[cam];
+			Eigen::Vector4d cc;
+			Eigen::Vector3d proj = ProjectToCamera(view, c, cc);
+			int u = (int)proj(0);
+			int v = (int)proj(1);
+			if (u <= 0 || u >= view.width || v <= 0 || v >= view.height) continue;
+			FuseSample(view, u, v, (float)proj(2), truncMargin, delta, fv);
 		}
+		if (fv.updated && !live) TouchBrick(DenseBrick(i, j, k));
+		StoreFused(i, j, k, ind, fv);
 	}
-	void ComputeAllVoxelCenters() {
+	/* dense integration driven by the per camera projection tables, the runs of a row are walked together */
+	void IntegrateCached(const std::vector<TSDFCameraView>& views, float truncMargin, float delta) {
+		int numCams = (int)views.size();
+#pragma omp parallel for schedule(dynamic)
 		for (int k = 0; k < res[2]; k++) {
+			std::vector<int64_t> first(numCams), count(numCams), base(numCams);
 			for (int j = 0; j < res[1]; j++) {
+				int row = j + k * res[1];
+				int64_t iMin = res[0], iMax = 0;
+				for (int cam = 0; cam < numCams; cam++) {
+					const TSDFCameraProjection* proj = views[cam].projection;
+					base[cam] = proj->runStart[row];
+					count[cam] = proj->runStart[row + 1] - base[cam];
+					first[cam] = proj->runFirstI[row];
+					if (count[cam] == 0) continue;
+					iMin = std::min(iMin, first[cam]);
+					iMax = std::max(iMax, first[cam] + count[cam]);
+				}
+				int64_t rowBase = IND2LINEAR((int64_t)0, j, k, res[0], res[1], res[2]);
+				for (int64_t i = iMin; i < iMax; i++) {
+					int64_t ind = rowBase + i;
+					bool live = VoxelLive((int)i, j, k);
+					if (live && flags[ind] == VOXEL_EMPTY) continue;
+					FusedVoxel fv;
+					LoadFused(live ? ind : -1, fv);
+					for (int cam = 0; cam < numCams; cam++) {
+						int64_t e = i - first[cam];
+						if (e < 0 || e >= count[cam]) continue;
+						const TSDFCameraProjection* proj = views[cam].projection;
+						uint32_t pix = proj->pixel[base[cam] + e];
+						if (pix == TSDF_PROJ_NO_PIXEL) continue;
+						FuseSample(views[cam], pix & 0xffff, pix >> 16, proj->depth[base[cam] + e] / TSDF_PROJ_DEPTH_SCALE, truncMargin, delta, fv);
+					}
+					if (fv.updated && !live) TouchBrick(DenseBrick((int)i, j, k));
+					StoreFused((int)i, j, k, ind, fv);
+				}
+			}
+		}
+	}
+	/* running fusion state of one voxel (kept in registers while the cameras are applied) */
+	struct FusedVoxel {
+		float d, weight, r, g, b;
+		bool updated;
+		bool colored; // the volume keeps voxel colours
+	};
+	/* ind < 0 loads the background (stale brick) */
+	void LoadFused(int64_t ind, FusedVoxel& fv) {
+		fv.updated = false;
+		fv.colored = voxelColors;
+		if (ind < 0 || !voxelColors) {
+			fv.r = background.r;
+			fv.g = background.g;
+			fv.b = background.b;
+		}
+		if (ind < 0) {
+			fv.d = background.sdf;
+			fv.weight = background.weight;
+			return;
+		}
+		fv.d = GetSDF(ind);
+		fv.weight = GetWeight(ind);
+		if (!voxelColors) return;
+		uint8_t* rgb = GetColor(ind);
+		fv.r = rgb[0];
+		fv.g = rgb[1];
+		fv.b = rgb[2];
+	}
+	/* write back voxel (i,j,k) at address ind if a camera updated it, widening the stored range of its brick */
+	void StoreFused(int i, int j, int k, int64_t ind, FusedVoxel& fv) {
+		if (!fv.updated) return;
+		SetSDF(ind, fv.d);
+		SetWeight(ind, fv.weight);
+		if (voxelColors) {
+			uint8_t* rgb = GetColor(ind);
+			rgb[0] = (uint8_t)(fv.r + 0.5f);
+			rgb[1] = (uint8_t)(fv.g + 0.5f);
+			rgb[2] = (uint8_t)(fv.b + 0.5f);
+		}
+		flags[ind] = VOXEL_FULL;
+		WidenStoredRange(StoredBrick(i, j, k, ind), sdfs[ind]);
+	}
+	/* apply the sample at pixel (u,v) of one camera to a voxel at depth uvz from that camera */
+	static void FuseSample(const TSDFCameraView& view, int u, int v, float uvz, float truncMargin, float delta, FusedVoxel& fv) {
+		if ((int)view.matte[v * view.matteStep + (size_t)u * view.matteChannels] <= 200) return;
+		float depthMeasurement = (float)(view.pointcloud[3 * ((size_t)u + (size_t)v * view.width) + 2]) / 1000.f;
+		if (depthMeasurement <= 0 || depthMeasurement >= 3) return;
+
+		float distFromVoxelToSurfaceSample = depthMeasurement - uvz;
+		if (distFromVoxelToSurfaceSample <= -truncMargin) return;
+		float sdf;
+		if (fabs(distFromVoxelToSurfaceSample) >= delta) {
+			sdf = distFromVoxelToSurfaceSample;
+		}
+		else {
+			sdf = fminf(1.f, distFromVoxelToSurfaceSample / truncMargin);
+		}
+		float oldweight = fv.weight;
+		float newweight = oldweight + 1;
+		float weightSum = oldweight + newweight;
+		fv.d = (fv.d * oldweight + sdf) / newweight;
+		fv.weight = newweight;
+		fv.updated = true;
+		if (!fv.colored) return;
+		const uint8_t* col = &view.bgr[v * view.bgrStep + (size_t)u * 3];
+		fv.r = (oldweight * fv.r + newweight * col[2]) / weightSum;
+		fv.g = (oldweight * fv.g + newweight * col[1]) / weightSum;
+		fv.b = (oldweight * fv.b + newweight * col[0]) / weightSum;
+	}
+	/* build the projection table of one camera for this (dense) grid, see TSDFCameraProjection
+	- voxels behind the camera or further than the table depth range are left out
+	*/
+	void BuildProjection(const TSDFCameraView& view, TSDFCameraProjection& proj) {
+		int numRows = res[1] * res[2];
+		proj.res[0] = res[0];
+		proj.res[1] = res[1];
+		proj.res[2] = res[2];
+		proj.runStart.assign(numRows + 1, 0);
+		proj.runFirstI.assign(numRows, 0);
+		std::vector<int> runEnd(numRows, 0);
+		auto project = [&](int i, int j, int k, uint32_t& pix, uint16_t& z) {
+			Eigen::Vector3d c;
+			GetVoxelCoordsFromIndex(i, j, k, c);
+			Eigen::Vector4d cc;
+			Eigen::Vector3d pp = ProjectToCamera(view, c, cc);
+			int u = (int)pp(0);
+			int v = (int)pp(1);
+			float uvz = pp(2);
+			if (u <= 0 || u >= view.width || v <= 0 || v >= view.height || uvz <= 0 || uvz * TSDF_PROJ_DEPTH_SCALE >= 65535.f) return false;
+			pix = ((uint32_t)v << 16) | (uint32_t)u;
+			z = (uint16_t)lrintf(uvz * TSDF_PROJ_DEPTH_SCALE);
+			return true;
+		};
+		// pass 1: the run of every row
+#pragma omp parallel for schedule(dynamic)
+		for (int k = 0; k < res[2]; k++) {
+			for (int j = 0; j < res[1]; j++) {
+				int row = j + k * res[1];
+				int first = -1, last = -1;
 				for (int i = 0; i < res[0]; i++) {
-					Eigen::Vector3d c;
-					GetVoxelCoordsFromIndex(i, j, k, c);
-					get(i, j, k).c = c;
+					uint32_t pix;
+					uint16_t z;
+					if (!project(i, j, k, pix, z)) continue;
+					if (first < 0) first = i;
+					last = i;
+				}
+				proj.runFirstI[row] = std::max(first, 0);
+				runEnd[row] = last + 1;
+			}
+		}
+		for (int row = 0; row < numRows; row++) {
+			proj.runStart[row + 1] = proj.runStart[row] + (runEnd[row] - proj.runFirstI[row]);
+		}
+		proj.pixel.assign(proj.runStart[numRows], TSDF_PROJ_NO_PIXEL);
+		proj.depth.assign(proj.runStart[numRows], 0);
+		// pass 2: fill the runs
+#pragma omp parallel for schedule(dynamic)
+		for (int k = 0; k < res[2]; k++) {
+			for (int j = 0; j < res[1]; j++) {
+				int row = j + k * res[1];
+				int64_t e = proj.runStart[row];
+				for (int i = proj.runFirstI[row]; i < runEnd[row]; i++, e++) {
+					uint32_t pix;
+					uint16_t z;
+					if (project(i, j, k, pix, z)) {
+						proj.pixel[e] = pix;
+						proj.depth[e] = z;
+					}
 				}
 			}
 		}
 	}
-	void Smooth(int wSize) {
-		this->AllocateDense2();
-		// BUG: CAN't do it in place like this.... 
-		for (int k = wSize; k < res[2]-wSize; k++) {
-			for (int j = wSize; j < res[1]-wSize; j++) {
-				for (int i = wSize; i < res[0]-wSize; i++) {
-					int ind = IND2LINEAR(i, j, k, res[0], res[1], res[2]);
-					// compute distance from center of voxel to surface of the sphere 
-					if (grid[ind].flag != VOXEL_EMPTY) {
-						float sum = 0;
-						int num = 0;
-						for (int wi = -wSize; wi < wSize; wi++) {
-							for (int wj = -wSize; wj < wSize; wj++) {
-								for (int wk = -wSize; wk < wSize; wk++) {
-									int ind2 = IND2LINEAR(i + wi, j+wj, k+wk, res[0], res[1], res[2]);
-									//if (grid[ind2].flag != VOXEL_EMPTY) 
-									{
-										sum += grid[ind2].sdf;
-										num++;
-									}
-								}
-							}
-							
+
+	/* coarse to fine silhouette carving (visual hull), run before Integrate()
+	- octree nodes are projected to the bounding rectangle of their corner voxels in every camera, a node
+	  whose rectangle lies inside an image and holds no foreground pixel of that matte (summed area table)
+	  is marked VOXEL_EMPTY whole, the others are split down to single voxels
+	- a voxel is carved when its center lands on background in any image, Integrate() then leaves it alone
+	- the levels above the 8^3 bricks are walked breadth first, each surviving brick then depth first in parallel
+	  (sparse volumes start from their allocated blocks, incremental frames from the listed dense bricks)
+	- returns the number of carved voxels
+	*/
+	int64_t CarveSilhouettes(const std::vector<TSDFCameraView>& views, const std::vector<int>* onlyBricks = nullptr) {
+		std::vector<TSDFMatteSAT> sats(views.size());
+#pragma omp parallel for
+		for (int cam = 0; cam < (int)views.size(); cam++) {
+			BuildMatteSAT(views[cam], sats[cam]);
+		}
+		int64_t carved = 0;
+		std::vector<Eigen::Vector4i> bricks; // i0, j0, k0, size
+		if (onlyBricks && storage == TSDF_DENSE) {
+			for (int b : *onlyBricks) {
+				int o[3];
+				BrickOrigin(b, o[0], o[1], o[2]);
+				bricks.push_back(Eigen::Vector4i(o[0], o[1], o[2], TSDF_BLOCK_SIZE));
+			}
+		}
+		else if (storage == TSDF_SPARSE) {
+			for (int slot = 0; slot < NumAllocatedBlocks(); slot++) {
+				int o[3];
+				BrickOrigin(slot, o[0], o[1], o[2]);
+				bricks.push_back(Eigen::Vector4i(o[0], o[1], o[2], TSDF_BLOCK_SIZE));
+			}
+		}
+		else {
+			int size = TSDF_BLOCK_SIZE;
+			while (size < res[0] || size < res[1] || size < res[2]) size *= 2;
+			std::vector<Eigen::Vector4i> level(1, Eigen::Vector4i(0, 0, 0, size));
+			while (size > TSDF_BLOCK_SIZE) {
+				std::vector<Eigen::Vector4i> next;
+#pragma omp parallel
+				{
+					std::vector<Eigen::Vector4i> children;
+					int64_t carvedHere = 0;
+#pragma omp for schedule(dynamic)
+					for (int n = 0; n < (int)level.size(); n++) {
+						const Eigen::Vector4i& node = level[n];
+						if (NodeOutsideSilhouette(views, sats, node[0], node[1], node[2], node[3])) {
+							carvedHere += CarveRange(node[0], node[1], node[2], node[3]);
+							continue;
+						}
+						int h = node[3] / 2;
+						for (int c = 0; c < 8; c++) {
+							Eigen::Vector4i child(node[0] + (c & 1) * h, node[1] + ((c >> 1) & 1) * h, node[2] + (c >> 2) * h, h);
+							if (child[0] < res[0] && child[1] < res[1] && child[2] < res[2]) children.push_back(child);
 						}
-						float v = sum / num;
-						grid2[ind].sdf = v;
 					}
+#pragma omp critical
+					{
+						next.insert(next.end(), children.begin(), children.end());
+						carved += carvedHere;
+					}
+				}
+				level.swap(next);
+				size /= 2;
+			}
+			bricks.swap(level);
+		}
+#pragma omp parallel for schedule(dynamic) reduction(+:carved)
+		for (int n = 0; n < (int)bricks.size(); n++) {
+			carved += CarveNode(views, sats, bricks[n][0], bricks[n][1], bricks[n][2], bricks[n][3]);
+		}
+		bricksValid = false; // the stored ranges were kept by CarveRange()
+		return carved;
+	}
+	int64_t CarveNode(const std::vector<TSDFCameraView>& views, const std::vector<TSDFMatteSAT>& sats, int i0, int j0, int k0, int size) {
+		if (i0 >= res[0] || j0 >= res[1] || k0 >= res[2]) return 0;
+		if (NodeOutsideSilhouette(views, sats, i0, j0, k0, size)) return CarveRange(i0, j0, k0, size);
+		if (size == 1) return 0;
+		int h = size / 2;
+		int64_t carved = 0;
+		for (int c = 0; c < 8; c++) {
+			carved += CarveNode(views, sats, i0 + (c & 1) * h, j0 + ((c >> 1) & 1) * h, k0 + (c >> 2) * h, h);
+		}
+		return carved;
+	}
+	/* true if every voxel center of the node projects onto matte background in at least one image */
+	bool NodeOutsideSilhouette(const std::vector<TSDFCameraView>& views, const std::vector<TSDFMatteSAT>& sats, int i0, int j0, int k0, int size) {
+		int e[3] = { std::min(i0 + size, res[0]) - 1, std::min(j0 + size, res[1]) - 1, std::min(k0 + size, res[2]) - 1 };
+		Eigen::Vector3d lo, hi;
+		GetVoxelCoordsFromIndex(i0, j0, k0, lo);
+		GetVoxelCoordsFromIndex(e[0], e[1], e[2], hi);
+		for (size_t cam = 0; cam < views.size(); cam++) {
+			const TSDFCameraView& view = views[cam];
+			double uMin = 1e30, uMax = -1e30, vMin = 1e30, vMax = -1e30;
+			bool inFront = true;
+			for (int c = 0; c < 8 && inFront; c++) {
+				Eigen::Vector3d p((c & 1) ? hi[0] : lo[0], ((c >> 1) & 1) ? hi[1] : lo[1], (c >> 2) ? hi[2] : lo[2]);
+				Eigen::Vector4d cc;
+				Eigen::Vector3d proj = ProjectToCamera(view, p, cc);
+				if (proj(2) <= 0) inFront = false;
+				uMin = std::min(uMin, proj(0));
+				uMax = std::max(uMax, proj(0));
+				vMin = std::min(vMin, proj(1));
+				vMax = std::max(vMax, proj(1));
+			}
+			if (!inFront) continue; // the box may wrap around the camera, no conclusion from this view
+			// same pixel rounding as the per voxel test, the rectangle must be entirely inside the image
+			int u0 = (int)uMin, u1 = (int)uMax, v0 = (int)vMin, v1 = (int)vMax;
+			if (uMin < 1 || vMin < 1 || u1 >= view.width || v1 >= view.height) continue;
+			if (MatteForegroundCount(sats[cam], u0, v0, u1, v1) == 0) return true;
+		}
+		return false;
+	}
+	/* mark the voxels of a node empty (outside the object) */
+	int64_t CarveRange(int i0, int j0, int k0, int size) {
+		int64_t carved = 0;
+		for (int k = k0; k < std::min(k0 + size, res[2]); k++) {
+			for (int j = j0; j < std::min(j0 + size, res[1]); j++) {
+				for (int i = i0; i < std::min(i0 + size, res[0]); i++) {
+					int64_t ind = TouchVoxel(i, j, k);
+					if (ind < 0) continue;
+					flags[ind] = VOXEL_EMPTY;
+					SetSDF(ind, VOXEL_MAXDIST);
+					weights[ind] = 0;
+					WidenStoredRange(StoredBrick(i, j, k, ind), sdfs[ind]);
+					carved++;
 				}
 			}
 		}
+		return carved;
+	}
 
-		for (int k = wSize; k < res[2] - wSize; k++) {
-			for (int j = wSize; j < res[1] - wSize; j++) {
-				for (int i = wSize; i < res[0] - wSize; i++) {
-					int ind = IND2LINEAR(i, j, k, res[0], res[1], res[2]);
-					if (grid[ind].flag != VOXEL_EMPTY) {
-						grid[ind].sdf = grid[ind].sdf*0.2 + 0.8*(grid2[ind].sdf);
+	/* smooth the sdf inside the truncation band (VOXEL_FULL voxels)
+	- separable box filter of radius wSize, three 1-D rolling sum passes (x, y, z) so the cost does not depend on wSize
+	- repeating it (passes > 1) approaches a gaussian, 3 passes is already close
+	- VOXEL_EMPTY voxels are neither updated nor sampled (normalised convolution over the non empty voxels)
+	- works a brick at a time on a tile with a wSize halo, bricks run in parallel and write to a copy of
+	  the sdf channel, so every voxel is filtered from the unsmoothed values
+	- the smoothed value is blended with the original (80% smoothed) as before
+	*/
+	void Smooth(int wSize, int passes = 1) {
+		if (wSize <= 0) return;
+		for (int pass = 0; pass < passes; pass++) {
+			// bricks that hold part of the band
+			std::vector<int> bricks;
+			int numBricks = (storage == TSDF_SPARSE) ? NumAllocatedBlocks() : blockRes[0] * blockRes[1] * blockRes[2];
+			for (int b = 0; b < numBricks; b++) {
+				if (BrickHasFlag(b, VOXEL_FULL)) bricks.push_back(b);
+			}
+			std::vector<int16_t> smoothed(sdfs.begin(), sdfs.end());
+			int T = TSDF_BLOCK_SIZE + 2 * wSize; // tile size with halo
+#pragma omp parallel
+			{
+				std::vector<float> val((size_t)T * T * T), msk((size_t)T * T * T);
+				std::vector<float> lineV(T), lineM(T);
+#pragma omp for schedule(dynamic)
+				for (int q = 0; q < (int)bricks.size(); q++) {
+					int o[3];
+					BrickOrigin(bricks[q], o[0], o[1], o[2]);
+					for (int z = 0; z < T; z++)
+						for (int y = 0; y < T; y++)
+							GatherRow(o[0] - wSize, T, o[1] - wSize + y, o[2] - wSize + z, &val[IND2LINEAR((size_t)0, y, z, T, T, T)], &msk[IND2LINEAR((size_t)0, y, z, T, T, T)]);
+					// x over every row, y over the rows still needed by z, z over the core only
+					for (int z = 0; z < T; z++)
+						for (int y = 0; y < T; y++)
+							BoxFilterLine(&val[IND2LINEAR((size_t)0, y, z, T, T, T)], &msk[IND2LINEAR((size_t)0, y, z, T, T, T)], 1, T, wSize, lineV.data(), lineM.data());
+					for (int z = 0; z < T; z++)
+						for (int x = wSize; x < T - wSize; x++)
+							BoxFilterLine(&val[IND2LINEAR((size_t)x, 0, z, T, T, T)], &msk[IND2LINEAR((size_t)x, 0, z, T, T, T)], T, T, wSize, lineV.data(), lineM.data());
+					for (int y = wSize; y < T - wSize; y++)
+						for (int x = wSize; x < T - wSize; x++)
+							BoxFilterLine(&val[IND2LINEAR((size_t)x, y, 0, T, T, T)], &msk[IND2LINEAR((size_t)x, y, 0, T, T, T)], T * T, T, wSize, lineV.data(), lineM.data());
+					// write back the band voxels of the brick core
+					for (int z = 0; z < TSDF_BLOCK_SIZE; z++) {
+						for (int y = 0; y < TSDF_BLOCK_SIZE; y++) {
+							for (int x = 0; x < TSDF_BLOCK_SIZE; x++) {
+								int i = o[0] + x, j = o[1] + y, k = o[2] + z;
+								if (i >= res[0] || j >= res[1] || k >= res[2]) continue;
+								int64_t ind = VoxelIndex(i, j, k);
+								if (ind < 0 || GetFlag(ind) != VOXEL_FULL) continue;
+								size_t t = IND2LINEAR((size_t)x + wSize, y + wSize, z + wSize, T, T, T);
+								if (msk[t] <= 0) continue;
+								smoothed[ind] = EncodeSDF(GetSDF(ind) * 0.2f + 0.8f * (val[t] / msk[t]));
+								WidenStoredRange(bricks[q], smoothed[ind]);
+							}
+						}
 					}
 				}
 			}
+			sdfs.swap(smoothed);
 		}
-
-
+		bricksValid = false; // the stored ranges still hold the unsmoothed values too, wider but never narrower
+	}
+	/* voxel origin of brick b (dense: block grid linear index, sparse: slot) */
+	void BrickOrigin(int b, int& i0, int& j0, int& k0) {
+		int bi, bj, bk;
+		if (storage == TSDF_SPARSE) {
+			GetBlockCoords(b, bi, bj, bk);
+		}
+		else {
+			bi = b % blockRes[0];
+			bj = (b / blockRes[0]) % blockRes[1];
+			bk = b / (blockRes[0] * blockRes[1]);
+		}
+		i0 = bi << TSDF_BLOCK_SHIFT;
+		j0 = bj << TSDF_BLOCK_SHIFT;
+		k0 = bk << TSDF_BLOCK_SHIFT;
+	}
+	bool BrickHasFlag(int b, int flag) {
+		if (storage == TSDF_SPARSE) {
+			const uint8_t* f = &flags[(size_t)b * TSDF_BLOCK_VOXELS];
+			return std::find(f, f + TSDF_BLOCK_VOXELS, (uint8_t)flag) != f + TSDF_BLOCK_VOXELS;
+		}
+		if (!BrickLive(b)) return background.flag == flag;
+		int o[3];
+		BrickOrigin(b, o[0], o[1], o[2]);
+		int n = std::min(TSDF_BLOCK_SIZE, res[0] - o[0]);
+		for (int k = o[2]; k < std::min(o[2] + TSDF_BLOCK_SIZE, res[2]); k++) {
+			for (int j = o[1]; j < std::min(o[1] + TSDF_BLOCK_SIZE, res[1]); j++) {
+				const uint8_t* f = &flags[IND2LINEAR((size_t)o[0], j, k, res[0], res[1], res[2])];
+				if (std::find(f, f + n, (uint8_t)flag) != f + n) return true;
+			}
+		}
+		return false;
+	}
+	/* sdf and sample mask of voxels (i0..i0+n-1, j, k), the mask is 0 outside the volume and on VOXEL_EMPTY */
+	void GatherRow(int i0, int n, int j, int k, float* val, float* msk) {
+		bool rowInside = (j >= 0 && k >= 0 && j < res[1] && k < res[2]);
+		int lastBlock = INT32_MIN;
+		int64_t blockBase = -1;
+		for (int x = 0; x < n; x++) {
+			int i = i0 + x;
+			val[x] = 0;
+			msk[x] = 0;
+			if (!rowInside || i < 0 || i >= res[0]) continue;
+			int64_t ind;
+			if ((i >> TSDF_BLOCK_SHIFT) != lastBlock) {
+				lastBlock = i >> TSDF_BLOCK_SHIFT;
+				if (storage == TSDF_DENSE) {
+					blockBase = BrickLive(DenseBrick(i, j, k)) ? 0 : -1;
+				}
+				else {
+					int slot = FindBlock(lastBlock, j >> TSDF_BLOCK_SHIFT, k >> TSDF_BLOCK_SHIFT);
+					blockBase = (slot < 0) ? -1 : (int64_t)slot * TSDF_BLOCK_VOXELS;
+				}
+			}
+			if (blockBase < 0) { // background
+				val[x] = background.sdf;
+				msk[x] = 1;
+				continue;
+			}
+			if (storage == TSDF_DENSE) {
+				ind = IND2LINEAR((int64_t)i, j, k, res[0], res[1], res[2]);
+			}
+			else {
+				ind = blockBase + IND2LINEAR(i & TSDF_BLOCK_MASK, j & TSDF_BLOCK_MASK, k & TSDF_BLOCK_MASK, TSDF_BLOCK_SIZE, TSDF_BLOCK_SIZE, TSDF_BLOCK_SIZE);
+			}
+			if (flags[ind] == VOXEL_EMPTY) continue;
+			val[x] = GetSDF(ind);
+			msk[x] = 1;
+		}
+	}
+	/* in place rolling box sum of radius r over n samples spaced stride apart (values and mask together) */
+	static void BoxFilterLine(float* v, float* m, int stride, int n, int r, float* tmpV, float* tmpM) {
+		for (int x = 0; x < n; x++) {
+			tmpV[x] = v[(size_t)x * stride];
+			tmpM[x] = m[(size_t)x * stride];
+		}
+		float sumV = 0, sumM = 0;
+		for (int x = 0; x < std::min(r, n); x++) {
+			sumV += tmpV[x];
+			sumM += tmpM[x];
+		}
+		for (int x = 0; x < n; x++) {
+			if (x + r < n) { sumV += tmpV[x + r]; sumM += tmpM[x + r]; }
+			if (x - r - 1 >= 0) { sumV -= tmpV[x - r - 1]; sumM -= tmpM[x - r - 1]; }
+			v[(size_t)x * stride] = sumV;
+			m[(size_t)x * stride] = sumM;
+		}
+	}
+	/* per brick sdf range, used to skip bricks that cannot contain the surface during extraction
+	- a brick is the 8x8x8 cells of a block, its range covers every voxel those cells read
+	  (the +1 layer, and the -1 layer too when sparse since blocks also own cells reaching back into unallocated neighbours)
+	- it is put together from the stored ranges of the brick and its neighbours: the range of the voxels a brick (block when
+	  sparse) holds, widened as they are written (StoreFused, CarveRange, Smooth) and restarted at the background when the
+	  brick is cleared or allocated, so an extraction after Integrate() reads a few ranges per brick instead of every voxel
+	- a stored range only grows until the brick is cleared again, it can be wider than the voxels but never narrower
+	- anything that writes sdfs without going through the methods of this class (VolumePyramid, a mapped volume file) must
+	  call InvalidateBrickRanges(), the stored ranges are then rescanned from the voxels by the next extraction
+	*/
+	void InvalidateBrickRanges() {
+		bricksValid = false;
+		storedRangesValid = false;
+	}
+	void UpdateBrickRanges() {
+		if (!storedRangesValid) RescanStoredRanges();
+		int numBricks = (storage == TSDF_SPARSE) ? NumAllocatedBlocks() : blockRes[0] * blockRes[1] * blockRes[2];
+		brickMin.resize(numBricks);
+		brickMax.resize(numBricks);
+#pragma omp parallel for schedule(dynamic, 256)
+		for (int b = 0; b < numBricks; b++) {
+			UpdateBrickRange(b);
+		}
+		bricksValid = true;
+	}
+	/* dense: recompute the ranges of the listed bricks only, the other bricks' ranges must still be current */
+	void UpdateBrickRanges(const std::vector<int>& bricks) {
+		if (storage == TSDF_SPARSE || !storedRangesValid || brickMin.size() != (size_t)blockRes[0] * blockRes[1] * blockRes[2]) {
+			UpdateBrickRanges();
+			return;
+		}
+#pragma omp parallel for schedule(dynamic, 256)
+		for (int n = 0; n < (int)bricks.size(); n++) {
+			UpdateBrickRange(bricks[n]);
+		}
+		bricksValid = true;
+	}
+	/* range of brick b from the stored ranges it reads: its own, the 7 bricks of the +1 layer (dense) or all 26 neighbours (sparse) */
+	void UpdateBrickRange(int b) {
+		int bi, bj, bk;
+		if (storage == TSDF_SPARSE) GetBlockCoords(b, bi, bj, bk);
+		else bi = b % blockRes[0], bj = (b / blockRes[0]) % blockRes[1], bk = b / (blockRes[0] * blockRes[1]);
+		int d0 = (storage == TSDF_SPARSE) ? -1 : 0;
+		int16_t lo = 32767, hi = -32767;
+		for (int dk = d0; dk <= 1; dk++) {
+			for (int dj = d0; dj <= 1; dj++) {
+				for (int di = d0; di <= 1; di++) {
+					int ni = bi + di, nj = bj + dj, nk = bk + dk;
+					if (ni < 0 || nj < 0 || nk < 0 || ni >= blockRes[0] || nj >= blockRes[1] || nk >= blockRes[2]) continue;
+					int n = (storage == TSDF_SPARSE) ? FindBlock(ni, nj, nk) : IND2LINEAR(ni, nj, nk, blockRes[0], blockRes[1], blockRes[2]);
+					if (n < 0 || (storage == TSDF_DENSE && !BrickLive(n))) {
+						// unallocated blocks and stale bricks read as background
+						lo = std::min(lo, EncodeSDF(background.sdf));
+						hi = std::max(hi, EncodeSDF(background.sdf));
+						continue;
+					}
+					lo = std::min(lo, storedMin[n].load(std::memory_order_relaxed));
+					hi = std::max(hi, storedMax[n].load(std::memory_order_relaxed));
+				}
+			}
+		}
+		brickMin[b] = DecodeSDF(lo);
+		brickMax[b] = DecodeSDF(hi);
+	}
+	/* brick whose stored range covers voxel (i,j,k) at address ind (dense: block grid linear index, sparse: slot) */
+	int StoredBrick(int i, int j, int k, int64_t ind) {
+		return (storage == TSDF_SPARSE) ? (int)(ind / TSDF_BLOCK_VOXELS) : DenseBrick(i, j, k);
+	}
+	void ResetStoredRange(int b) {
+		storedMin[b].store(EncodeSDF(background.sdf), std::memory_order_relaxed);
+		storedMax[b].store(EncodeSDF(background.sdf), std::memory_order_relaxed);
+	}
+	/* widen the stored range of brick b by the encoded sdf q (thread safe, bricks are shared by the z slabs of dense integration) */
+	void WidenStoredRange(int b, int16_t q) {
+		int16_t lo = storedMin[b].load(std::memory_order_relaxed);
+		while (q < lo && !storedMin[b].compare_exchange_weak(lo, q, std::memory_order_relaxed)) {}
+		int16_t hi = storedMax[b].load(std::memory_order_relaxed);
+		while (q > hi && !storedMax[b].compare_exchange_weak(hi, q, std::memory_order_relaxed)) {}
+	}
+	/* stored ranges from the voxels themselves, after writes that bypassed them (see InvalidateBrickRanges) */
+	void RescanStoredRanges() {
+		int numBricks = (storage == TSDF_SPARSE) ? NumAllocatedBlocks() : blockRes[0] * blockRes[1] * blockRes[2];
+#pragma omp parallel for schedule(dynamic, 16)
+		for (int b = 0; b < numBricks; b++) {
+			int16_t lo = 32767, hi = -32767;
+			if (storage == TSDF_SPARSE) {
+				const int16_t* q = &sdfs[(size_t)b * TSDF_BLOCK_VOXELS];
+				for (int v = 0; v < TSDF_BLOCK_VOXELS; v++) {
+					lo = std::min(lo, q[v]);
+					hi = std::max(hi, q[v]);
+				}
+			}
+			else {
+				if (!BrickLive(b)) continue; // restarted by TouchBrick() when it is written
+				int o[3];
+				BrickOrigin(b, o[0], o[1], o[2]);
+				int n = std::min(TSDF_BLOCK_SIZE, res[0] - o[0]);
+				for (int k = o[2]; k < std::min(o[2] + TSDF_BLOCK_SIZE, res[2]); k++) {
+					for (int j = o[1]; j < std::min(o[1] + TSDF_BLOCK_SIZE, res[1]); j++) {
+						const int16_t* q = &sdfs[IND2LINEAR((size_t)o[0], j, k, res[0], res[1], res[2])];
+						for (int i = 0; i < n; i++) {
+							lo = std::min(lo, q[i]);
+							hi = std::max(hi, q[i]);
+						}
+					}
+				}
+			}
+			storedMin[b].store(lo, std::memory_order_relaxed);
+			storedMax[b].store(hi, std::memory_order_relaxed);
+		}
+		storedRangesValid = true;
+	}
+	/* brick b (dense: block grid linear index, sparse: slot) may contain the isosurface */
+	bool BrickIsActive(int b, float isolevel) {
+		return brickMin[b] < isolevel && brickMax[b] >= isolevel;
 	}
 	void GetVoxelCoordsFromIndex(int i, int j, int k, Eigen::Vector3d& vCenter) {
 	//	int ind = IND2LINEAR(i, j, k, res[0], res[1], res[2]);
@@ -167,6 +1032,17 @@ public:
 		vCenter[2] = ((((float)(k) / (float)res[2])-0.5f) * sz[2]) + vSize[2]/2 + center[2];
 		//std::cout << "("<<vCenter[0]<<","<<vCenter[1]<<","<<vCenter[2]<<")" << std::endl;
 	}
+	/* dense volumes only: sdf of the voxel at linear index ind */
+	float GetSDFLinear(int ind) {
+		return GetSDF(ind % res[0], (ind / res[0]) % res[1], ind / (res[0] * res[1]));
+	}
+	/* dense volumes only: center of the voxel at linear index ind */
+	void GetVoxelCoordsFromLinear(int ind, Eigen::Vector3d& vCenter) {
+		int i = ind % res[0];
+		int j = (ind / res[0]) % res[1];
+		int k = ind / (res[0] * res[1]);
+		GetVoxelCoordsFromIndex(i, j, k, vCenter);
+	}
 	void GetVoxelCornersFromIndex(int i, int j, int k, std::vector<Eigen::Vector3d> &corners) {
 		// get center 
 		Eigen::Vector3d c;
@@ -188,17 +1064,40 @@ public:
 
 
 	}
-	Voxel& get(int i, int j, int k) {
-		int ind = IND2LINEAR(i, j, k, res[0], res[1], res[2]);
-		return this->grid[ind];
+	/* unpacked copy of voxel (i,j,k)
+	   - in sparse mode voxels in unallocated blocks return the background voxel
+	   - use VoxelIndex() and the Set* accessors when updating voxels */
+	Voxel get(int i, int j, int k) {
+		int64_t ind = VoxelIndex(i, j, k);
+		if (ind < 0) return background;
+		Voxel v;
+		v.flag = GetFlag(ind);
+		v.sdf = GetSDF(ind);
+		v.weight = GetWeight(ind);
+		if (!voxelColors) {
+			v.r = v.g = v.b = background.r;
+			return v;
+		}
+		uint8_t* rgb = GetColor(ind);
+		v.r = rgb[0];
+		v.g = rgb[1];
+		v.b = rgb[2];
+		return v;
 	}
 
 	void set(int i, int j, int k, int flag) {
-		Voxel &v=get(i, j, k);
-		v.flag = flag;
+		int64_t ind = TouchVoxel(i, j, k);
+		if (ind >= 0) SetFlag(ind, flag);
 	}
 
 
+	/* fraction of the way from valp1 to valp2 where the sdf crosses isolevel
+	- the cells are classified against isolevel, so the crossing lies on the edge; rounding is kept from pushing it off
+	*/
+	static double EdgeCrossing(double isolevel, float valp1, float valp2) {
+		double mu = (isolevel - valp1) / ((double)valp2 - valp1);
+		return std::min(std::max(mu, 0.0), 1.0);
+	}
 	/*
 	   Linearly interpolate the position where an isosurface cuts
 	   an edge between two vertices, each with their own scalar value
@@ -214,7 +1113,7 @@ public:
 		//	return(p2);
 		//if (fabs(valp1 - valp2) < isolevel)
 		//	return(p1);
-		mu = (-valp1) / (valp2 - valp1);
+		mu = EdgeCrossing(isolevel, valp1, valp2);
 		p(0) = p1(0) + mu * (p2(0) - p1(0));
 		p(1) = p1(1) + mu * (p2(1) - p1(1));
 		p(2) = p1(2) + mu * (p2(2) - p1(2));
@@ -250,18 +1149,19 @@ public:
 	}
 	void PolygoniseTri(int ii0, int ii1, int ii2, int ii3, float isolevel, std::vector<TRIANGLE> &triangles) {
 		/* sample the grid here */
-		float val0 = grid[ii0].sdf;
-		float val1 = grid[ii1].sdf;
-		float val2 = grid[ii2].sdf;
-		float val3 = grid[ii3].sdf;
+		float val0 = GetSDFLinear(ii0);
+		float val1 = GetSDFLinear(ii1);
+		float val2 = GetSDFLinear(ii2);
+		float val3 = GetSDFLinear(ii3);
 		
 		
 
 		// the centers of each voxel
-		Eigen::Vector3d p0 = grid[ii0].c;
-		Eigen::Vector3d p1 = grid[ii1].c;
-		Eigen::Vector3d p2 = grid[ii2].c;
-		Eigen::Vector3d p3 = grid[ii3].c;
+		Eigen::Vector3d p0, p1, p2, p3;
+		GetVoxelCoordsFromLinear(ii0, p0);
+		GetVoxelCoordsFromLinear(ii1, p1);
+		GetVoxelCoordsFromLinear(ii2, p2);
+		GetVoxelCoordsFromLinear(ii3, p3);
 
 
 		TRIANGLE t0, t1;
@@ -569,96 +1469,741 @@ public:
 		}
 	}
 
+	/* marching tetrahedra (six per cell), dense volumes only
+	- parallel over z slabs of cells like PolygoniseMC, only the active cells (see ForEachActiveCell) are split,
+	  the tetrahedra of a cell use its corners only so a cell all on one side of the isolevel has no triangles
+	*/
 	int Polygonise(float isolevel, std::vector<TRIANGLE> &triangles) {
 		int numTris = 0;
-		for (int i =0; i < res[0]-1;i++) {
-			for (int j = 0; j < res[1]-1; j++) {
-				for (int k = 0; k < res[2]-1; k++) {
-					// polygonize this cell
-					// probably want to check the flag to see if we've carved it or not
-					int indices[24]; // 0 2 3 7
-					indices[0] = IND2LINEAR(i+0, j+0, k+0, res[0], res[1], res[2]);
-					indices[1] = IND2LINEAR(i+1, j+0, k+1, res[0], res[1], res[2]);
-					indices[2] = IND2LINEAR(i+0, j+0, k+1, res[0], res[1], res[2]);
-					indices[3] = IND2LINEAR(i+0, j+1, k+1, res[0], res[1], res[2]);
-
-					// 0 2 6 7
-					indices[4] = IND2LINEAR(i + 0, j + 0, k + 0, res[0], res[1], res[2]);
-					indices[5] = IND2LINEAR(i + 1, j + 0, k + 1, res[0], res[1], res[2]);
-					indices[6] = IND2LINEAR(i + 1, j + 1, k + 1, res[0], res[1], res[2]);
-					indices[7] = IND2LINEAR(i + 0, j + 1, k + 1, res[0], res[1], res[2]);
-
-					// 0 4 6 7
-					indices[8]  = IND2LINEAR(i + 0, j + 0, k + 0, res[0], res[1], res[2]);
-					indices[9]  = IND2LINEAR(i + 0, j + 1, k + 0, res[0], res[1], res[2]);
-					indices[10] = IND2LINEAR(i + 1, j + 1, k + 1, res[0], res[1], res[2]);
-					indices[11] = IND2LINEAR(i + 0, j + 1, k + 1, res[0], res[1], res[2]);
-
-					// 0 6 1 2
-					indices[12] = IND2LINEAR(i + 0, j + 0, k + 0, res[0], res[1], res[2]);
-					indices[13] = IND2LINEAR(i + 1, j + 1, k + 1, res[0], res[1], res[2]);
-					indices[14] = IND2LINEAR(i + 1, j + 0, k + 0, res[0], res[1], res[2]);
-					indices[15] = IND2LINEAR(i + 1, j + 0, k + 1, res[0], res[1], res[2]);
-
-					// 0 6 1 4
-					indices[16] = IND2LINEAR(i + 0, j + 0, k + 0, res[0], res[1], res[2]);
-					indices[17] = IND2LINEAR(i + 1, j + 1, k + 1, res[0], res[1], res[2]);
-					indices[18] = IND2LINEAR(i + 1, j + 0, k + 0, res[0], res[1], res[2]);
-					indices[19] = IND2LINEAR(i + 0, j + 1, k + 0, res[0], res[1], res[2]);
-
-					// 5 6 1 4
-					indices[20] = IND2LINEAR(i + 1, j + 1, k + 0, res[0], res[1], res[2]);
-					indices[21] = IND2LINEAR(i + 1, j + 1, k + 1, res[0], res[1], res[2]);
-					indices[22] = IND2LINEAR(i + 1, j + 0, k + 0, res[0], res[1], res[2]);
-					indices[23] = IND2LINEAR(i + 0, j + 1, k + 0, res[0], res[1], res[2]);
-
-
-					PolygoniseTri(indices[0], indices[1], indices[2], indices[3], isolevel, triangles);
-					PolygoniseTri(indices[4], indices[5], indices[6], indices[7], isolevel, triangles);
-					PolygoniseTri(indices[8], indices[9], indices[10], indices[11], isolevel, triangles);
-					PolygoniseTri(indices[12], indices[13], indices[14], indices[15], isolevel, triangles);
-					PolygoniseTri(indices[16], indices[17], indices[18], indices[19], isolevel, triangles);
-					PolygoniseTri(indices[20], indices[21], indices[22], indices[23], isolevel, triangles);
-				}
-			}
+		if (storage == TSDF_SPARSE) {
+			std::cout << "MC: Polygonise() (tetrahedral) is only implemented for dense volumes, use PolygoniseMC()" << std::endl;
+			return 0;
 		}
+		if (!bricksValid) UpdateBrickRanges();
+		std::vector<std::vector<TRIANGLE>> slabTris(std::max(res[2] - 1, 0));
+#pragma omp parallel for schedule(dynamic)
+		for (int s = 0; s < res[2] - 1; s++) {
+			ForEachActiveCell(isolevel, s, [&](int i, int j, int k) {
+				PolygoniseCellTets(isolevel, slabTris[s], i, j, k);
+			});
+		}
+		AppendSlabs(slabTris, triangles);
 		numTris = triangles.size();
 		std::cout << "MC: NumTris:" << numTris << std::endl;
 		return numTris;
 	}
+	void PolygoniseCellTets(float isolevel, std::vector<TRIANGLE> &triangles, int i, int j, int k) {
+		// polygonize this cell
+		// probably want to check the flag to see if we've carved it or not
+		int indices[24]; // 0 2 3 7
+		indices[0] = IND2LINEAR(i+0, j+0, k+0, res[0], res[1], res[2]);
+		indices[1] = IND2LINEAR(i+1, j+0, k+1, res[0], res[1], res[2]);
+		indices[2] = IND2LINEAR(i+0, j+0, k+1, res[0], res[1], res[2]);
+		indices[3] = IND2LINEAR(i+0, j+1, k+1, res[0], res[1], res[2]);
+
+		// 0 2 6 7
+		indices[4] = IND2LINEAR(i + 0, j + 0, k + 0, res[0], res[1], res[2]);
+		indices[5] = IND2LINEAR(i + 1, j + 0, k + 1, res[0], res[1], res[2]);
+		indices[6] = IND2LINEAR(i + 1, j + 1, k + 1, res[0], res[1], res[2]);
+		indices[7] = IND2LINEAR(i + 0, j + 1, k + 1, res[0], res[1], res[2]);
+
+		// 0 4 6 7
+		indices[8]  = IND2LINEAR(i + 0, j + 0, k + 0, res[0], res[1], res[2]);
+		indices[9]  = IND2LINEAR(i + 0, j + 1, k + 0, res[0], res[1], res[2]);
+		indices[10] = IND2LINEAR(i + 1, j + 1, k + 1, res[0], res[1], res[2]);
+		indices[11] = IND2LINEAR(i + 0, j + 1, k + 1, res[0], res[1], res[2]);
+
+		// 0 6 1 2
+		indices[12] = IND2LINEAR(i + 0, j + 0, k + 0, res[0], res[1], res[2]);
+		indices[13] = IND2LINEAR(i + 1, j + 1, k + 1, res[0], res[1], res[2]);
+		indices[14] = IND2LINEAR(i + 1, j + 0, k + 0, res[0], res[1], res[2]);
+		indices[15] = IND2LINEAR(i + 1, j + 0, k + 1, res[0], res[1], res[2]);
+
+		// 0 6 1 4
+		indices[16] = IND2LINEAR(i + 0, j + 0, k + 0, res[0], res[1], res[2]);
+		indices[17] = IND2LINEAR(i + 1, j + 1, k + 1, res[0], res[1], res[2]);
+		indices[18] = IND2LINEAR(i + 1, j + 0, k + 0, res[0], res[1], res[2]);
+		indices[19] = IND2LINEAR(i + 0, j + 1, k + 0, res[0], res[1], res[2]);
+
+		// 5 6 1 4
+		indices[20] = IND2LINEAR(i + 1, j + 1, k + 0, res[0], res[1], res[2]);
+		indices[21] = IND2LINEAR(i + 1, j + 1, k + 1, res[0], res[1], res[2]);
+		indices[22] = IND2LINEAR(i + 1, j + 0, k + 0, res[0], res[1], res[2]);
+		indices[23] = IND2LINEAR(i + 0, j + 1, k + 0, res[0], res[1], res[2]);
+
+
+		PolygoniseTri(indices[0], indices[1], indices[2], indices[3], isolevel, triangles);
+		PolygoniseTri(indices[4], indices[5], indices[6], indices[7], isolevel, triangles);
+		PolygoniseTri(indices[8], indices[9], indices[10], indices[11], isolevel, triangles);
+		PolygoniseTri(indices[12], indices[13], indices[14], indices[15], isolevel, triangles);
+		PolygoniseTri(indices[16], indices[17], indices[18], indices[19], isolevel, triangles);
+		PolygoniseTri(indices[20], indices[21], indices[22], indices[23], isolevel, triangles);
+	}
 
+	/* marching cubes, parallel over z slabs of cells (over blocks when sparse)
+	- every slab fills its own triangle list, the lists are appended in slab order afterwards
+	  so the output is the same whatever the number of threads
+	- only the active cells (see ForEachActiveCell) go through the edge/triangle tables
+	*/
 	int PolygoniseMC(float isolevel, std::vector<TRIANGLE>& triangles) {
 		int numTris = 0;
-		for (int i = 0; i < res[0] - 1; i++) {
-			for (int j = 0; j < res[1] - 1; j++) {
-				for (int k = 0; k < res[2] - 1; k++) {
-					int ind = IND2LINEAR(i + 0, j + 0, k + 0, res[0], res[1], res[2]);
-					PolygoniseCellMC(isolevel, triangles, i,j,k);
-				}
-			}
+		int numSlabs = (storage == TSDF_SPARSE) ? NumAllocatedBlocks() : res[2] - 1;
+		if (!bricksValid) UpdateBrickRanges();
+		std::vector<std::vector<TRIANGLE>> slabTris(std::max(numSlabs, 0));
+#pragma omp parallel for schedule(dynamic)
+		for (int s = 0; s < numSlabs; s++) {
+			ForEachActiveCell(isolevel, s, [&](int i, int j, int k) {
+				PolygoniseCellMC(isolevel, slabTris[s], i, j, k);
+			});
 		}
+		AppendSlabs(slabTris, triangles);
 		numTris = triangles.size();
 		//std::cout << "MC: NumTris:" << numTris << std::endl;
 		return numTris;
 	}
+	/* concatenate per-slab results onto out, in slab order */
+	template <typename T>
+	static void AppendSlabs(std::vector<std::vector<T>>& slabs, std::vector<T>& out) {
+		std::vector<size_t> offsets(slabs.size() + 1);
+		offsets[0] = out.size();
+		for (size_t s = 0; s < slabs.size(); s++) offsets[s + 1] = offsets[s] + slabs[s].size();
+		out.resize(offsets.back());
+#pragma omp parallel for schedule(dynamic)
+		for (int s = 0; s < (int)slabs.size(); s++) {
+			std::copy(slabs[s].begin(), slabs[s].end(), out.begin() + offsets[s]);
+			std::vector<T>().swap(slabs[s]);
+		}
+	}
+	/* calls fn(i,j,k) for every cell of slab s that crosses the isosurface (cube index not 0 or 255)
+	- dense: slab s is the cell layer k = s, sparse: slab s is the block in that slot
+	- bricks whose sdf range does not straddle the isolevel are skipped whole (needs valid brick ranges),
+	  the others are classified a row of cells at a time from inside/outside masks of the 4 voxel rows
+	- sparse: a cell is visited by every block that holds one of its 8 corners, it belongs to the
+	  block of the first allocated corner (in corner order) so boundary cells are visited exactly once
+	*/
+	template <typename F>
+	void ForEachActiveCell(float isolevel, int s, F fn) {
+		uint8_t cube[TSDF_BLOCK_SIZE + 1];
+		if (storage == TSDF_SPARSE) {
+			if (!BrickIsActive(s, isolevel)) return;
+			int bi, bj, bk;
+			GetBlockCoords(s, bi, bj, bk);
+			int i0 = bi << TSDF_BLOCK_SHIFT, j0 = bj << TSDF_BLOCK_SHIFT, k0 = bk << TSDF_BLOCK_SHIFT;
+			int ib = std::max(i0 - 1, 0), ie = std::min(i0 + TSDF_BLOCK_SIZE, res[0] - 1);
+			for (int k = std::max(k0 - 1, 0); k < std::min(k0 + TSDF_BLOCK_SIZE, res[2] - 1); k++) {
+				for (int j = std::max(j0 - 1, 0); j < std::min(j0 + TSDF_BLOCK_SIZE, res[1] - 1); j++) {
+					ClassifyCellRow(isolevel, ib, ie - ib, j, k, cube);
+					for (int x = 0; x < ie - ib; x++) {
+						if (cube[x] == 0 || cube[x] == 255) continue;
+						if (CellOwner(ib + x, j, k) == s) fn(ib + x, j, k);
+					}
+				}
+			}
+			return;
+		}
+		int k = s;
+		int bk = k >> TSDF_BLOCK_SHIFT;
+		for (int bj = 0; bj < blockRes[1]; bj++) {
+			for (int bi = 0; bi < blockRes[0]; bi++) {
+				ForEachActiveCellOfBrick(isolevel, IND2LINEAR(bi, bj, bk, blockRes[0], blockRes[1], blockRes[2]), k, k + 1, fn);
+			}
+		}
+	}
+	/* dense: calls fn(i,j,k) for the active cells of brick b in the cell layers kBegin..kEnd-1 (inside the brick) */
+	template <typename F>
+	void ForEachActiveCellOfBrick(float isolevel, int b, int kBegin, int kEnd, F fn) {
+		if (!BrickIsActive(b, isolevel)) return;
+		uint8_t cube[TSDF_BLOCK_SIZE + 1];
+		int o[3];
+		BrickOrigin(b, o[0], o[1], o[2]);
+		int ie = std::min(o[0] + TSDF_BLOCK_SIZE, res[0] - 1);
+		int je = std::min(o[1] + TSDF_BLOCK_SIZE, res[1] - 1);
+		for (int k = kBegin; k < kEnd; k++) {
+			for (int j = o[1]; j < je; j++) {
+				ClassifyCellRow(isolevel, o[0], ie - o[0], j, k, cube);
+				for (int x = 0; x < ie - o[0]; x++) {
+					if (cube[x] != 0 && cube[x] != 255) fn(o[0] + x, j, k);
+				}
+			}
+		}
+	}
+	/* cube index of the n cells (i0+x,j,k), x in [0,n), from the inside masks of their 4 voxel rows (n <= TSDF_BLOCK_SIZE + 1) */
+	void ClassifyCellRow(float isolevel, int i0, int n, int j, int k, uint8_t* cube) {
+		uint8_t m[4][TSDF_BLOCK_SIZE + 2]; // inside masks of rows (j,k) (j+1,k) (j,k+1) (j+1,k+1)
+		for (int r = 0; r < 4; r++) RowInsideMask(i0, n + 1, j + (r & 1), k + (r >> 1), isolevel, m[r]);
+		for (int x = 0; x < n; x++) {
+			cube[x] = (uint8_t)(m[0][x] | (m[0][x + 1] << 1) | (m[2][x + 1] << 2) | (m[2][x] << 3) |
+				(m[1][x] << 4) | (m[1][x + 1] << 5) | (m[3][x + 1] << 6) | (m[3][x] << 7));
+		}
+	}
+	/* out[x] = 1 if voxel (i0+x,j,k) is inside (sdf < isolevel), for x in [0,n) */
+	void RowInsideMask(int i0, int n, int j, int k, float isolevel, uint8_t* out) {
+		if (storage == TSDF_DENSE) {
+			const int16_t* q = &sdfs[IND2LINEAR((size_t)i0, j, k, res[0], res[1], res[2])];
+			int lastBlock = -2;
+			bool live = false;
+			for (int x = 0; x < n; x++) {
+				if (((i0 + x) >> TSDF_BLOCK_SHIFT) != lastBlock) {
+					lastBlock = (i0 + x) >> TSDF_BLOCK_SHIFT;
+					live = BrickLive(DenseBrick(i0 + x, j, k));
+				}
+				out[x] = (uint8_t)((live ? DecodeSDF(q[x]) : background.sdf) < isolevel);
+			}
+			return;
+		}
+		int lastBlock = -2, slot = -1;
+		for (int x = 0; x < n; x++) {
+			int i = i0 + x;
+			if ((i >> TSDF_BLOCK_SHIFT) != lastBlock) {
+				lastBlock = i >> TSDF_BLOCK_SHIFT;
+				slot = FindBlock(lastBlock, j >> TSDF_BLOCK_SHIFT, k >> TSDF_BLOCK_SHIFT);
+			}
+			float d = background.sdf;
+			if (slot >= 0) d = GetSDF(((int64_t)slot * TSDF_BLOCK_VOXELS) + IND2LINEAR(i & TSDF_BLOCK_MASK, j & TSDF_BLOCK_MASK, k & TSDF_BLOCK_MASK, TSDF_BLOCK_SIZE, TSDF_BLOCK_SIZE, TSDF_BLOCK_SIZE));
+			out[x] = (uint8_t)(d < isolevel);
+		}
+	}
+	/* sparse: slot of the block that owns cell (i,j,k), -1 if none of its corners is allocated */
+	int CellOwner(int i, int j, int k) {
+		static const int cornerOffsets[8][3] = {
+			{0,0,0},{1,0,0},{1,0,1},{0,0,1},{0,1,0},{1,1,0},{1,1,1},{0,1,1}
+		};
+		int owner = -1;
+		for (int c = 0; c < 8 && owner < 0; c++) {
+			owner = FindBlock((i + cornerOffsets[c][0]) >> TSDF_BLOCK_SHIFT, (j + cornerOffsets[c][1]) >> TSDF_BLOCK_SHIFT, (k + cornerOffsets[c][2]) >> TSDF_BLOCK_SHIFT);
+		}
+		return owner;
+	}
+
+	/* indexed marching cubes
+	- every grid edge that crosses the surface gets exactly one vertex, owned by the slab
+	  (z layer, or block when sparse) of its start voxel and found again through its global edge id
+	- pass 1 interpolates the vertices of each slab, pass 2 emits the triangles as indices
+	- both passes run in parallel over slabs, results are appended in slab order
+	*/
+	struct EdgeVertices {
+		std::vector<int64_t> edgeIds; // sorted (surface nets: cell ids, see PolygoniseSurfaceNets)
+		std::vector<float> verts, normals;
+		std::vector<uint8_t> colors;
+		uint32_t offset; // index of the first vertex of this slab in the mesh
+	};
+	int64_t EdgeId(int i, int j, int k, int axis) {
+		return 3 * IND2LINEAR((int64_t)i, j, k, res[0], res[1], res[2]) + axis;
+	}
+	int PolygoniseMCIndexed(float isolevel, INDEXEDMESH& mesh, bool withColors = true, bool withNormals = true) {
+		static const int axisOffsets[3][3] = { {1,0,0},{0,1,0},{0,0,1} };
+		bool sparse = (storage == TSDF_SPARSE);
+		int numVertSlabs = sparse ? NumAllocatedBlocks() : res[2];
+		int numCellSlabs = sparse ? NumAllocatedBlocks() : res[2] - 1;
+		std::vector<EdgeVertices> slabVerts(std::max(numVertSlabs, 0));
+		if (!bricksValid) UpdateBrickRanges();
+
+		// pass 1: vertices
+#pragma omp parallel for schedule(dynamic)
+		for (int s = 0; s < numVertSlabs; s++) {
+			EdgeVertices& ev = slabVerts[s];
+			auto addEdge = [&](int i, int j, int k, int axis) {
+				int i1 = i + axisOffsets[axis][0], j1 = j + axisOffsets[axis][1], k1 = k + axisOffsets[axis][2];
+				if (i1 >= res[0] || j1 >= res[1] || k1 >= res[2]) return;
+				if ((GetSDF(i, j, k) < isolevel) != (GetSDF(i1, j1, k1) < isolevel)) {
+					AddEdgeVertex(ev, isolevel, i, j, k, axis, withColors, withNormals);
+				}
+			};
+			if (!sparse) {
+				// an edge lies inside the voxel range of the brick of its start voxel
+				int k = s;
+				for (int j = 0; j < res[1]; j++) {
+					for (int bi = 0; bi < blockRes[0]; bi++) {
+						if (!BrickIsActive(IND2LINEAR(bi, j >> TSDF_BLOCK_SHIFT, k >> TSDF_BLOCK_SHIFT, blockRes[0], blockRes[1], blockRes[2]), isolevel)) continue;
+						for (int i = bi << TSDF_BLOCK_SHIFT; i < std::min((bi + 1) << TSDF_BLOCK_SHIFT, res[0]); i++)
+							for (int axis = 0; axis < 3; axis++)
+								addEdge(i, j, k, axis);
+					}
+				}
+				continue;
+			}
+			if (!BrickIsActive(s, isolevel)) continue;
+			// sparse: edges starting in the block, plus edges that end in the block but start in an unallocated one
+			int bi, bj, bk;
+			GetBlockCoords(s, bi, bj, bk);
+			int o[3] = { bi << TSDF_BLOCK_SHIFT, bj << TSDF_BLOCK_SHIFT, bk << TSDF_BLOCK_SHIFT };
+			std::vector<std::pair<int64_t, Eigen::Vector4i>> edges;
+			for (int k = o[2] - 1; k < o[2] + TSDF_BLOCK_SIZE; k++) {
+				for (int j = o[1] - 1; j < o[1] + TSDF_BLOCK_SIZE; j++) {
+					for (int i = o[0] - 1; i < o[0] + TSDF_BLOCK_SIZE; i++) {
+						if (i < 0 || j < 0 || k < 0 || i >= res[0] || j >= res[1] || k >= res[2]) continue;
+						int c[3] = { i, j, k };
+						for (int axis = 0; axis < 3; axis++) {
+							bool startInside = true, endInside = true, otherInside = true;
+							for (int a = 0; a < 3; a++) {
+								int cs = c[a], ce = c[a] + axisOffsets[axis][a];
+								if (a == axis) {
+									startInside = (cs >= o[a]);
+									endInside = (ce >= o[a] && ce < o[a] + TSDF_BLOCK_SIZE);
+								}
+								else if (cs < o[a]) otherInside = false;
+							}
+							if (!otherInside) continue;
+							if (!startInside && !(endInside && FindBlock((i >> TSDF_BLOCK_SHIFT), (j >> TSDF_BLOCK_SHIFT), (k >> TSDF_BLOCK_SHIFT)) < 0)) continue;
+							edges.push_back(std::make_pair(EdgeId(i, j, k, axis), Eigen::Vector4i(i, j, k, axis)));
+						}
+					}
+				}
+			}
+			std::sort(edges.begin(), edges.end(), [](const std::pair<int64_t, Eigen::Vector4i>& a, const std::pair<int64_t, Eigen::Vector4i>& b) { return a.first < b.first; });
+			for (auto& e : edges) addEdge(e.second[0], e.second[1], e.second[2], e.second[3]);
+		}
+		uint32_t numVerts = 0;
+		for (auto& ev : slabVerts) {
+			ev.offset = numVerts;
+			numVerts += (uint32_t)ev.edgeIds.size();
+		}
+
+		// pass 2: triangles
+		std::vector<std::vector<uint32_t>> slabIndices(std::max(numCellSlabs, 0));
+#pragma omp parallel for schedule(dynamic)
+		for (int s = 0; s < numCellSlabs; s++) {
+			ForEachActiveCell(isolevel, s, [&](int i, int j, int k) {
+				PolygoniseCellMCIndexed(isolevel, slabVerts, slabIndices[s], i, j, k);
+			});
+		}
+
+		GatherSlabMesh(slabVerts, slabIndices, mesh, withColors, withNormals);
+		return (int)(mesh.indices.size() / 3);
+	}
+	/* replace mesh with the vertices and indices of the slabs, in slab order (both are freed) */
+	static void GatherSlabMesh(std::vector<EdgeVertices>& slabVerts, std::vector<std::vector<uint32_t>>& slabIndices, INDEXEDMESH& mesh, bool withColors, bool withNormals) {
+		mesh.verts.clear();
+		mesh.normals.clear();
+		mesh.colors.clear();
+		mesh.indices.clear();
+		std::vector<std::vector<float>> v(slabVerts.size()), n(slabVerts.size());
+		std::vector<std::vector<uint8_t>> c(slabVerts.size());
+		for (size_t q = 0; q < slabVerts.size(); q++) {
+			v[q].swap(slabVerts[q].verts);
+			n[q].swap(slabVerts[q].normals);
+			c[q].swap(slabVerts[q].colors);
+		}
+		std::vector<EdgeVertices>().swap(slabVerts);
+		AppendSlabs(v, mesh.verts);
+		if (withNormals) AppendSlabs(n, mesh.normals);
+		if (withColors) AppendSlabs(c, mesh.colors);
+		AppendSlabs(slabIndices, mesh.indices);
+	}
+	/* interpolate the vertex where edge (i,j,k)->(i,j,k)+axis crosses isolevel and append it to ev */
+	void AddEdgeVertex(EdgeVertices& ev, float isolevel, int i, int j, int k, int axis, bool withColors, bool withNormals) {
+		static const int axisOffsets[3][3] = { {1,0,0},{0,1,0},{0,0,1} };
+		int i1 = i + axisOffsets[axis][0], j1 = j + axisOffsets[axis][1], k1 = k + axisOffsets[axis][2];
+		Eigen::Vector3d p0, p1;
+		GetVoxelCoordsFromIndex(i, j, k, p0);
+		GetVoxelCoordsFromIndex(i1, j1, k1, p1);
+		float v0 = GetSDF(i, j, k);
+		float v1 = GetSDF(i1, j1, k1);
+		double mu = EdgeCrossing(isolevel, v0, v1);
+		Eigen::Vector3d p = p0 + mu * (p1 - p0);
+		ev.edgeIds.push_back(EdgeId(i, j, k, axis));
+		ev.verts.push_back((float)p[0]);
+		ev.verts.push_back((float)p[1]);
+		ev.verts.push_back((float)p[2]);
+		if (withNormals) {
+			Eigen::Vector3d n = (1 - mu) * GetGradient(i, j, k) + mu * GetGradient(i1, j1, k1);
+			double len = n.norm();
+			if (len > 0) n /= len;
+			ev.normals.push_back((float)n[0]);
+			ev.normals.push_back((float)n[1]);
+			ev.normals.push_back((float)n[2]);
+		}
+		if (withColors) {
+			// weight the two voxel colors by confidence, unseen voxels have no color
+			Voxel a = get(i, j, k);
+			Voxel b = get(i1, j1, k1);
+			double wa = (1 - mu) * a.weight, wb = mu * b.weight;
+			if (wa + wb <= 0) { wa = 1 - mu; wb = mu; }
+			ev.colors.push_back((uint8_t)((wa * a.r + wb * b.r) / (wa + wb) + 0.5));
+			ev.colors.push_back((uint8_t)((wa * a.g + wb * b.g) / (wa + wb) + 0.5));
+			ev.colors.push_back((uint8_t)((wa * a.b + wb * b.b) / (wa + wb) + 0.5));
+		}
+	}
+	/* deferred colouring: every vertex takes its colour from the images (see SampleSurfaceColor) instead of the voxels
+	- needs the vertex normals (extract with withNormals), the visibility test allows the truncation distance
+	- vertices that no camera sees with the visibility test are coloured without it, failing that they stay as they are
+	*/
+	void ColorVertices(const std::vector<TSDFCameraView>& views, INDEXEDMESH& mesh) {
+		int64_t numVerts = (int64_t)mesh.verts.size() / 3;
+		if (mesh.normals.size() != mesh.verts.size()) return;
+		mesh.colors.resize(mesh.verts.size(), 0);
+		float tolerance = SurfaceDepthTolerance();
+#pragma omp parallel for schedule(dynamic, 4096)
+		for (int64_t v = 0; v < numVerts; v++) {
+			Eigen::Vector3d p(mesh.verts[3 * v], mesh.verts[3 * v + 1], mesh.verts[3 * v + 2]);
+			Eigen::Vector3d n(mesh.normals[3 * v], mesh.normals[3 * v + 1], mesh.normals[3 * v + 2]);
+			if (!SampleSurfaceColor(views, p, n, tolerance, &mesh.colors[3 * v])) SampleSurfaceColor(views, p, n, 0, &mesh.colors[3 * v]);
+		}
+	}
+	/* deferred colouring of a triangle soup, one colour per triangle sampled at its centroid */
+	void ColorTriangles(const std::vector<TSDFCameraView>& views, std::vector<TRIANGLE>& triangles) {
+		float tolerance = SurfaceDepthTolerance();
+#pragma omp parallel for schedule(dynamic, 4096)
+		for (int64_t t = 0; t < (int64_t)triangles.size(); t++) {
+			TRIANGLE& tri = triangles[t];
+			Eigen::Vector3d p = (tri.p[0] + tri.p[1] + tri.p[2]) / 3;
+			// the marching cubes triangles wind counter-clockwise seen from outside
+			Eigen::Vector3d n = (tri.p[1] - tri.p[0]).cross(tri.p[2] - tri.p[0]);
+			double len = n.norm();
+			if (len <= 0) continue;
+			n /= len;
+			uint8_t rgb[3];
+			if (SampleSurfaceColor(views, p, n, tolerance, rgb) || SampleSurfaceColor(views, p, n, 0, rgb)) {
+				tri.c = Eigen::Vector3d(rgb[0], rgb[1], rgb[2]) / 255.;
+			}
+		}
+	}
+	/* how far the depth samples may be from the extracted surface and still see it */
+	float SurfaceDepthTolerance() {
+		return std::max(truncMargin, 2 * (float)vSize[0]);
+	}
+	/* central difference sdf gradient at voxel (i,j,k)
+	- one sided at the volume border and next to unallocated blocks (their background value is not a distance)
+	*/
+	Eigen::Vector3d GetGradient(int i, int j, int k) {
+		int c[3] = { i, j, k };
+		Eigen::Vector3d g;
+		for (int a = 0; a < 3; a++) {
+			int lo[3] = { i, j, k }, hi[3] = { i, j, k };
+			lo[a] = std::max(c[a] - 1, 0);
+			hi[a] = std::min(c[a] + 1, res[a] - 1);
+			if (storage == TSDF_SPARSE) {
+				if (VoxelIndex(lo[0], lo[1], lo[2]) < 0) lo[a] = c[a];
+				if (VoxelIndex(hi[0], hi[1], hi[2]) < 0) hi[a] = c[a];
+			}
+			g[a] = (hi[a] == lo[a]) ? 0 : (GetSDF(hi[0], hi[1], hi[2]) - GetSDF(lo[0], lo[1], lo[2])) / ((hi[a] - lo[a]) * vSize[a]);
+		}
+		return g;
+	}
+	/* index of the shared vertex on edge (i,j,k)->(i,j,k)+axis */
+	uint32_t FindEdgeVertex(std::vector<EdgeVertices>& slabVerts, int i, int j, int k, int axis) {
+		int s = k;
+		if (storage == TSDF_SPARSE) {
+			s = FindBlock(i >> TSDF_BLOCK_SHIFT, j >> TSDF_BLOCK_SHIFT, k >> TSDF_BLOCK_SHIFT);
+			if (s < 0) { // owned by the block the edge ends in
+				int e[3] = { i, j, k };
+				e[axis]++;
+				s = FindBlock(e[0] >> TSDF_BLOCK_SHIFT, e[1] >> TSDF_BLOCK_SHIFT, e[2] >> TSDF_BLOCK_SHIFT);
+			}
+		}
+		EdgeVertices& ev = slabVerts[s];
+		auto it = std::lower_bound(ev.edgeIds.begin(), ev.edgeIds.end(), EdgeId(i, j, k, axis));
+		return ev.offset + (uint32_t)(it - ev.edgeIds.begin());
+	}
+	/* start voxel offset and axis of each of the 12 cube edges (same numbering as edgeTable) */
+	static constexpr int cellEdgeStart[12][4] = {
+		{0,0,0,0},{1,0,0,2},{0,0,1,0},{0,0,0,2},
+		{0,1,0,0},{1,1,0,2},{0,1,1,0},{0,1,0,2},
+		{0,0,0,1},{1,0,0,1},{1,0,1,1},{0,0,1,1}
+	};
+	int CellCubeIndex(float isolevel, int i, int j, int k) {
+		float v[8];
+		v[0] = GetSDF(i + 0, j + 0, k + 0);
+		v[1] = GetSDF(i + 1, j + 0, k + 0);
+		v[2] = GetSDF(i + 1, j + 0, k + 1);
+		v[3] = GetSDF(i + 0, j + 0, k + 1);
+		v[4] = GetSDF(i + 0, j + 1, k + 0);
+		v[5] = GetSDF(i + 1, j + 1, k + 0);
+		v[6] = GetSDF(i + 1, j + 1, k + 1);
+		v[7] = GetSDF(i + 0, j + 1, k + 1);
+		int cubeindex = 0;
+		for (int c = 0; c < 8; c++) {
+			if (v[c] < isolevel) cubeindex |= (1 << c);
+		}
+		return cubeindex;
+	}
+	int PolygoniseCellMCIndexed(float isolevel, std::vector<EdgeVertices>& slabVerts, std::vector<uint32_t>& indices, int i, int j, int k) {
+		int cubeindex = CellCubeIndex(isolevel, i, j, k);
+		if (edgeTable[cubeindex] == 0)
+			return(0);
+		uint32_t vertlist[12];
+		for (int e = 0; e < 12; e++) {
+			const int* es = cellEdgeStart[e];
+			if (edgeTable[cubeindex] & (1 << e))
+				vertlist[e] = FindEdgeVertex(slabVerts, i + es[0], j + es[1], k + es[2], es[3]);
+		}
+		int ntriang = 0;
+		for (int t = 0; triTable[cubeindex][t] != -1; t += 3) {
+			indices.push_back(vertlist[(int)triTable[cubeindex][t]]);
+			indices.push_back(vertlist[(int)triTable[cubeindex][t + 1]]);
+			indices.push_back(vertlist[(int)triTable[cubeindex][t + 2]]);
+			ntriang++;
+		}
+		return(ntriang);
+	}
+	/* the triangles of cell (i,j,k) as the edge ids of their vertices */
+	int CellEdgesMC(float isolevel, std::vector<int64_t>& triEdges, int i, int j, int k) {
+		int cubeindex = CellCubeIndex(isolevel, i, j, k);
+		int t = 0;
+		for (; triTable[cubeindex][t] != -1; t++) {
+			const int* es = cellEdgeStart[(int)triTable[cubeindex][t]];
+			triEdges.push_back(EdgeId(i + es[0], j + es[1], k + es[2], es[3]));
+		}
+		return t / 3;
+	}
+
+	/* surface nets, one vertex per active cell instead of one per crossed edge (about half the triangles of marching cubes)
+	- the vertex of a cell is the mean of its edge crossings, its normal and colour are blended from the crossings as in AddEdgeVertex
+	- every crossed grid edge joins the vertices of the 4 cells around it in a quad, split along its shorter diagonal
+	  and wound counter-clockwise seen from outside like the marching cubes triangles
+	- the quad of an edge comes from the lowest of its 4 cells, edges on the border of the volume (fewer than 4 cells) give none
+	- pass 1 places the vertices of each slab (see ForEachActiveCell), pass 2 emits the quads, both in parallel and appended in slab order
+	*/
+	int PolygoniseSurfaceNets(float isolevel, INDEXEDMESH& mesh, bool withColors = true, bool withNormals = true) {
+		int numSlabs = (storage == TSDF_SPARSE) ? NumAllocatedBlocks() : res[2] - 1;
+		std::vector<EdgeVertices> slabVerts(std::max(numSlabs, 0));
+		if (!bricksValid) UpdateBrickRanges();
+
+		// pass 1: cell vertices, sorted by cell id
+#pragma omp parallel for schedule(dynamic)
+		for (int s = 0; s < numSlabs; s++) {
+			std::vector<std::pair<int64_t, Eigen::Vector3i>> cells;
+			ForEachActiveCell(isolevel, s, [&](int i, int j, int k) {
+				cells.push_back(std::make_pair(IND2LINEAR((int64_t)i, j, k, res[0], res[1], res[2]), Eigen::Vector3i(i, j, k)));
+			});
+			std::sort(cells.begin(), cells.end(), [](const std::pair<int64_t, Eigen::Vector3i>& a, const std::pair<int64_t, Eigen::Vector3i>& b) { return a.first < b.first; });
+			for (auto& c : cells) AddCellVertex(slabVerts[s], isolevel, c.second[0], c.second[1], c.second[2], withColors, withNormals);
+		}
+		uint32_t numVerts = 0;
+		for (auto& ev : slabVerts) {
+			ev.offset = numVerts;
+			numVerts += (uint32_t)ev.edgeIds.size();
+		}
+
+		// pass 2: quads
+		std::vector<std::vector<uint32_t>> slabIndices(std::max(numSlabs, 0));
+#pragma omp parallel for schedule(dynamic)
+		for (int s = 0; s < numSlabs; s++) {
+			ForEachActiveCell(isolevel, s, [&](int i, int j, int k) {
+				PolygoniseCellNets(isolevel, slabVerts, slabIndices[s], i, j, k);
+			});
+		}
+		GatherSlabMesh(slabVerts, slabIndices, mesh, withColors, withNormals);
+		return (int)(mesh.indices.size() / 3);
+	}
+	/* surface nets as a triangle soup, each triangle takes the mean colour of its vertices */
+	int PolygoniseSurfaceNets(float isolevel, std::vector<TRIANGLE>& triangles) {
+		INDEXEDMESH mesh;
+		PolygoniseSurfaceNets(isolevel, mesh, true, false);
+		size_t first = triangles.size();
+		int64_t numTris = (int64_t)mesh.indices.size() / 3;
+		triangles.resize(first + numTris);
+#pragma omp parallel for schedule(dynamic, 4096)
+		for (int64_t t = 0; t < numTris; t++) {
+			TRIANGLE& tri = triangles[first + t];
+			tri.c = Eigen::Vector3d(0, 0, 0);
+			for (int c = 0; c < 3; c++) {
+				uint32_t v = mesh.indices[3 * t + c];
+				tri.p[c] = Eigen::Vector3d(mesh.verts[3 * v], mesh.verts[3 * v + 1], mesh.verts[3 * v + 2]);
+				tri.c += Eigen::Vector3d(mesh.colors[3 * v], mesh.colors[3 * v + 1], mesh.colors[3 * v + 2]) / (3 * 255.);
+			}
+		}
+		return (int)numTris;
+	}
+	/* corner offsets of a cell and the corners at the ends of its 12 edges (same numbering as edgeTable) */
+	static constexpr int cellCorners[8][3] = {
+		{0,0,0},{1,0,0},{1,0,1},{0,0,1},{0,1,0},{1,1,0},{1,1,1},{0,1,1}
+	};
+	static constexpr int cellEdgeCorners[12][2] = {
+		{0,1},{1,2},{2,3},{3,0},{4,5},{5,6},{6,7},{7,4},{0,4},{1,5},{2,6},{3,7}
+	};
+	/* place the vertex of cell (i,j,k) at the mean of its edge crossings and append it to ev */
+	void AddCellVertex(EdgeVertices& ev, float isolevel, int i, int j, int k, bool withColors, bool withNormals) {
+		float v[8];
+		int cubeindex = 0;
+		for (int c = 0; c < 8; c++) {
+			v[c] = GetSDF(i + cellCorners[c][0], j + cellCorners[c][1], k + cellCorners[c][2]);
+			if (v[c] < isolevel) cubeindex |= (1 << c);
+		}
+		Eigen::Vector3d gradient[8];
+		Voxel voxel[8];
+		bool loaded[8] = { false };
+		Eigen::Vector3d p(0, 0, 0), n(0, 0, 0), rgb(0, 0, 0);
+		double rgbWeight = 0;
+		int numCrossings = 0;
+		for (int e = 0; e < 12; e++) {
+			if (!(edgeTable[cubeindex] & (1 << e))) continue;
+			int a = cellEdgeCorners[e][0], b = cellEdgeCorners[e][1];
+			double mu = std::min(std::max((isolevel - v[a]) / (double)(v[b] - v[a]), 0.0), 1.0);
+			for (int x = 0; x < 3; x++) p[x] += cellCorners[a][x] + mu * (cellCorners[b][x] - cellCorners[a][x]);
+			numCrossings++;
+			if (!withColors && !withNormals) continue;
+			for (int c : { a, b }) {
+				if (loaded[c]) continue;
+				int ci = i + cellCorners[c][0], cj = j + cellCorners[c][1], ck = k + cellCorners[c][2];
+				if (withNormals) gradient[c] = GetGradient(ci, cj, ck);
+				if (withColors) voxel[c] = get(ci, cj, ck);
+				loaded[c] = true;
+			}
+			if (withNormals) n += (1 - mu) * gradient[a] + mu * gradient[b];
+			if (withColors) {
+				// weighted by confidence like AddEdgeVertex, unseen voxels have no color
+				double wa = (1 - mu) * voxel[a].weight, wb = mu * voxel[b].weight;
+				if (wa + wb <= 0) { wa = (1 - mu) * 1e-3; wb = mu * 1e-3; }
+				rgb += wa * Eigen::Vector3d(voxel[a].r, voxel[a].g, voxel[a].b) + wb * Eigen::Vector3d(voxel[b].r, voxel[b].g, voxel[b].b);
+				rgbWeight += wa + wb;
+			}
+		}
+		Eigen::Vector3d origin;
+		GetVoxelCoordsFromIndex(i, j, k, origin);
+		p /= numCrossings;
+		ev.edgeIds.push_back(IND2LINEAR((int64_t)i, j, k, res[0], res[1], res[2]));
+		for (int x = 0; x < 3; x++) ev.verts.push_back((float)(origin[x] + p[x] * vSize[x]));
+		if (withNormals) {
+			double len = n.norm();
+			if (len > 0) n /= len;
+			for (int x = 0; x < 3; x++) ev.normals.push_back((float)n[x]);
+		}
+		if (withColors) {
+			for (int x = 0; x < 3; x++) ev.colors.push_back((uint8_t)(rgb[x] / rgbWeight + 0.5));
+		}
+	}
+	/* global index and position of the vertex of cell (i,j,k), nullptr if the cell has none */
+	const float* FindCellVertex(std::vector<EdgeVertices>& slabVerts, int i, int j, int k, uint32_t& index) {
+		int s = (storage == TSDF_SPARSE) ? CellOwner(i, j, k) : k;
+		if (s < 0) return nullptr;
+		EdgeVertices& ev = slabVerts[s];
+		int64_t id = IND2LINEAR((int64_t)i, j, k, res[0], res[1], res[2]);
+		auto it = std::lower_bound(ev.edgeIds.begin(), ev.edgeIds.end(), id);
+		if (it == ev.edgeIds.end() || *it != id) return nullptr;
+		size_t local = it - ev.edgeIds.begin();
+		index = ev.offset + (uint32_t)local;
+		return &ev.verts[3 * local];
+	}
+	/* the quads of the 3 grid edges that meet at the far corner (1,1,1) of cell (i,j,k) and have it as their lowest cell */
+	int PolygoniseCellNets(float isolevel, std::vector<EdgeVertices>& slabVerts, std::vector<uint32_t>& indices, int i, int j, int k) {
+		static const int farEdgeStart[3] = { 7, 2, 5 }; // corner the x, y, z edge into corner 6 starts from
+		int cubeindex = CellCubeIndex(isolevel, i, j, k);
+		bool farInside = (cubeindex >> 6) & 1;
+		int c[3] = { i, j, k };
+		int ntriang = 0;
+		for (int axis = 0; axis < 3; axis++) {
+			bool startInside = (cubeindex >> farEdgeStart[axis]) & 1;
+			if (startInside == farInside) continue;
+			int u = (axis + 1) % 3, w = (axis + 2) % 3;
+			if (c[u] + 1 >= res[u] - 1 || c[w] + 1 >= res[w] - 1) continue; // border edge
+			// cells around the edge, counter-clockwise about +axis
+			uint32_t q[4];
+			const float* qp[4];
+			bool found = true;
+			for (int n = 0; n < 4 && found; n++) {
+				int d[3] = { 0, 0, 0 };
+				d[u] = (n == 1 || n == 2);
+				d[w] = (n >= 2);
+				qp[n] = FindCellVertex(slabVerts, i + d[0], j + d[1], k + d[2], q[n]);
+				found = (qp[n] != nullptr);
+			}
+			if (!found) continue;
+			if (!startInside) { // outside is towards -axis, wind the other way
+				std::swap(q[1], q[3]);
+				std::swap(qp[1], qp[3]);
+			}
+			auto dist2 = [](const float* a, const float* b) {
+				return (a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) + (a[2] - b[2]) * (a[2] - b[2]);
+			};
+			if (dist2(qp[0], qp[2]) <= dist2(qp[1], qp[3])) {
+				uint32_t t[6] = { q[0], q[1], q[2], q[0], q[2], q[3] };
+				indices.insert(indices.end(), t, t + 6);
+			}
+			else {
+				uint32_t t[6] = { q[0], q[1], q[3], q[1], q[2], q[3] };
+				indices.insert(indices.end(), t, t + 6);
+			}
+			ntriang += 2;
+		}
+		return ntriang;
+	}
+
+	/* meshes of single dense bricks, for incremental frames that only extract the bricks that changed
+	- soup: the triangles PolygoniseMC() makes for the cells of the brick
+	- indexed: the vertices of the edges that start in the brick (as PolygoniseMCIndexed(), in edge id order)
+	  and the triangles as edge ids, AssembleBrickMeshes() numbers the vertices
+	- reads the voxels of the brick and of its 26 neighbours at most (the cells reach one voxel into the next
+	  bricks, the normals one voxel further), so a brick mesh stays valid while none of those change
+	- needs valid brick ranges (see UpdateBrickRanges)
+	*/
+	struct BrickMesh {
+		std::vector<TRIANGLE> tris;
+		EdgeVertices verts;
+		std::vector<int64_t> triEdges; // 3 per triangle
+	};
+	void PolygoniseBrick(float isolevel, int b, BrickMesh& out, bool indexed, bool withColors, bool withNormals) {
+		static const int axisOffsets[3][3] = { {1,0,0},{0,1,0},{0,0,1} };
+		out = BrickMesh();
+		int o[3];
+		BrickOrigin(b, o[0], o[1], o[2]);
+		int kEnd = std::min(o[2] + TSDF_BLOCK_SIZE, res[2] - 1);
+		if (!indexed) {
+			ForEachActiveCellOfBrick(isolevel, b, o[2], kEnd, [&](int i, int j, int k) { PolygoniseCellMC(isolevel, out.tris, i, j, k); });
+			return;
+		}
+		if (!BrickIsActive(b, isolevel)) return;
+		for (int k = o[2]; k < std::min(o[2] + TSDF_BLOCK_SIZE, res[2]); k++) {
+			for (int j = o[1]; j < std::min(o[1] + TSDF_BLOCK_SIZE, res[1]); j++) {
+				for (int i = o[0]; i < std::min(o[0] + TSDF_BLOCK_SIZE, res[0]); i++) {
+					for (int axis = 0; axis < 3; axis++) {
+						int i1 = i + axisOffsets[axis][0], j1 = j + axisOffsets[axis][1], k1 = k + axisOffsets[axis][2];
+						if (i1 >= res[0] || j1 >= res[1] || k1 >= res[2]) continue;
+						if ((GetSDF(i, j, k) < isolevel) != (GetSDF(i1, j1, k1) < isolevel)) {
+							AddEdgeVertex(out.verts, isolevel, i, j, k, axis, withColors, withNormals);
+						}
+					}
+				}
+			}
+		}
+		ForEachActiveCellOfBrick(isolevel, b, o[2], kEnd, [&](int i, int j, int k) { CellEdgesMC(isolevel, out.triEdges, i, j, k); });
+	}
+	/* append the soups of all bricks in brick order, the brick meshes are kept */
+	static void AssembleBrickMeshes(const std::vector<BrickMesh>& meshes, std::vector<TRIANGLE>& triangles) {
+		size_t n = triangles.size();
+		for (const BrickMesh& m : meshes) n += m.tris.size();
+		triangles.reserve(n);
+		for (const BrickMesh& m : meshes) triangles.insert(triangles.end(), m.tris.begin(), m.tris.end());
+	}
+	/* one indexed mesh from the brick meshes of every brick (meshes[b] is brick b), vertices numbered in brick order */
+	void AssembleBrickMeshes(const std::vector<BrickMesh>& meshes, INDEXEDMESH& mesh, bool withColors, bool withNormals) {
+		std::vector<uint32_t> vertOffsets(meshes.size() + 1, 0);
+		std::vector<size_t> indexOffsets(meshes.size() + 1, 0);
+		for (size_t b = 0; b < meshes.size(); b++) {
+			vertOffsets[b + 1] = vertOffsets[b] + (uint32_t)meshes[b].verts.edgeIds.size();
+			indexOffsets[b + 1] = indexOffsets[b] + meshes[b].triEdges.size();
+		}
+		size_t numVerts = vertOffsets.back();
+		mesh.verts.resize(3 * numVerts);
+		mesh.normals.resize(withNormals ? 3 * numVerts : 0);
+		mesh.colors.resize(withColors ? 3 * numVerts : 0);
+		mesh.indices.resize(indexOffsets.back());
+#pragma omp parallel for schedule(dynamic)
+		for (int b = 0; b < (int)meshes.size(); b++) {
+			const BrickMesh& m = meshes[b];
+			size_t v0 = 3 * (size_t)vertOffsets[b];
+			std::copy(m.verts.verts.begin(), m.verts.verts.end(), mesh.verts.begin() + v0);
+			if (withNormals) std::copy(m.verts.normals.begin(), m.verts.normals.end(), mesh.normals.begin() + v0);
+			if (withColors) std::copy(m.verts.colors.begin(), m.verts.colors.end(), mesh.colors.begin() + v0);
+			for (size_t e = 0; e < m.triEdges.size(); e++) {
+				// the vertex belongs to the brick of the edge's start voxel
+				int64_t voxel = m.triEdges[e] / 3;
+				int i = (int)(voxel % res[0]), j = (int)((voxel / res[0]) % res[1]), k = (int)(voxel / ((int64_t)res[0] * res[1]));
+				int owner = DenseBrick(i, j, k);
+				const std::vector<int64_t>& ids = meshes[owner].verts.edgeIds;
+				mesh.indices[indexOffsets[b] + e] = vertOffsets[owner] + (uint32_t)(std::lower_bound(ids.begin(), ids.end(), m.triEdges[e]) - ids.begin());
+			}
+		}
+	}
 	int PolygoniseCellMC(float isolevel, std::vector<TRIANGLE> &triangles, int xi, int yi, int zi) {
 		int ntriang;
 		int cubeindex;
 		Eigen::Vector3d vertlist[12];
-		int indices[24];
 		int i, j, k;
 		i = xi;
 		j = yi;
 		k = zi;
 
-		indices[0] = IND2LINEAR(i + 0, j + 0, k + 0, res[0], res[1], res[2]);
-		indices[1] = IND2LINEAR(i + 1, j + 0, k + 0, res[0], res[1], res[2]);
-		indices[2] = IND2LINEAR(i + 1, j + 0, k + 1, res[0], res[1], res[2]);
-		indices[3] = IND2LINEAR(i + 0, j + 0, k + 1, res[0], res[1], res[2]);
-		indices[4] = IND2LINEAR(i + 0, j + 1, k + 0, res[0], res[1], res[2]);
-		indices[5] = IND2LINEAR(i + 1, j + 1, k + 0, res[0], res[1], res[2]);
-		indices[6] = IND2LINEAR(i + 1, j + 1, k + 1, res[0], res[1], res[2]);
-		indices[7] = IND2LINEAR(i + 0, j + 1, k + 1, res[0], res[1], res[2]);
 		/*
 	  Determine the index into the edge table which
 	  tells us which vertices are inside of the surface
@@ -668,30 +2213,32 @@ public:
 		// we are in a particular voxel, so our neighbours are
 		Eigen::Vector3d p[8], rgb;
 		float v[8];
-		v[0] = grid[indices[0]].sdf;
-		v[1] = grid[indices[1]].sdf;
-		v[2] = grid[indices[2]].sdf;
-		v[3] = grid[indices[3]].sdf;
-		v[4] = grid[indices[4]].sdf;
-		v[5] = grid[indices[5]].sdf;
-		v[6] = grid[indices[6]].sdf;
-		v[7] = grid[indices[7]].sdf;
+		v[0] = GetSDF(i + 0, j + 0, k + 0);
+		v[1] = GetSDF(i + 1, j + 0, k + 0);
+		v[2] = GetSDF(i + 1, j + 0, k + 1);
+		v[3] = GetSDF(i + 0, j + 0, k + 1);
+		v[4] = GetSDF(i + 0, j + 1, k + 0);
+		v[5] = GetSDF(i + 1, j + 1, k + 0);
+		v[6] = GetSDF(i + 1, j + 1, k + 1);
+		v[7] = GetSDF(i + 0, j + 1, k + 1);
 
 		//std::cout << "v[0]=" << v[0] << std::endl;
 
-		p[0] = grid[indices[0]].c;
-		p[1] = grid[indices[1]].c;
-		p[2] = grid[indices[2]].c;
-		p[3] = grid[indices[3]].c;
-		p[4] = grid[indices[4]].c;
-		p[5] = grid[indices[5]].c;
-		p[6] = grid[indices[6]].c;
-		p[7] = grid[indices[7]].c;
-		rgb[0] = grid[indices[0]].r;
-		rgb[1] = grid[indices[0]].g;
-		rgb[2] = grid[indices[0]].b;
+		// corner positions come from the index, background voxels (sparse) have no stored center
+		GetVoxelCoordsFromIndex(i + 0, j + 0, k + 0, p[0]);
+		GetVoxelCoordsFromIndex(i + 1, j + 0, k + 0, p[1]);
+		GetVoxelCoordsFromIndex(i + 1, j + 0, k + 1, p[2]);
+		GetVoxelCoordsFromIndex(i + 0, j + 0, k + 1, p[3]);
+		GetVoxelCoordsFromIndex(i + 0, j + 1, k + 0, p[4]);
+		GetVoxelCoordsFromIndex(i + 1, j + 1, k + 0, p[5]);
+		GetVoxelCoordsFromIndex(i + 1, j + 1, k + 1, p[6]);
+		GetVoxelCoordsFromIndex(i + 0, j + 1, k + 1, p[7]);
+		Voxel v0 = get(i, j, k);
+		rgb[0] = v0.r;
+		rgb[1] = v0.g;
+		rgb[2] = v0.b;
 		//for (int i = 0; i < 8; i++) {
-		//	int f = grid[indices[i]].flag;
+		//	int f = get(...).flag;
 		//	//if ( f != VOXEL_FULL) return 0;
 		//	//if (fabs(v[i]) > 0.04) return 0;
 		//}
@@ -755,11 +2302,29 @@ public:
 	/// ////members
 	/// </summary>
 	int res[3];
-	Voxel *grid; // linear-grid of voxels
-	Voxel* grid2; // temp grid
+	int storage; // TSDF_DENSE or TSDF_SPARSE
+	bool voxelColors; // false: no colour channel, the mesh is coloured from the images instead (see ColorVertices)
+	int blockRes[3]; // number of blocks along each axis
+	std::unordered_map<int64_t, int> blockMap; // block key -> slot (sparse)
+	std::vector<int64_t> blockKeys; // slot -> block key (sparse)
+	/* voxel channels (structure of arrays), indexed by VoxelIndex()
+	- dense: linear grid index, sparse: slot * TSDF_BLOCK_VOXELS + offset in the block */
+	VoxelChannel<int16_t> sdfs; // quantized sdf (see EncodeSDF)
+	VoxelChannel<uint16_t> weights;
+	VoxelChannel<uint8_t> flags;
+	VoxelChannel<uint8_t> colors; // rgb8, 3 per voxel
+	Voxel background; // value of every voxel outside the allocated blocks
+	std::vector<float> brickMin, brickMax; // sdf range per brick (see UpdateBrickRanges)
+	bool bricksValid = false;
+	std::unique_ptr<std::atomic<int16_t>[]> storedMin, storedMax; // encoded sdf range of the voxels each brick holds (see WidenStoredRange)
+	bool storedRangesValid = true;
+	std::unique_ptr<std::atomic<uint32_t>[]> brickEpochs; // dense: epoch each brick was last cleared in (see TouchBrick)
+	uint32_t epoch = 1; // current epoch, dense bricks stamped with another one are stale
+	std::mutex brickLock; // serializes the clearing of stale bricks
 	Eigen::Vector3d center;
 	Eigen::Vector3d sz; // grid size
 	Eigen::Vector3d vSize; // size of one voxel in the grid
+	float truncMargin = 0, truncDelta = 0; // of the last Integrate(), saved with the volume
 
 };
 
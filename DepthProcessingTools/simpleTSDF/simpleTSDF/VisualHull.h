@@ -0,0 +1,308 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include "Eigen/Core"
+#include "TSDFVolume.h"
+
+#define HULL_CHUNK 16 // voxels decided together by one matte box test in VisualHull::Carve()
+#define HULL_CHUNK_MASK ((1ull << HULL_CHUNK) - 1)
+
+/* lowest set bit and number of set bits of a 64-bit word */
+inline int LowestBit64(uint64_t x) {
+#ifdef _MSC_VER
+	unsigned long b;
+	_BitScanForward64(&b, x);
+	return (int)b;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+inline int PopCount64(uint64_t x) {
+#ifdef _MSC_VER
+	return (int)__popcnt64(x);
+#else
+	return __builtin_popcountll(x);
+#endif
+}
+
+/* a camera's matte thresholded once (matte > 200, as everywhere else), one bit per pixel in rows of 64-bit words */
+struct MatteBits {
+	int width = 0, height = 0, wordsPerRow = 0;
+	std::vector<uint64_t> bits;
+
+	bool Foreground(int u, int v) const { return (bits[(size_t)v * wordsPerRow + (u >> 6)] >> (u & 63)) & 1; }
+};
+inline void BuildMatteBits(const TSDFCameraView& view, MatteBits& mb) {
+	mb.width = view.width;
+	mb.height = view.height;
+	mb.wordsPerRow = (view.width + 63) / 64;
+	mb.bits.assign((size_t)mb.wordsPerRow * view.height, 0);
+	for (int v = 0; v < view.height; v++) {
+		const uint8_t* m = &view.matte[v * view.matteStep];
+		uint64_t* row = &mb.bits[(size_t)v * mb.wordsPerRow];
+		for (int u = 0; u < view.width; u++) {
+			if (m[(size_t)u * view.matteChannels] > 200) row[u >> 6] |= 1ull << (u & 63);
+		}
+	}
+}
+
+/* visual hull of the mattes at 1 bit per voxel, the fast preview (simpleTSDF --hull)
+- no depth, sdf or colour: a voxel stays occupied while every camera that sees it sees matte foreground there
+  (as TSDFVolume::CarveSilhouettes, a camera that does not see the voxel does not carve it)
+- voxels are bits of 64-bit words along x, the grid has an empty border of one voxel so the hull is always closed
+- Carve(): the voxel centers of a row (j,k) are an affine walk in camera space, every word of the row is ANDed
+  with the bits the camera keeps and words that are already empty are skipped
+- a run of HULL_CHUNK voxels projects onto a segment, so the matte's summed area table over the box of its end pixels
+  decides the whole run when that box is all background or all foreground, only the runs along the matte's
+  edge are projected voxel by voxel (3 adds and a divide each)
+- Polygonise*(): marching cubes on the binary field with the vertices at the edge midpoints, only the cells
+  whose corners differ (found word-wide) go through the tables
+- same voxel centers as a TSDFVolume with the same res, center and size
+*/
+class VisualHull {
+public:
+	int res[3];
+	Eigen::Vector3d center, sz, vSize;
+
+	VisualHull(int resX, int resY, int resZ, const Eigen::Vector3d& _center, const Eigen::Vector3d& _sz) {
+		res[0] = resX;
+		res[1] = resY;
+		res[2] = resZ;
+		pad[0] = resX + 2;
+		pad[1] = resY + 2;
+		pad[2] = resZ + 2;
+		wordsPerRow = (pad[0] + 63) / 64;
+		bits.resize((size_t)wordsPerRow * pad[1] * pad[2]);
+		Place(_center, _sz);
+		Reset();
+	}
+	void Place(const Eigen::Vector3d& _center, const Eigen::Vector3d& _sz) {
+		center = _center;
+		sz = _sz;
+		for (int a = 0; a < 3; a++) vSize[a] = sz[a] / res[a];
+	}
+	/* every voxel occupied */
+	void Reset() {
+		std::fill(bits.begin(), bits.end(), 0);
+#pragma omp parallel for
+		for (int k = 1; k <= res[2]; k++) {
+			for (int j = 1; j <= res[1]; j++) {
+				uint64_t* row = Row(j, k);
+				for (int i = 1; i <= res[0]; i++) row[i >> 6] |= 1ull << (i & 63);
+			}
+		}
+	}
+	bool Occupied(int i, int j, int k) const {
+		i++; j++; k++;
+		return (Row(j, k)[i >> 6] >> (i & 63)) & 1;
+	}
+	int64_t NumOccupied() const {
+		int64_t n = 0;
+		for (uint64_t w : bits) n += PopCount64(w);
+		return n;
+	}
+	int64_t NumVoxels() const { return (int64_t)res[0] * res[1] * res[2]; }
+
+	/* carve with every camera's matte, returns the number of voxels carved away */
+	int64_t Carve(const std::vector<TSDFCameraView>& views) {
+		int64_t before = NumOccupied();
+		std::vector<MatteBits> mattes(views.size());
+		std::vector<TSDFMatteSAT> sats(views.size());
+#pragma omp parallel for
+		for (int cam = 0; cam < (int)views.size(); cam++) {
+			BuildMatteBits(views[cam], mattes[cam]);
+			BuildMatteSAT(views[cam], sats[cam]);
+		}
+		for (size_t cam = 0; cam < views.size(); cam++) {
+			CarveCamera(views[cam], mattes[cam], sats[cam]);
+		}
+		return before - NumOccupied();
+	}
+
+	/* indexed mesh of the hull (shared vertices, no colours), normals from the adjacent faces */
+	int PolygoniseIndexed(INDEXEDMESH& mesh, bool withNormals) {
+		// triangles as edge ids per slab of cells, the edge ids are turned into vertices afterwards
+		int numSlabs = pad[2] - 1;
+		std::vector<std::vector<int64_t>> slabEdges(numSlabs);
+#pragma omp parallel for schedule(dynamic)
+		for (int k = 0; k < numSlabs; k++) {
+			ForEachActiveCell(k, [&](int i, int j, int cubeindex) { AddCellEdges(i, j, k, cubeindex, slabEdges[k]); });
+		}
+		std::vector<int64_t> edges;
+		TSDFVolume::AppendSlabs(slabEdges, edges);
+		std::vector<int64_t> unique(edges);
+		std::sort(unique.begin(), unique.end());
+		unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+
+		mesh.verts.resize(unique.size() * 3);
+		mesh.normals.clear();
+		mesh.colors.clear();
+		mesh.indices.resize(edges.size());
+#pragma omp parallel for
+		for (int v = 0; v < (int)unique.size(); v++) {
+			Eigen::Vector3d p = EdgeMidpoint(unique[v]);
+			for (int a = 0; a < 3; a++) mesh.verts[3 * v + a] = (float)p[a];
+		}
+#pragma omp parallel for
+		for (int e = 0; e < (int)edges.size(); e++) {
+			mesh.indices[e] = (uint32_t)(std::lower_bound(unique.begin(), unique.end(), edges[e]) - unique.begin());
+		}
+		if (withNormals) {
+			std::vector<Eigen::Vector3f> n(unique.size(), Eigen::Vector3f::Zero());
+			for (size_t t = 0; t < mesh.indices.size(); t += 3) {
+				const uint32_t* tri = &mesh.indices[t];
+				Eigen::Vector3f p0(&mesh.verts[3 * tri[0]]), p1(&mesh.verts[3 * tri[1]]), p2(&mesh.verts[3 * tri[2]]);
+				Eigen::Vector3f fn = (p1 - p0).cross(p2 - p0); // area weighted, counter-clockwise seen from outside
+				for (int c = 0; c < 3; c++) n[tri[c]] += fn;
+			}
+			mesh.normals.resize(unique.size() * 3);
+			for (size_t v = 0; v < n.size(); v++) {
+				float len = n[v].norm();
+				if (len > 0) n[v] /= len;
+				for (int a = 0; a < 3; a++) mesh.normals[3 * v + a] = n[v][a];
+			}
+		}
+		return (int)(mesh.indices.size() / 3);
+	}
+	/* triangle soup of the hull, grey */
+	int Polygonise(std::vector<TRIANGLE>& triangles) {
+		INDEXEDMESH mesh;
+		PolygoniseIndexed(mesh, false);
+		size_t first = triangles.size(), numTris = mesh.indices.size() / 3;
+		triangles.resize(first + numTris);
+#pragma omp parallel for
+		for (int t = 0; t < (int)numTris; t++) {
+			TRIANGLE& tri = triangles[first + t];
+			for (int c = 0; c < 3; c++) {
+				const float* p = &mesh.verts[3 * mesh.indices[3 * t + c]];
+				tri.p[c] = Eigen::Vector3d(p[0], p[1], p[2]);
+			}
+			tri.c = Eigen::Vector3d(0.75, 0.75, 0.75);
+		}
+		return (int)numTris;
+	}
+
+private:
+	int pad[3];      // res + the empty border
+	int wordsPerRow; // 64-bit words per padded row along x
+	std::vector<uint64_t> bits;
+
+	uint64_t* Row(int j, int k) { return &bits[((size_t)j + (size_t)k * pad[1]) * wordsPerRow]; }
+	const uint64_t* Row(int j, int k) const { return &bits[((size_t)j + (size_t)k * pad[1]) * wordsPerRow]; }
+
+	/* world position of the voxel at padded index (i,j,k), as TSDFVolume::GetVoxelCoordsFromIndex */
+	Eigen::Vector3d PaddedVoxelCenter(double i, double j, double k) const {
+		return Eigen::Vector3d(((i - 1) / res[0] - 0.5) * sz[0] + vSize[0] / 2 + center[0],
+			((j - 1) / res[1] - 0.5) * sz[1] + vSize[1] / 2 + center[1],
+			((k - 1) / res[2] - 0.5) * sz[2] + vSize[2] / 2 + center[2]);
+	}
+
+	void CarveCamera(const TSDFCameraView& view, const MatteBits& matte, const TSDFMatteSAT& sat) {
+		const Eigen::Matrix4d& exInv = view.exInv;
+		float fx = (float)view.in(0, 0), fy = (float)view.in(1, 1), cx = (float)view.in(0, 2), cy = (float)view.in(1, 2);
+		Eigen::Vector3d step = exInv.block<3, 1>(0, 0) * vSize[0]; // camera space step of one voxel along x
+		float sx = (float)step[0], sy = (float)step[1], sz_ = (float)step[2];
+		int numRows = res[1] * res[2];
+#pragma omp parallel for schedule(dynamic, 64)
+		for (int r = 0; r < numRows; r++) {
+			int j = 1 + r % res[1], k = 1 + r / res[1];
+			uint64_t* row = Row(j, k);
+			Eigen::Vector4d c0 = exInv * PaddedVoxelCenter(0, j, k).homogeneous(); // padded i = 0, one step before the first voxel
+			auto pixel = [&](int i, int& u, int& v) {
+				float x = (float)c0[0] + i * sx, y = (float)c0[1] + i * sy, z = (float)c0[2] + i * sz_;
+				if (z <= 0) return false;
+				float invz = 1.0f / z;
+				float fu = x * fx * invz + cx, fv = y * fy * invz + cy;
+				if (!(fu >= 0 && fv >= 0 && fu < matte.width && fv < matte.height)) return false;
+				u = (int)fu;
+				v = (int)fv;
+				return true;
+			};
+			for (int w = 0; w < wordsPerRow; w++) {
+				if (!row[w]) continue;
+				uint64_t occ = 0, keep = 0;
+				for (int c = 0; c < 64; c += HULL_CHUNK) {
+					uint64_t chunk = (row[w] >> c) & HULL_CHUNK_MASK;
+					if (!chunk) continue;
+					int i0 = 64 * w + c, u0, v0, u1, v1;
+					if (pixel(i0, u0, v0) && pixel(i0 + HULL_CHUNK - 1, u1, v1)) { // the whole run lands in the image
+						int64_t area = (int64_t)(std::abs(u1 - u0) + 1) * (std::abs(v1 - v0) + 1);
+						uint32_t fg = MatteForegroundCount(sat, std::min(u0, u1), std::min(v0, v1), std::max(u0, u1), std::max(v0, v1));
+						if (fg == 0) continue;
+						if (fg == area) { keep |= chunk << c; continue; }
+					}
+					occ |= chunk << c;
+				}
+				while (occ) {
+					int b = LowestBit64(occ);
+					occ &= occ - 1;
+					// same pixel rounding as the integration, behind the camera or outside the image is no conclusion
+					int u, v;
+					if (!pixel(64 * w + b, u, v) || matte.Foreground(u, v)) keep |= 1ull << b;
+				}
+				row[w] = keep;
+			}
+		}
+	}
+
+	/* calls f(i, j, cubeindex) for every cell of slab k (padded cell coordinates) whose 8 corners are not all equal,
+	   cell i spans voxels i and i+1 of the rows (j,k), (j+1,k), (j,k+1), (j+1,k+1) with the corners numbered as in TSDFVolume
+	*/
+	template <typename F>
+	void ForEachActiveCell(int k, F f) const {
+		for (int j = 0; j < pad[1] - 1; j++) {
+			const uint64_t* r[4] = { Row(j, k), Row(j, k + 1), Row(j + 1, k), Row(j + 1, k + 1) };
+			for (int w = 0; w < wordsPerRow; w++) {
+				uint64_t cur[4], next[4], any = 0;
+				for (int q = 0; q < 4; q++) {
+					cur[q] = r[q][w];
+					next[q] = (w + 1 < wordsPerRow) ? r[q][w + 1] : 0;
+					any |= cur[q] | next[q];
+				}
+				if (!any) continue;
+				// bit b set if voxel 64w+b differs along x from its successor or from the other rows at b or b+1
+				uint64_t rowsDiffer = (cur[0] ^ cur[1]) | (cur[0] ^ cur[2]) | (cur[0] ^ cur[3]);
+				uint64_t rowsDifferNext = (next[0] ^ next[1]) | (next[0] ^ next[2]) | (next[0] ^ next[3]);
+				uint64_t active = rowsDiffer | (rowsDiffer >> 1) | (rowsDifferNext << 63);
+				for (int q = 0; q < 4; q++) active |= cur[q] ^ ((cur[q] >> 1) | (next[q] << 63));
+				while (active) {
+					int b = LowestBit64(active);
+					active &= active - 1;
+					int i = 64 * w + b;
+					if (i >= pad[0] - 1) break;
+					auto bit = [&](int q, int di) { int x = i + di; return (int)((r[q][x >> 6] >> (x & 63)) & 1); };
+					int cubeindex = bit(0, 0) | (bit(0, 1) << 1) | (bit(1, 1) << 2) | (bit(1, 0) << 3)
+						| (bit(2, 0) << 4) | (bit(2, 1) << 5) | (bit(3, 1) << 6) | (bit(3, 0) << 7);
+					f(i, j, cubeindex);
+				}
+			}
+		}
+	}
+	/* edge id of the edge (i,j,k)->(i,j,k)+axis in the padded grid, ordered by k, j, i */
+	int64_t EdgeId(int i, int j, int k, int axis) const {
+		return ((((int64_t)k * pad[1]) + j) * pad[0] + i) * 3 + axis;
+	}
+	Eigen::Vector3d EdgeMidpoint(int64_t id) const {
+		int axis = (int)(id % 3);
+		int64_t v = id / 3;
+		double d[3] = { 0, 0, 0 };
+		d[axis] = 0.5;
+		return PaddedVoxelCenter((double)(v % pad[0]) + d[0], (double)((v / pad[0]) % pad[1]) + d[1], (double)(v / ((int64_t)pad[0] * pad[1])) + d[2]);
+	}
+	void AddCellEdges(int i, int j, int k, int cubeindex, std::vector<int64_t>& edges) const {
+		/* start voxel offset and axis of each of the 12 cube edges (as TSDFVolume::PolygoniseCellMCIndexed) */
+		static const int edgeStart[12][4] = {
+			{0,0,0,0},{1,0,0,2},{0,0,1,0},{0,0,0,2},
+			{0,1,0,0},{1,1,0,2},{0,1,1,0},{0,1,0,2},
+			{0,0,0,1},{1,0,0,1},{1,0,1,1},{0,0,1,1}
+		};
+		for (int t = 0; triTable[cubeindex][t] != -1; t++) {
+			const int* e = edgeStart[(int)triTable[cubeindex][t]];
+			edges.push_back(EdgeId(i + e[0], j + e[1], k + e[2], e[3]));
+		}
+	}
+};
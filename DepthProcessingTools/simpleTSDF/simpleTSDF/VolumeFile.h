@@ -0,0 +1,308 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "TSDFVolume.h"
+#include "MeshIO.h"
+
+/* TSDFVolume files (.tsdf), written by SaveVolume() and opened in place by LoadVolume()
+- a fixed header, then the channels one after the other, each starting on a TSDF_FILE_ALIGN boundary so it can be mapped as is:
+  block keys (int64, blocks layout only), sdf (int16, see EncodeSDF), weight (uint16), flag (uint8), colour (rgb8)
+- grid layout (TSDF_DENSE): every voxel of the grid in linear order (IND2LINEAR)
+- blocks layout (TSDF_SPARSE): only the stored TSDF_BLOCK_SIZE^3 blocks, in key order of the sparse volume slots,
+  missing blocks read back as the background voxel
+- host byte order, which is little endian on every platform we build for
+*/
+#define TSDF_FILE_MAGIC "TSDFVOL"
+#define TSDF_FILE_VERSION 1
+#define TSDF_FILE_ALIGN 4096
+
+struct TSDFVolumeFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t layout;        // TSDF_DENSE (grid) or TSDF_SPARSE (blocks)
+	int32_t res[3];
+	int32_t blockSize;      // TSDF_BLOCK_SIZE
+	double center[3];
+	double size[3];
+	double voxelSize[3];
+	float truncMargin, truncDelta; // metric, of the integration that filled the volume (0 = unknown)
+	float sdfRange;         // TSDF_SDF_RANGE the sdfs are quantized over
+	int32_t backgroundFlag;
+	float backgroundSDF;
+	uint32_t reserved;
+	uint64_t numBlocks;     // blocks layout
+	uint64_t numVoxels;     // values in each channel (3 per voxel for the colours)
+	uint64_t keyOffset, sdfOffset, weightOffset, flagOffset, colorOffset; // bytes from the start of the file
+};
+static_assert(sizeof(TSDFVolumeFileHeader) == 184, "the volume file header must not change size");
+
+/* read only file mapping, the pages are private copy on write so the volume may still be modified in memory */
+class MappedFile {
+public:
+	~MappedFile() { Close(); }
+
+	bool Open(const std::string& path) {
+		Close();
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER length;
+		bool ok = GetFileSizeEx(file, &length) && length.QuadPart > 0;
+		HANDLE mapping = ok ? CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr) : nullptr;
+		if (mapping) {
+			data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+			CloseHandle(mapping); // the view keeps the mapping alive
+		}
+		CloseHandle(file);
+		if (!data) return false;
+		size = (size_t)length.QuadPart;
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				data = (uint8_t*)p;
+				size = (size_t)st.st_size;
+			}
+		}
+		close(fd);
+		if (!data) return false;
+#endif
+		return true;
+	}
+	void Close() {
+		if (!data) return;
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap(data, size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	uint8_t* data = nullptr;
+	size_t size = 0;
+};
+
+inline uint64_t AlignVolumeFileOffset(uint64_t offset) {
+	return (offset + TSDF_FILE_ALIGN - 1) / TSDF_FILE_ALIGN * TSDF_FILE_ALIGN;
+}
+
+/* channel values of the voxels i0..i0+n-1 of row (j,k) of a brick: one run of the channel (see VoxelIndex),
+   background when ind < 0 or the volume has no such channel (voxelColors off), padded with background up to TSDF_BLOCK_SIZE voxels when pad is set */
+template <typename T>
+void WriteVolumeRun(MeshFileWriter& w, VoxelChannel<T>& channel, int64_t ind, int n, int perVoxel, bool pad, T background) {
+	T run[3 * TSDF_BLOCK_SIZE];
+	int total = (pad ? TSDF_BLOCK_SIZE : n) * perVoxel;
+	int stored = (ind < 0 || channel.empty()) ? 0 : n * perVoxel;
+	if (stored) memcpy(run, &channel[(size_t)ind * perVoxel], stored * sizeof(T));
+	for (int v = stored; v < total; v++) run[v] = background;
+	w.Bytes(run, total * sizeof(T));
+}
+
+/* save vol to path (see TSDFVolumeFileHeader)
+- blocks: store only the blocks a sparse volume holds, or the bricks of a dense volume that differ from the background
+  (a dense volume saved like this loads as a sparse one), otherwise the whole grid
+- the volume must not be written to while it is saved
+*/
+inline bool SaveVolume(const std::string& path, TSDFVolume& vol, bool blocks) {
+	// stored blocks as block keys, which for dense volumes are also the brick numbers (see DenseBrick)
+	std::vector<int64_t> keys;
+	if (blocks && vol.storage == TSDF_SPARSE) {
+		keys = vol.blockKeys;
+	}
+	else if (blocks) {
+		int16_t bgSDF = TSDFVolume::EncodeSDF(vol.background.sdf);
+		for (int b = 0; b < vol.blockRes[0] * vol.blockRes[1] * vol.blockRes[2]; b++) {
+			if (!vol.BrickLive(b)) continue;
+			int o[3];
+			vol.BrickOrigin(b, o[0], o[1], o[2]);
+			bool stored = false;
+			for (int k = o[2]; k < std::min(o[2] + TSDF_BLOCK_SIZE, vol.res[2]) && !stored; k++) {
+				for (int j = o[1]; j < std::min(o[1] + TSDF_BLOCK_SIZE, vol.res[1]) && !stored; j++) {
+					int64_t ind = vol.VoxelIndex(o[0], j, k);
+					for (int i = 0; i < std::min(TSDF_BLOCK_SIZE, vol.res[0] - o[0]); i++) {
+						if (vol.sdfs[ind + i] != bgSDF || vol.weights[ind + i] != 0) stored = true;
+					}
+				}
+			}
+			if (stored) keys.push_back(b);
+		}
+	}
+
+	TSDFVolumeFileHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TSDF_FILE_MAGIC, sizeof(TSDF_FILE_MAGIC));
+	h.version = TSDF_FILE_VERSION;
+	h.layout = blocks ? TSDF_SPARSE : TSDF_DENSE;
+	h.blockSize = TSDF_BLOCK_SIZE;
+	for (int a = 0; a < 3; a++) {
+		h.res[a] = vol.res[a];
+		h.center[a] = vol.center[a];
+		h.size[a] = vol.sz[a];
+		h.voxelSize[a] = vol.vSize[a];
+	}
+	h.truncMargin = vol.truncMargin;
+	h.truncDelta = vol.truncDelta;
+	h.sdfRange = TSDF_SDF_RANGE;
+	h.backgroundFlag = vol.background.flag;
+	h.backgroundSDF = vol.background.sdf;
+	h.numBlocks = keys.size();
+	h.numVoxels = blocks ? h.numBlocks * TSDF_BLOCK_VOXELS : (uint64_t)vol.res[0] * vol.res[1] * vol.res[2];
+	h.keyOffset = AlignVolumeFileOffset(sizeof(h));
+	h.sdfOffset = AlignVolumeFileOffset(h.keyOffset + h.numBlocks * sizeof(int64_t));
+	h.weightOffset = AlignVolumeFileOffset(h.sdfOffset + h.numVoxels * sizeof(int16_t));
+	h.flagOffset = AlignVolumeFileOffset(h.weightOffset + h.numVoxels * sizeof(uint16_t));
+	h.colorOffset = AlignVolumeFileOffset(h.flagOffset + h.numVoxels);
+	uint64_t end = h.colorOffset + h.numVoxels * 3;
+
+	MeshFileWriter w;
+	if (!w.Open(path)) return false;
+	uint64_t written = 0;
+	auto padTo = [&](uint64_t offset) {
+		static const char zeros[TSDF_FILE_ALIGN] = {};
+		w.Bytes(zeros, (size_t)(offset - written));
+		written = offset;
+	};
+	w.Bytes(&h, sizeof(h));
+	written = sizeof(h);
+	padTo(h.keyOffset);
+	if (!keys.empty()) w.Bytes(keys.data(), keys.size() * sizeof(int64_t));
+	written += keys.size() * sizeof(int64_t);
+
+	// every channel is one pass over the stored rows, a row of a brick is contiguous in the channel for both storage modes
+	auto channel = [&](uint64_t offset, auto& values, int perVoxel, auto background) {
+		padTo(offset);
+		if (blocks) {
+			for (size_t s = 0; s < keys.size(); s++) {
+				int bi = (int)(keys[s] % vol.blockRes[0]);
+				int bj = (int)((keys[s] / vol.blockRes[0]) % vol.blockRes[1]);
+				int bk = (int)(keys[s] / ((int64_t)vol.blockRes[0] * vol.blockRes[1]));
+				int o[3] = { bi << TSDF_BLOCK_SHIFT, bj << TSDF_BLOCK_SHIFT, bk << TSDF_BLOCK_SHIFT };
+				int n = std::min(TSDF_BLOCK_SIZE, vol.res[0] - o[0]);
+				for (int kk = 0; kk < TSDF_BLOCK_SIZE; kk++) {
+					for (int jj = 0; jj < TSDF_BLOCK_SIZE; jj++) {
+						int j = o[1] + jj, k = o[2] + kk;
+						int64_t ind = (j < vol.res[1] && k < vol.res[2]) ? vol.VoxelIndex(o[0], j, k) : -1;
+						WriteVolumeRun(w, values, ind, n, perVoxel, true, background);
+					}
+				}
+			}
+		}
+		else {
+			for (int k = 0; k < vol.res[2]; k++) {
+				for (int j = 0; j < vol.res[1]; j++) {
+					for (int i = 0; i < vol.res[0]; i += TSDF_BLOCK_SIZE) {
+						WriteVolumeRun(w, values, vol.VoxelIndex(i, j, k), std::min(TSDF_BLOCK_SIZE, vol.res[0] - i), perVoxel, false, background);
+					}
+				}
+			}
+		}
+		written = offset + h.numVoxels * perVoxel * sizeof(background);
+	};
+	channel(h.sdfOffset, vol.sdfs, 1, TSDFVolume::EncodeSDF(vol.background.sdf));
+	channel(h.weightOffset, vol.weights, 1, (uint16_t)0);
+	channel(h.flagOffset, vol.flags, 1, (uint8_t)vol.background.flag);
+	channel(h.colorOffset, vol.colors, 3, (uint8_t)0);
+	if (!w.Close() || written != end) {
+		std::cout << "VOLUMEFILE: could not write " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/* open a volume file in place: the header and (blocks layout) the block keys are read, the channels are mapped
+- returns nullptr (and says why) if the file is missing, truncated or from another build configuration
+- grid files load as dense volumes, blocks files as sparse ones, both can be integrated into again
+*/
+inline std::unique_ptr<TSDFVolume> LoadVolume(const std::string& path) {
+	std::shared_ptr<MappedFile> file(new MappedFile);
+	if (!file->Open(path)) {
+		std::cout << "VOLUMEFILE: could not open " << path << std::endl;
+		return nullptr;
+	}
+	TSDFVolumeFileHeader h;
+	if (file->size < sizeof(h)) {
+		std::cout << "VOLUMEFILE: " << path << " is not a volume file" << std::endl;
+		return nullptr;
+	}
+	memcpy(&h, file->data, sizeof(h));
+	if (memcmp(h.magic, TSDF_FILE_MAGIC, sizeof(TSDF_FILE_MAGIC)) != 0 || h.version != TSDF_FILE_VERSION) {
+		std::cout << "VOLUMEFILE: " << path << " is not a version " << TSDF_FILE_VERSION << " volume file" << std::endl;
+		return nullptr;
+	}
+	if (h.blockSize != TSDF_BLOCK_SIZE || h.sdfRange != TSDF_SDF_RANGE) {
+		std::cout << "VOLUMEFILE: " << path << " was saved with block size " << h.blockSize << " and sdf range " << h.sdfRange
+			<< ", this build uses " << TSDF_BLOCK_SIZE << " and " << TSDF_SDF_RANGE << std::endl;
+		return nullptr;
+	}
+	bool blocks = (h.layout == TSDF_SPARSE);
+	uint64_t gridVoxels = (uint64_t)h.res[0] * h.res[1] * h.res[2];
+	uint64_t offsets[5] = { h.keyOffset, h.sdfOffset, h.weightOffset, h.flagOffset, h.colorOffset };
+	uint64_t lengths[5] = { h.numBlocks * sizeof(int64_t), h.numVoxels * sizeof(int16_t), h.numVoxels * sizeof(uint16_t), h.numVoxels, h.numVoxels * 3 };
+	bool sizesOk = (h.layout == TSDF_DENSE || blocks) && h.res[0] > 0 && h.res[1] > 0 && h.res[2] > 0
+		&& h.numVoxels == (blocks ? h.numBlocks * TSDF_BLOCK_VOXELS : gridVoxels);
+	for (int c = 0; c < 5; c++) {
+		sizesOk = sizesOk && offsets[c] % TSDF_FILE_ALIGN == 0 && offsets[c] <= file->size && lengths[c] <= file->size - offsets[c];
+	}
+	if (!sizesOk) {
+		std::cout << "VOLUMEFILE: " << path << " is truncated or damaged" << std::endl;
+		return nullptr;
+	}
+
+	// built as an empty sparse volume so nothing is allocated, then switched to the layout of the file
+	Eigen::Vector3d center(h.center[0], h.center[1], h.center[2]), size(h.size[0], h.size[1], h.size[2]);
+	std::unique_ptr<TSDFVolume> vol(new TSDFVolume(h.res[0], h.res[1], h.res[2], center, size, TSDF_SPARSE));
+	for (int a = 0; a < 3; a++) vol->vSize[a] = h.voxelSize[a];
+	vol->truncMargin = h.truncMargin;
+	vol->truncDelta = h.truncDelta;
+	vol->background.flag = h.backgroundFlag;
+	vol->background.sdf = h.backgroundSDF;
+	if (blocks) {
+		const int64_t* keys = (const int64_t*)(file->data + h.keyOffset);
+		int64_t numKeys = (int64_t)vol->blockRes[0] * vol->blockRes[1] * vol->blockRes[2];
+		vol->blockKeys.assign(keys, keys + h.numBlocks);
+		vol->blockMap.reserve(h.numBlocks);
+		for (size_t s = 0; s < h.numBlocks; s++) {
+			// a key outside the block grid (or twice) would be read out of bounds by the extraction
+			if (keys[s] < 0 || keys[s] >= numKeys || !vol->blockMap.emplace(keys[s], (int)s).second) {
+				std::cout << "VOLUMEFILE: " << path << " is truncated or damaged (block " << s << ")" << std::endl;
+				return nullptr;
+			}
+		}
+	}
+	else {
+		vol->storage = TSDF_DENSE;
+		int numBricks = vol->blockRes[0] * vol->blockRes[1] * vol->blockRes[2];
+		vol->brickEpochs.reset(new std::atomic<uint32_t>[numBricks]);
+		for (int b = 0; b < numBricks; b++) vol->brickEpochs[b].store(vol->epoch); // every brick of the file is live
+	}
+	vol->sdfs.Map((int16_t*)(file->data + h.sdfOffset), h.numVoxels, file);
+	vol->weights.Map((uint16_t*)(file->data + h.weightOffset), h.numVoxels, file);
+	vol->flags.Map(file->data + h.flagOffset, h.numVoxels, file);
+	vol->colors.Map(file->data + h.colorOffset, h.numVoxels * 3, file);
+	vol->InvalidateBrickRanges(); // the stored ranges are rescanned from the file by the first extraction
+	return vol;
+}
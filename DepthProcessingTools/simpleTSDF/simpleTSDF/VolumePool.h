@@ -0,0 +1,56 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include "TSDFVolume.h"
+
+/* volumes shared by the frames in flight, so a take allocates its grids once
+- Acquire() hands out a free volume placed at the requested box and reset (O(1) when dense, see TSDFVolume::TouchBrick)
+- a volume is only reallocated when it was built with another resolution, storage mode (autobounds) or without voxel colours,
+  sparse volumes keep the capacity of their block arrays between frames
+- at most 'capacity' volumes exist, Acquire() blocks until one is released
+*/
+class VolumePool {
+public:
+	VolumePool(int capacity) : capacity(capacity < 1 ? 1 : capacity) {}
+
+	TSDFVolume* Acquire(const int res[3], Eigen::Vector3d& center, Eigen::Vector3d& size, int storage, bool voxelColors = true) {
+		std::unique_lock<std::mutex> lock(mutex);
+		released.wait(lock, [&] { return !freeVolumes.empty() || (int)volumes.size() < capacity; });
+		TSDFVolume* vol = nullptr;
+		for (size_t f = 0; f < freeVolumes.size() && !vol; f++) {
+			TSDFVolume* v = freeVolumes[f];
+			if (v->storage == storage && v->voxelColors == voxelColors && v->res[0] == res[0] && v->res[1] == res[1] && v->res[2] == res[2]) {
+				vol = v;
+				freeVolumes.erase(freeVolumes.begin() + f);
+			}
+		}
+		if (!vol) {
+			if ((int)volumes.size() == capacity) { // no matching grid, rebuild the oldest free one
+				TSDFVolume* old = freeVolumes.front();
+				freeVolumes.erase(freeVolumes.begin());
+				for (size_t v = 0; v < volumes.size(); v++) {
+					if (volumes[v].get() == old) volumes.erase(volumes.begin() + v);
+				}
+			}
+			volumes.emplace_back(new TSDFVolume(res[0], res[1], res[2], center, size, storage, voxelColors));
+			vol = volumes.back().get();
+		}
+		vol->Place(center, size);
+		vol->reset();
+		return vol;
+	}
+	void Release(TSDFVolume* vol) {
+		std::lock_guard<std::mutex> lock(mutex);
+		freeVolumes.push_back(vol);
+		released.notify_one();
+	}
+
+private:
+	int capacity;
+	std::vector<std::unique_ptr<TSDFVolume>> volumes;
+	std::vector<TSDFVolume*> freeVolumes;
+	std::mutex mutex;
+	std::condition_variable released;
+};
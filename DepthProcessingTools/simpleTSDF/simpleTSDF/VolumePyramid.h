@@ -0,0 +1,163 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "Eigen/Core"
+#include "TSDFVolume.h"
+
+/* mip pyramid of a TSDFVolume, the levels of detail of a frame from one integration (simpleTSDF --lods, pyTSDF Volume.downsample)
+- level l has half the resolution of level l-1 (rounded up) over the same grid origin, level 0 is the volume itself
+- a coarse voxel sits at the centre of its 2x2x2 children and is their weighted mean: sdf and colour are averaged over
+  the observed children by their weights, without any it stays unseen background (carved VOXEL_EMPTY if a child was carved)
+- the levels keep the metric truncation margin of the volume, so the normalised band narrows in voxels level by level
+  (1.5 voxels at level 1 with the default 3): the sign changes marching cubes needs are kept, the surface is placed coarser
+- every level is a volume of its own and meshes as a closed surface, a level of detail has no cracks to stitch
+- dense levels only write the bricks over live bricks of the finer level, sparse levels allocate the parents of its blocks
+*/
+class VolumePyramid {
+public:
+	/* up to numLevels coarser levels of base, it stops before a level would have fewer than TSDF_BLOCK_SIZE voxels a side */
+	void Build(TSDFVolume& base, int numLevels) {
+		levels.clear();
+		TSDFVolume* fine = &base;
+		for (int l = 0; l < numLevels; l++) {
+			if (std::min(fine->res[0], std::min(fine->res[1], fine->res[2])) < 2 * TSDF_BLOCK_SIZE) break;
+			levels.push_back(Downsample(*fine));
+			fine = levels.back().get();
+		}
+	}
+	/* coarse levels built, Level(1) .. Level(NumLevels()) */
+	int NumLevels() const { return (int)levels.size(); }
+	TSDFVolume& Level(int l) { return *levels[l - 1]; }
+
+	/* the next coarser level of fine */
+	static std::unique_ptr<TSDFVolume> Downsample(TSDFVolume& fine) {
+		int res[3];
+		Eigen::Vector3d origin = fine.center - fine.sz / 2, sz, center;
+		for (int a = 0; a < 3; a++) {
+			res[a] = (fine.res[a] + 1) / 2;
+			sz[a] = res[a] * 2 * fine.vSize[a]; // an odd resolution grows by half a coarse voxel
+		}
+		center = origin + sz / 2;
+		std::unique_ptr<TSDFVolume> coarse(new TSDFVolume(res[0], res[1], res[2], center, sz, fine.storage, fine.voxelColors));
+		coarse->truncMargin = fine.truncMargin;
+		coarse->truncDelta = fine.truncDelta;
+
+		// coarse bricks over live fine ones: a coarse block covers 2x2x2 fine blocks
+		std::vector<int> bricks;
+		if (fine.storage == TSDF_SPARSE) {
+			for (int s = 0; s < fine.NumAllocatedBlocks(); s++) {
+				int bi, bj, bk;
+				fine.GetBlockCoords(s, bi, bj, bk);
+				coarse->AllocateBlock(bi >> 1, bj >> 1, bk >> 1);
+			}
+			for (int s = 0; s < coarse->NumAllocatedBlocks(); s++) bricks.push_back(s);
+		}
+		else {
+			for (int b = 0; b < coarse->blockRes[0] * coarse->blockRes[1] * coarse->blockRes[2]; b++) {
+				int o[3];
+				coarse->BrickOrigin(b, o[0], o[1], o[2]);
+				int64_t base[8];
+				if (ChildBlocks(fine, o, base)) bricks.push_back(b);
+			}
+		}
+
+#pragma omp parallel for schedule(dynamic)
+		for (int q = 0; q < (int)bricks.size(); q++) {
+			int o[3];
+			coarse->BrickOrigin(bricks[q], o[0], o[1], o[2]);
+			int64_t base[8];
+			ChildBlocks(fine, o, base);
+			if (coarse->storage == TSDF_DENSE) coarse->TouchBrick(bricks[q]);
+			for (int k = o[2]; k < std::min(o[2] + TSDF_BLOCK_SIZE, res[2]); k++) {
+				for (int j = o[1]; j < std::min(o[1] + TSDF_BLOCK_SIZE, res[1]); j++) {
+					for (int i = o[0]; i < std::min(o[0] + TSDF_BLOCK_SIZE, res[0]); i++) {
+						DownsampleVoxel(fine, *coarse, base, i, j, k);
+					}
+				}
+			}
+		}
+		coarse->InvalidateBrickRanges();
+		return coarse;
+	}
+
+private:
+	/* address base of the 2x2x2 fine blocks under the coarse brick at voxel origin o (x fastest), -1 where they read
+	   as background (unallocated, stale or outside the grid); false if all of them do */
+	static bool ChildBlocks(TSDFVolume& fine, const int o[3], int64_t base[8]) {
+		bool any = false;
+		for (int n = 0; n < 8; n++) {
+			int bi = (o[0] >> (TSDF_BLOCK_SHIFT - 1)) + (n & 1);
+			int bj = (o[1] >> (TSDF_BLOCK_SHIFT - 1)) + ((n >> 1) & 1);
+			int bk = (o[2] >> (TSDF_BLOCK_SHIFT - 1)) + (n >> 2);
+			base[n] = -1;
+			if (bi >= fine.blockRes[0] || bj >= fine.blockRes[1] || bk >= fine.blockRes[2]) continue;
+			if (fine.storage == TSDF_SPARSE) {
+				int slot = fine.FindBlock(bi, bj, bk);
+				if (slot >= 0) base[n] = (int64_t)slot * TSDF_BLOCK_VOXELS;
+			}
+			else if (fine.BrickLive(IND2LINEAR(bi, bj, bk, fine.blockRes[0], fine.blockRes[1], fine.blockRes[2]))) {
+				base[n] = 0;
+			}
+			any |= base[n] >= 0;
+		}
+		return any;
+	}
+	/* coarse voxel (i,j,k) from its children, base from ChildBlocks() for its brick
+	   - the children 2i..2i+1 (and so on) never straddle a block border, they are read from one block at fixed offsets
+	*/
+	static void DownsampleVoxel(TSDFVolume& fine, TSDFVolume& coarse, const int64_t base[8], int i, int j, int k) {
+		int fi = 2 * i, fj = 2 * j, fk = 2 * k;
+		int64_t b = base[((fi >> TSDF_BLOCK_SHIFT) & 1) + 2 * ((fj >> TSDF_BLOCK_SHIFT) & 1) + 4 * ((fk >> TSDF_BLOCK_SHIFT) & 1)];
+		if (b < 0) return; // background, the coarse voxel too
+		int64_t ind0, step[3];
+		if (fine.storage == TSDF_SPARSE) {
+			ind0 = b + IND2LINEAR(fi & TSDF_BLOCK_MASK, fj & TSDF_BLOCK_MASK, fk & TSDF_BLOCK_MASK, TSDF_BLOCK_SIZE, TSDF_BLOCK_SIZE, TSDF_BLOCK_SIZE);
+			step[0] = 1, step[1] = TSDF_BLOCK_SIZE, step[2] = TSDF_BLOCK_SIZE * TSDF_BLOCK_SIZE;
+		}
+		else {
+			ind0 = IND2LINEAR((int64_t)fi, fj, fk, fine.res[0], fine.res[1], fine.res[2]);
+			step[0] = 1, step[1] = fine.res[0], step[2] = (int64_t)fine.res[0] * fine.res[1];
+		}
+		// an odd fine resolution leaves the last coarse voxel of an axis with one child along it
+		int n[3] = { fi + 1 < fine.res[0] ? 2 : 1, fj + 1 < fine.res[1] ? 2 : 1, fk + 1 < fine.res[2] ? 2 : 1 };
+		float sumW = 0, sumD = 0, sumC[3] = { 0, 0, 0 };
+		int observed = 0;
+		bool carved = false;
+		for (int z = 0; z < n[2]; z++) {
+			for (int y = 0; y < n[1]; y++) {
+				for (int x = 0; x < n[0]; x++) {
+					int64_t ind = ind0 + x * step[0] + y * step[1] + z * step[2];
+					if (fine.flags[ind] == VOXEL_EMPTY) carved = true;
+					float w = fine.GetWeight(ind);
+					if (w <= 0) continue;
+					sumW += w;
+					sumD += w * fine.GetSDF(ind);
+					if (fine.voxelColors) {
+						const uint8_t* rgb = fine.GetColor(ind);
+						for (int a = 0; a < 3; a++) sumC[a] += w * rgb[a];
+					}
+					observed++;
+				}
+			}
+		}
+		if (observed == 0 && !carved) return; // stays background
+		int64_t ind = coarse.VoxelIndex(i, j, k);
+		if (observed == 0) {
+			coarse.flags[ind] = VOXEL_EMPTY;
+			coarse.SetSDF(ind, VOXEL_MAXDIST);
+			coarse.weights[ind] = 0;
+			return;
+		}
+		coarse.SetSDF(ind, sumD / sumW);
+		coarse.SetWeight(ind, sumW / observed);
+		coarse.flags[ind] = VOXEL_FULL;
+		if (coarse.voxelColors) {
+			uint8_t* rgb = coarse.GetColor(ind);
+			for (int a = 0; a < 3; a++) rgb[a] = (uint8_t)(sumC[a] / sumW + 0.5f);
+		}
+	}
+
+	std::vector<std::unique_ptr<TSDFVolume>> levels;
+};
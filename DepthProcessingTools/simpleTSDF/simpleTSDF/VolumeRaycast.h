@@ -0,0 +1,343 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include "Eigen/Core"
+#include "TSDFVolume.h"
+
+#define RAYCAST_MIN_STEP 0.5f   // voxels, the shortest step inside a brick that may hold the surface
+#define RAYCAST_STEP_SCALE 0.8f // of the sdf distance, the sdf is measured along the capturing camera's rays and overshoots at grazing angles
+
+/* what a camera sees of the volume's isosurface, width x height pixels row after row */
+struct RaycastImage {
+	int width = 0, height = 0;
+	std::vector<uint8_t> bgr; // shaded voxel colour (grey when the volume has none), black where the ray hits nothing
+	std::vector<float> depth; // camera space z of the surface in metres, 0 where the ray hits nothing
+};
+
+/* rendered against captured depth over the foreground (matte > 200) of one camera */
+struct RaycastResidual {
+	int64_t both = 0;            // pixels with a captured and a rendered depth
+	int64_t captureOnly = 0;     // captured foreground the volume does not show
+	int64_t renderOnly = 0;      // surface rendered where nothing was captured
+	double meanAbs = 0, rms = 0; // metres, over both
+	double mean = 0;             // rendered - captured, metres (> 0: the surface lies behind the samples)
+};
+
+/* sphere tracing preview of a TSDFVolume from any pinhole camera, no mesh (simpleTSDF --render, pyTSDF Volume.render)
+- rays walk the 8^3 bricks with a 3D DDA and skip the ones that cannot hold the isosurface (see TSDFVolume::BrickIsActive),
+  inside the others they step by the trilinear sdf (at least RAYCAST_MIN_STEP voxels) until it drops below the isolevel
+- the band sdf is in units of the truncation margin, so the steps only use the sdf when the volume knows its margin
+- the hit is placed by a secant step between the samples around the crossing, the normal is the sdf gradient there
+- shading: voxel colour (trilinear over the observed corners) times a head light, ambient plus diffuse
+- the volume is only read, rows run in parallel; the constructor brings the (dense) brick ranges up to date
+*/
+class VolumeRaycaster {
+public:
+	VolumeRaycaster(TSDFVolume& vol, float isolevel) : vol(vol), isolevel(isolevel) {
+		int numBricks = vol.blockRes[0] * vol.blockRes[1] * vol.blockRes[2];
+		blockBase.assign(numBricks, -1);
+		active.assign(numBricks, 0);
+		outside.assign(numBricks, 0);
+		if (vol.storage == TSDF_SPARSE) {
+			// the sparse brick ranges are widened for marching cubes, here a block only needs the voxels its cells
+			// read: its own and those of its upper neighbours (the background where they are not allocated)
+			std::vector<int16_t> ownMin(numBricks, TSDFVolume::EncodeSDF(vol.background.sdf)), ownMax(ownMin);
+			for (int s = 0; s < vol.NumAllocatedBlocks(); s++) {
+				int bi, bj, bk;
+				vol.GetBlockCoords(s, bi, bj, bk);
+				blockBase[IND2LINEAR(bi, bj, bk, vol.blockRes[0], vol.blockRes[1], vol.blockRes[2])] = (int64_t)s * TSDF_BLOCK_VOXELS;
+			}
+#pragma omp parallel for schedule(dynamic, 64)
+			for (int b = 0; b < numBricks; b++) {
+				if (blockBase[b] < 0) continue;
+				const int16_t* q = &vol.sdfs[blockBase[b]];
+				ownMin[b] = *std::min_element(q, q + TSDF_BLOCK_VOXELS);
+				ownMax[b] = *std::max_element(q, q + TSDF_BLOCK_VOXELS);
+			}
+#pragma omp parallel for schedule(dynamic, 64)
+			for (int b = 0; b < numBricks; b++) {
+				int c[3] = { b % vol.blockRes[0], (b / vol.blockRes[0]) % vol.blockRes[1], b / (vol.blockRes[0] * vol.blockRes[1]) };
+				int16_t lo = ownMin[b], hi = ownMax[b];
+				for (int n = 1; n < 8; n++) {
+					int ni = c[0] + (n & 1), nj = c[1] + ((n >> 1) & 1), nk = c[2] + (n >> 2);
+					if (ni >= vol.blockRes[0] || nj >= vol.blockRes[1] || nk >= vol.blockRes[2]) continue;
+					int nb = IND2LINEAR(ni, nj, nk, vol.blockRes[0], vol.blockRes[1], vol.blockRes[2]);
+					lo = std::min(lo, ownMin[nb]);
+					hi = std::max(hi, ownMax[nb]);
+				}
+				float fLo = TSDFVolume::DecodeSDF(lo), fHi = TSDFVolume::DecodeSDF(hi);
+				active[b] = fLo < isolevel && fHi >= isolevel;
+				outside[b] = fLo >= isolevel;
+			}
+		}
+		else {
+			if (!vol.bricksValid) vol.UpdateBrickRanges();
+			for (int b = 0; b < numBricks; b++) {
+				if (vol.BrickLive(b)) blockBase[b] = 0;
+				active[b] = vol.BrickIsActive(b, isolevel);
+				outside[b] = vol.brickMin[b] >= isolevel;
+			}
+		}
+		// grid box of the active bricks, rays are clipped to it
+		int lo[3] = { INT_MAX, INT_MAX, INT_MAX }, hi[3] = { -1, -1, -1 };
+		for (int b = 0; b < numBricks; b++) {
+			if (!active[b]) continue;
+			int c[3] = { b % vol.blockRes[0], (b / vol.blockRes[0]) % vol.blockRes[1], b / (vol.blockRes[0] * vol.blockRes[1]) };
+			for (int a = 0; a < 3; a++) {
+				lo[a] = std::min(lo[a], c[a]);
+				hi[a] = std::max(hi[a], c[a]);
+			}
+		}
+		for (int a = 0; a < 3; a++) {
+			if (hi[a] < 0) { // nothing to hit
+				boxLo[a] = 1;
+				boxHi[a] = 0;
+				continue;
+			}
+			boxLo[a] = (float)(lo[a] * TSDF_BLOCK_SIZE);
+			boxHi[a] = (float)std::min((hi[a] + 1) * TSDF_BLOCK_SIZE, vol.res[a] - 1);
+		}
+		for (int a = 0; a < 3; a++) {
+			origin[a] = (float)(vol.center[a] - vol.sz[a] / 2);
+			vSize[a] = (float)vol.vSize[a];
+		}
+		minStep = RAYCAST_MIN_STEP * std::min({ vSize[0], vSize[1], vSize[2] });
+		bgSDF = vol.background.sdf;
+	}
+
+	/* render the camera with intrinsics in and world -> camera transform exInv into out */
+	void Render(const Eigen::Matrix3d& in, const Eigen::Matrix4d& exInv, int width, int height, RaycastImage& out) const {
+		out.width = width;
+		out.height = height;
+		out.bgr.assign((size_t)width * height * 3, 0);
+		out.depth.assign((size_t)width * height, 0);
+		Eigen::Matrix3f Rt = exInv.block<3, 3>(0, 0).transpose().cast<float>();
+		Eigen::Vector3f eye = -Rt * exInv.block<3, 1>(0, 3).cast<float>();
+		float fx = (float)in(0, 0), fy = (float)in(1, 1), cx = (float)in(0, 2), cy = (float)in(1, 2);
+#pragma omp parallel for schedule(dynamic)
+		for (int v = 0; v < height; v++) {
+			for (int u = 0; u < width; u++) {
+				// camera ray with z = 1, so the ray parameter is the camera space depth
+				Eigen::Vector3f dir = Rt * Eigen::Vector3f((u + 0.5f - cx) / fx, (v + 0.5f - cy) / fy, 1);
+				size_t pix = (size_t)v * width + u;
+				float t;
+				Eigen::Vector3f g;
+				if (!Trace(eye, dir, t, g)) continue;
+				out.depth[pix] = t;
+				Shade(g, dir, &out.bgr[3 * pix]);
+			}
+		}
+	}
+	void Render(const TSDFCameraView& view, RaycastImage& out) const {
+		Render(view.in, view.exInv, view.width, view.height, out);
+	}
+
+	/* compare a rendering of view (same size) with the depth it captured */
+	static RaycastResidual Residual(const RaycastImage& img, const TSDFCameraView& view) {
+		RaycastResidual r;
+		double sum = 0, sumAbs = 0, sumSq = 0;
+		for (int v = 0; v < view.height; v++) {
+			for (int u = 0; u < view.width; u++) {
+				float rendered = img.depth[(size_t)v * img.width + u];
+				float captured = (float)view.pointcloud[3 * ((size_t)u + (size_t)v * view.width) + 2] / 1000.f;
+				bool seen = view.matte[v * view.matteStep + (size_t)u * view.matteChannels] > 200 && captured > 0 && captured < 3;
+				if (rendered > 0 && seen) {
+					double d = rendered - captured;
+					sum += d;
+					sumAbs += std::abs(d);
+					sumSq += d * d;
+					r.both++;
+				}
+				else if (seen) r.captureOnly++;
+				else if (rendered > 0) r.renderOnly++;
+			}
+		}
+		if (r.both > 0) {
+			r.mean = sum / r.both;
+			r.meanAbs = sumAbs / r.both;
+			r.rms = std::sqrt(sumSq / r.both);
+		}
+		return r;
+	}
+
+private:
+	/* first crossing of the isolevel from outside along eye + t dir, t and the grid position of the hit */
+	bool Trace(const Eigen::Vector3f& eye, const Eigen::Vector3f& dir, float& tHit, Eigen::Vector3f& gHit) const {
+		// grid coordinates: voxel centers at integers, the trilinear samples need [0, res-1] (clipped to the active bricks)
+		Eigen::Vector3f g0, gd;
+		for (int a = 0; a < 3; a++) {
+			g0[a] = (eye[a] - origin[a]) / vSize[a] - 0.5f;
+			gd[a] = dir[a] / vSize[a];
+		}
+		float tMin = 0, tMax = INFINITY;
+		for (int a = 0; a < 3; a++) {
+			if (gd[a] == 0) {
+				if (g0[a] < boxLo[a] || g0[a] > boxHi[a]) return false;
+				continue;
+			}
+			float t0 = (boxLo[a] - g0[a]) / gd[a], t1 = (boxHi[a] - g0[a]) / gd[a];
+			if (t0 > t1) std::swap(t0, t1);
+			tMin = std::max(tMin, t0);
+			tMax = std::min(tMax, t1);
+		}
+		if (!(tMin < tMax)) return false;
+		float stepScale = 1.0f / dir.norm(); // metres along the ray -> t
+
+		// brick DDA, bricks are 8 grid units wide
+		int b[3], step[3];
+		float tNext[3], tDelta[3];
+		Eigen::Vector3f gStart = g0 + tMin * gd;
+		for (int a = 0; a < 3; a++) {
+			b[a] = std::min(std::max((int)std::floor(gStart[a] / TSDF_BLOCK_SIZE), 0), vol.blockRes[a] - 1);
+			step[a] = (gd[a] > 0) ? 1 : -1;
+			if (gd[a] == 0) {
+				tNext[a] = tDelta[a] = INFINITY;
+				continue;
+			}
+			float boundary = (float)((b[a] + (step[a] > 0 ? 1 : 0)) * TSDF_BLOCK_SIZE);
+			tNext[a] = (boundary - g0[a]) / gd[a];
+			tDelta[a] = TSDF_BLOCK_SIZE / std::abs(gd[a]);
+		}
+		// the last sample (or the exit of a skipped outside brick, sampled only if needed) while the ray is outside
+		float t = tMin, tPrev = 0, fPrev = NAN;
+		bool wasOutside = false;
+		auto hit = [&](float f) {
+			if (std::isnan(fPrev)) fPrev = Sample(g0 + tPrev * gd);
+			tHit = (fPrev < isolevel) ? tPrev : Refine(g0, gd, tPrev, fPrev, t, f);
+			gHit = g0 + tHit * gd;
+			return true;
+		};
+		for (;;) {
+			int brick = IND2LINEAR(b[0], b[1], b[2], vol.blockRes[0], vol.blockRes[1], vol.blockRes[2]);
+			float tExit = std::min({ tNext[0], tNext[1], tNext[2], tMax });
+			if (active[brick]) {
+				while (t < tExit) {
+					float f = Sample(g0 + t * gd);
+					if (f < isolevel && wasOutside) return hit(f);
+					wasOutside = f >= isolevel;
+					tPrev = t;
+					fPrev = f;
+					float dist = (vol.truncMargin > 0) ? std::abs(f - isolevel) * vol.truncMargin * RAYCAST_STEP_SCALE : 0;
+					t += std::max(dist, minStep) * stepScale;
+				}
+			}
+			else if (t < tExit) {
+				// nothing crosses inside the brick, but the surface may lie between the last sample and an all inside brick
+				if (!outside[brick] && wasOutside) return hit(Sample(g0 + t * gd));
+				wasOutside = outside[brick];
+				tPrev = t = tExit;
+				fPrev = NAN;
+			}
+			if (tExit >= tMax) return false;
+			int a = (tNext[0] <= tNext[1] && tNext[0] <= tNext[2]) ? 0 : (tNext[1] <= tNext[2]) ? 1 : 2;
+			b[a] += step[a];
+			if (b[a] < 0 || b[a] >= vol.blockRes[a]) return false;
+			tNext[a] += tDelta[a];
+		}
+	}
+	/* isolevel crossing between (t0, f0 >= isolevel) and (t1, f1 < isolevel), one secant step refined */
+	float Refine(const Eigen::Vector3f& g0, const Eigen::Vector3f& gd, float t0, float f0, float t1, float f1) const {
+		float t = t0 + (t1 - t0) * (f0 - isolevel) / std::max(f0 - f1, 1e-12f);
+		float f = Sample(g0 + t * gd);
+		if (f < isolevel) {
+			t1 = t;
+			f1 = f;
+		}
+		else {
+			t0 = t;
+			f0 = f;
+		}
+		return t0 + (t1 - t0) * (f0 - isolevel) / std::max(f0 - f1, 1e-12f);
+	}
+
+	/* the 8 voxels around grid point g (address or -1 for background) and their trilinear weights */
+	void Corners(const Eigen::Vector3f& g, int64_t ind[8], float w[8]) const {
+		int c0[3];
+		float fr[3];
+		for (int a = 0; a < 3; a++) {
+			float x = std::min(std::max(g[a], 0.0f), (float)(vol.res[a] - 1));
+			c0[a] = std::min((int)x, vol.res[a] - 2);
+			fr[a] = x - c0[a];
+		}
+		for (int c = 0; c < 8; c++) {
+			w[c] = ((c & 1) ? fr[0] : 1 - fr[0]) * (((c >> 1) & 1) ? fr[1] : 1 - fr[1]) * ((c >> 2) ? fr[2] : 1 - fr[2]);
+		}
+		int64_t step[3];
+		if (vol.storage == TSDF_SPARSE) {
+			step[0] = 1;
+			step[1] = TSDF_BLOCK_SIZE;
+			step[2] = TSDF_BLOCK_SIZE * TSDF_BLOCK_SIZE;
+		}
+		else {
+			step[0] = 1;
+			step[1] = vol.res[0];
+			step[2] = (int64_t)vol.res[0] * vol.res[1];
+		}
+		if ((c0[0] & TSDF_BLOCK_MASK) != TSDF_BLOCK_MASK
+			&& (c0[1] & TSDF_BLOCK_MASK) != TSDF_BLOCK_MASK && (c0[2] & TSDF_BLOCK_MASK) != TSDF_BLOCK_MASK) {
+			// all 8 in one brick (the common case)
+			int64_t first = Address(c0[0], c0[1], c0[2]);
+			for (int c = 0; c < 8; c++) {
+				ind[c] = (first < 0) ? -1 : first + ((c & 1) ? step[0] : 0) + (((c >> 1) & 1) ? step[1] : 0) + ((c >> 2) ? step[2] : 0);
+			}
+			return;
+		}
+		for (int c = 0; c < 8; c++) ind[c] = Address(c0[0] + (c & 1), c0[1] + ((c >> 1) & 1), c0[2] + (c >> 2));
+	}
+	/* address of voxel (i,j,k), -1 for background */
+	int64_t Address(int i, int j, int k) const {
+		int64_t base = blockBase[IND2LINEAR(i >> TSDF_BLOCK_SHIFT, j >> TSDF_BLOCK_SHIFT, k >> TSDF_BLOCK_SHIFT, vol.blockRes[0], vol.blockRes[1], vol.blockRes[2])];
+		if (base < 0) return -1;
+		if (vol.storage == TSDF_SPARSE) return base + IND2LINEAR(i & TSDF_BLOCK_MASK, j & TSDF_BLOCK_MASK, k & TSDF_BLOCK_MASK, TSDF_BLOCK_SIZE, TSDF_BLOCK_SIZE, TSDF_BLOCK_SIZE);
+		return IND2LINEAR((int64_t)i, j, k, vol.res[0], vol.res[1], vol.res[2]);
+	}
+	float Sample(const Eigen::Vector3f& g) const {
+		int64_t ind[8];
+		float w[8];
+		Corners(g, ind, w);
+		float f = 0;
+		for (int c = 0; c < 8; c++) f += w[c] * ((ind[c] < 0) ? bgSDF : TSDFVolume::DecodeSDF(vol.sdfs[ind[c]]));
+		return f;
+	}
+	/* head light shading of the hit at grid point g seen along dir */
+	void Shade(const Eigen::Vector3f& g, const Eigen::Vector3f& dir, uint8_t* bgr) const {
+		Eigen::Vector3f n;
+		for (int a = 0; a < 3; a++) {
+			Eigen::Vector3f e = Eigen::Vector3f::Zero();
+			e[a] = 1;
+			n[a] = (Sample(g + e) - Sample(g - e)) / vSize[a];
+		}
+		float len = n.norm();
+		float light = (len > 0) ? std::abs(n.dot(dir)) / (len * dir.norm()) : 1;
+		float shade = 0.25f + 0.75f * light;
+		float rgb[3] = { 200, 200, 200 };
+		if (vol.voxelColors) {
+			int64_t ind[8];
+			float w[8];
+			Corners(g, ind, w);
+			float sum = 0, acc[3] = { 0, 0, 0 };
+			for (int c = 0; c < 8; c++) {
+				if (ind[c] < 0 || vol.weights[ind[c]] == 0) continue;
+				for (int x = 0; x < 3; x++) acc[x] += w[c] * vol.colors[3 * ind[c] + x];
+				sum += w[c];
+			}
+			if (sum > 0) {
+				for (int x = 0; x < 3; x++) rgb[x] = acc[x] / sum;
+			}
+		}
+		for (int x = 0; x < 3; x++) bgr[2 - x] = (uint8_t)std::min(rgb[x] * shade + 0.5f, 255.0f);
+	}
+
+	TSDFVolume& vol;
+	float isolevel;
+	std::vector<int64_t> blockBase; // per brick of the block grid: -1 background, else added to the in-block offset (sparse) or 0 (dense)
+	std::vector<uint8_t> active;    // may hold the isosurface
+	std::vector<uint8_t> outside;   // inactive and entirely at or above the isolevel
+	float boxLo[3], boxHi[3];       // grid box of the active bricks (empty when lo > hi)
+	float origin[3], vSize[3];
+	float minStep;
+	float bgSDF;
+};
@@ -1,16 +1,36 @@
 #define _USE_MATH_DEFINES // for C++
 #include <cmath>
+#include <climits>
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <mutex>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "meshview/meshview.hpp"
 #include "meshview/meshview_imgui.hpp"
 #include "Eigen/Core"
 #include "Eigen/Geometry"
 #include "TSDFVolume.h"
+#include "MeshIO.h"
+#include "FramePipeline.h"
+#include "VolumePool.h"
+#include "DepthRegistration.h"
+#include "VolumeFile.h"
+#include "VisualHull.h"
+#include "IncrementalVolume.h"
+#include "MeshDecimate.h"
+#include "VolumeRaycast.h"
+#include "VolumePyramid.h"
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -30,11 +50,72 @@ struct _ioptions {
     std::vector<std::string> depthPaths;
     std::vector<std::string> mattePaths;
     int voxRes;
+    bool sparse;
+    bool indexed;
+    bool normals;
+    int smooth;
+    int smoothPasses;
+    bool carve;
+    std::string autoBounds;
+    bool asciiPly;
+    // frame pipeline (multi frame runs), defaults also used by oldmain()
+    int decodeThreads = 2;
+    int prefetch = 2;
+    int writeQueue = 2;
+    int inFlight = 1; // frames reconstructed at once, 0 = from memoryMB
+    int memoryMB = 8192;
+    // batch mode: frame range and the frame numbers it expands to
+    std::string frames;
+    std::vector<int> frameList;
+    // truncation band in voxels (same defaults as _VOXEL_TRUNC / _VOXEL_TRUNC_DELTA)
+    int truncVoxels = 3;
+    int truncDeltaVoxels = 5;
+    bool serve = false;
+    std::string registration = "k4a"; // depth to color: k4a transformation engine, native ray tables, or both compared
+    // volume files (see VolumeFile.h): saved per frame after the integration, or meshed again with --extract
+    std::string saveVolume;
+    bool volumeBlocks = false;
+    std::string extractVolume;
+    float isoLevel = NAN; // NAN = 1/(2 res), the level simpleTSDF always extracted
+    bool vertexColor = false;
+    bool hull = false; // preview: 1 bit visual hull of the mattes only (see VisualHull.h)
+    // frame to frame: only the bricks under changed pixels are integrated and meshed again (see IncrementalVolume.h)
+    bool incremental = false;
+    int changeTile = 16;
+    float changeDepth = 10; // mm
+    std::string extractor = "mc"; // marching cubes or surface nets (see TSDFVolume::PolygoniseSurfaceNets)
+    // indexed mesh decimation after extraction (see MeshDecimate.h), 0 = off
+    int decimate = 0;         // target faces
+    float decimateError = 0;  // metres
+    int lods = 0; // coarser levels of detail meshed from the volume's mip pyramid (see VolumePyramid.h)
+    // raycast previews of the volume (see VolumeRaycast.h), no mesh needed
+    std::string render;       // png, {frame} and {cam} templates
+    std::string renderCams;   // camera indices "0,2,5", empty = every camera (none with a look-at camera)
+    std::string renderLookAt; // "ex,ey,ez,tx,ty,tz" free camera in metres
+    std::vector<int> renderCamList;
+    std::vector<float> renderLookAtPoints; // eye then target, empty = none
+    bool noMesh = false;
 }ioptions;
 
 /*
 Samples command arguments:
 --extrinsics extrinsics.log -i intrinsics0 -r rgb0 -d depth0 -m matte0 -i intrinsics1 -r rgb1 -d depth1 -m matte1 etc....
+Batch (a whole take in one run, per take setup done once):
+--extrinsics extrinsics.log --frames 0:924 -i client_0/Intrinsics_Calib_0.json -i client_1/Intrinsics_Calib_1.json ...
+    -r client_{cam}/Color_{frame}.jpg -d client_{cam}/Depth_{frame}.tiff -m client_{cam}/Color_{frame}.matte.png -o ply/frame_{frame}.ply
+Keep the volumes, then mesh them again (other isolevel or smoothing) without the images:
+... --savevolume vol/frame_{frame}.tsdf
+--extract vol/frame_{frame}.tsdf --frames 0:924 --smooth 2 --isolevel 0 -o ply/frame_{frame}.ply
+Levels of detail from one integration, full resolution to lod/frame_{frame}_0.ply then 256, 128 and 64 voxels:
+... -v 512 -s -x --lods 3 -o lod/frame_{frame}_{lod}.ply
+Check a take without meshing it, every camera's view of the volume with its depth residual, plus one free camera:
+--render check/frame_{frame}_cam{cam}.png --renderlookat 0,0.5,-2.5,0,0,0 --nomesh ...
+On-set preview, the visual hull of the mattes only (no depth, no colour):
+--hull --frames 0:924 -v 256 ... -o preview/frame_{frame}.ply
+Mostly static takes (seated interviews), each frame only redoes the bricks under pixels that changed since the last one:
+--incremental --frames 0:924 -x -n ... -o ply/frame_{frame}.ply
+Server (jobs as JSON lines on stdin, see Serve()):
+--serve [any of the options above as defaults for the jobs]
 */
 cxxopts::ParseResult parse(int argc, char* argv[])
 {
@@ -46,11 +127,46 @@ cxxopts::ParseResult parse(int argc, char* argv[])
             .add_options()
             ("e,extrinsics", "path to extrinsics .log file"         , cxxopts::value<std::string>(ioptions.extrinsicsLogFilename))
             ("i,intrinsics", "path to intrinsics file (multiple)"   , cxxopts::value<std::vector<std::string>>(ioptions.intrinsicsPaths))
-            ("r,rgb", "path to rgb image (multiple)"                , cxxopts::value<std::vector<std::string>>(ioptions.rgbPaths))
-            ("d,depth", "path to depth TIFF image (multiple)"       , cxxopts::value<std::vector<std::string>>(ioptions.depthPaths))
-            ("m,matte", "path to matte image (multiple)"            , cxxopts::value<std::vector<std::string>>(ioptions.mattePaths))
-            ("o,outputFilename", "path to output .ply file"         , cxxopts::value<std::string>(ioptions.outputPlyFilename)->default_value("./output.ply"))
+            ("r,rgb", "path to rgb image (multiple, or one {cam} template)", cxxopts::value<std::vector<std::string>>(ioptions.rgbPaths))
+            ("d,depth", "path to depth TIFF image (multiple, or one {cam} template)", cxxopts::value<std::vector<std::string>>(ioptions.depthPaths))
+            ("m,matte", "path to matte image (multiple, or one {cam} template)", cxxopts::value<std::vector<std::string>>(ioptions.mattePaths))
+            ("o,outputFilename", "path to output .ply (or .obj) file", cxxopts::value<std::string>(ioptions.outputPlyFilename)->default_value("./output.ply"))
+            ("ascii", "write ascii instead of binary ply"           , cxxopts::value<bool>(ioptions.asciiPly)->default_value("false"))
             ("v,voxres", "Voxel Resolution (32/64/128/256)"         , cxxopts::value<int>(ioptions.voxRes)->default_value("128"))
+            ("s,sparse", "sparse block storage (for 512/1024 voxRes)", cxxopts::value<bool>(ioptions.sparse)->default_value("false"))
+            ("x,indexed", "write an indexed mesh with shared vertices", cxxopts::value<bool>(ioptions.indexed)->default_value("false"))
+            ("n,normals", "write vertex normals (indexed mesh only)", cxxopts::value<bool>(ioptions.normals)->default_value("false"))
+            ("smooth", "tsdf smoothing radius in voxels (0 = off)"  , cxxopts::value<int>(ioptions.smooth)->default_value("0"))
+            ("smoothpasses", "smoothing passes (3 ~ gaussian)"      , cxxopts::value<int>(ioptions.smoothPasses)->default_value("1"))
+            ("c,carve", "carve the visual hull of the mattes before integrating", cxxopts::value<bool>(ioptions.carve)->default_value("false"))
+            ("a,autobounds", "fit the volume to the silhouettes (off/voxelsize/voxelcount)", cxxopts::value<std::string>(ioptions.autoBounds)->default_value("off"))
+            ("decodethreads", "frames decoded in parallel ahead of the integration", cxxopts::value<int>(ioptions.decodeThreads)->default_value("2"))
+            ("prefetch", "decoded frames allowed to wait for the integration", cxxopts::value<int>(ioptions.prefetch)->default_value("2"))
+            ("writequeue", "meshes allowed to wait for the writer thread", cxxopts::value<int>(ioptions.writeQueue)->default_value("2"))
+            ("f,frames", "frame range start[:end[:step]] (end included) substituted for {frame} in the paths", cxxopts::value<std::string>(ioptions.frames)->default_value("0"))
+            ("j,inflight", "frames reconstructed at once (0 = as many as fit in --memory)", cxxopts::value<int>(ioptions.inFlight)->default_value("0"))
+            ("memory", "memory budget in MB for the frames in flight", cxxopts::value<int>(ioptions.memoryMB)->default_value("8192"))
+            ("trunc", "truncation distance in voxels", cxxopts::value<int>(ioptions.truncVoxels)->default_value("3"))
+            ("truncdelta", "depth behind the surface still integrated, in voxels", cxxopts::value<int>(ioptions.truncDeltaVoxels)->default_value("5"))
+            ("registration", "depth to color registration (k4a/native/compare)", cxxopts::value<std::string>(ioptions.registration)->default_value("k4a"))
+            ("hull", "fast preview: mesh the visual hull of the mattes in a 1 bit grid instead of the TSDF (reads only the mattes)", cxxopts::value<bool>(ioptions.hull)->default_value("false"))
+            ("incremental", "keep the volume and its mesh from frame to frame, only the bricks under changed pixels are redone (dense, fixed cube)", cxxopts::value<bool>(ioptions.incremental)->default_value("false"))
+            ("changetile", "incremental: pixel tiles compared with the last frame, in pixels", cxxopts::value<int>(ioptions.changeTile)->default_value("16"))
+            ("changedepth", "incremental: depth change in mm a pixel needs to count as changed", cxxopts::value<float>(ioptions.changeDepth)->default_value("10"))
+            ("vertexcolor", "colour the mesh from the images after extraction instead of integrating voxel colours", cxxopts::value<bool>(ioptions.vertexColor)->default_value("false"))
+            ("savevolume", "save the integrated volume of every frame (before smoothing) to this .tsdf file ({frame} template)", cxxopts::value<std::string>(ioptions.saveVolume))
+            ("volumeblocks", "save only the blocks that hold data instead of the whole grid", cxxopts::value<bool>(ioptions.volumeBlocks)->default_value("false"))
+            ("extract", "mesh a saved .tsdf volume ({frame} template) instead of integrating images", cxxopts::value<std::string>(ioptions.extractVolume))
+            ("extractor", "surface extraction: mc (marching cubes) or nets (surface nets, no slivers)", cxxopts::value<std::string>(ioptions.extractor)->default_value("mc"))
+            ("decimate", "decimate the indexed mesh down to this many faces (0 = off)", cxxopts::value<int>(ioptions.decimate)->default_value("0"))
+            ("decimateerror", "decimate the indexed mesh while the surface moves less than this many metres (0 = off)", cxxopts::value<float>(ioptions.decimateError)->default_value("0"))
+            ("lods", "also mesh this many coarser levels of detail, each at half the resolution of the last, to -o with {lod} (or name_lod<N>.ext)", cxxopts::value<int>(ioptions.lods)->default_value("0"))
+            ("render", "raycast the volume to this png, from the cameras of --rendercams ({frame} and {cam} templates)", cxxopts::value<std::string>(ioptions.render))
+            ("rendercams", "cameras to render, comma separated indices (default every camera, none with --renderlookat)", cxxopts::value<std::string>(ioptions.renderCams))
+            ("renderlookat", "also render a free camera at ex,ey,ez looking at tx,ty,tz (metres, intrinsics and size of the first rendered camera)", cxxopts::value<std::string>(ioptions.renderLookAt))
+            ("nomesh", "do not extract or write meshes (with --render or --savevolume)", cxxopts::value<bool>(ioptions.noMesh)->default_value("false"))
+            ("isolevel", "sdf level of the extracted surface (default 1/(2 voxres))", cxxopts::value<float>(ioptions.isoLevel))
+            ("serve", "keep running and take jobs as JSON lines on stdin, progress as JSON lines on stdout", cxxopts::value<bool>(ioptions.serve)->default_value("false"))
             ("h,help", "print usage")
             ;
 
@@ -73,22 +189,197 @@ cxxopts::ParseResult parse(int argc, char* argv[])
 
 
 
+/* path templates: {<key>} is replaced by value, {<key>:N} pads it with zeros to N digits
+   - keys are "cam" (camera index) and "frame" (frame number)
+*/
+std::string ExpandPathTemplate(std::string path, const std::string& key, int value) {
+    std::string open = "{" + key;
+    for (size_t p = path.find(open); p != std::string::npos; p = path.find(open, p)) {
+        size_t e = path.find('}', p);
+        if (e == std::string::npos) break;
+        std::string spec = path.substr(p + open.size(), e - p - open.size()); // "" or ":N"
+        if (!spec.empty() && spec[0] != ':') { p = e; continue; }
+        std::string num = std::to_string(value);
+        int width = spec.empty() ? 0 : atoi(spec.c_str() + 1);
+        if ((int)num.size() < width) num.insert(0, width - num.size(), '0');
+        path.replace(p, e - p + 1, num);
+        p += num.size();
+    }
+    return path;
+}
+
+/* start[:end[:step]] with the end included, false if it does not parse or is empty */
+bool ParseFrameRange(const std::string& range, std::vector<int>& frames) {
+    int start = 0, end = 0, step = 1;
+    int n = sscanf(range.c_str(), "%d:%d:%d", &start, &end, &step);
+    if (n < 1) return false;
+    if (n == 1) end = start;
+    if (step <= 0 || end < start) return false;
+    frames.clear();
+    for (int F = start; F <= end; F += step) frames.push_back(F);
+    return true;
+}
+
+/* output file of frame F: the {frame} template expanded, or name_F.ext when several frames share a plain name */
+std::string FrameOutputPath(const std::string& output, int frame, bool multiFrame) {
+    if (output.find("{frame") != std::string::npos) return ExpandPathTemplate(output, "frame", frame);
+    if (!multiFrame) return output;
+    size_t slash = output.find_last_of("/\\");
+    size_t dot = output.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = output.size();
+    return output.substr(0, dot) + "_" + std::to_string(frame) + output.substr(dot);
+}
+
+/* comma separated numbers ("0,2,5"), false if one does not parse */
+template<typename T>
+bool ParseNumberList(const std::string& list, std::vector<T>& values) {
+    values.clear();
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        char* end;
+        double v = strtod(item.c_str(), &end);
+        if (end == item.c_str() || *end != 0) return false;
+        values.push_back((T)v);
+    }
+    return true;
+}
+
+/* one rgb/depth/matte template with {cam} stands for every camera */
+void ExpandCameraTemplates(std::vector<std::string>& paths, int numCameras) {
+    if (paths.size() == 1 && numCameras > 1) paths.resize(numCameras, paths[0]);
+    for (size_t c = 0; c < paths.size(); c++) paths[c] = ExpandPathTemplate(paths[c], "cam", (int)c);
+}
+
+/* check the options and expand the frame range and the {cam} templates
+   - returns false with the reason in error, used for the command line and for every server job
+*/
+bool ValidateOptions(std::string& error) {
+    if (ioptions.autoBounds != "off" && ioptions.autoBounds != "voxelsize" && ioptions.autoBounds != "voxelcount") {
+        error = "autobounds must be off, voxelsize or voxelcount";
+        return false;
+    }
+    if (!ParseFrameRange(ioptions.frames, ioptions.frameList)) {
+        error = "frames must be start[:end[:step]] with end >= start and step > 0";
+        return false;
+    }
+    if (ioptions.registration != "k4a" && ioptions.registration != "native" && ioptions.registration != "compare") {
+        error = "registration must be k4a, native or compare";
+        return false;
+    }
+    if (ioptions.extractor != "mc" && ioptions.extractor != "nets") {
+        error = "extractor must be mc or nets";
+        return false;
+    }
+    if (ioptions.decimate < 0 || ioptions.decimateError < 0) {
+        error = "decimate and decimateerror must not be negative";
+        return false;
+    }
+    if ((ioptions.decimate > 0 || ioptions.decimateError > 0) && !ioptions.indexed) {
+        error = "decimation works on the shared vertices of the indexed mesh, add --indexed";
+        return false;
+    }
+    if (ioptions.lods < 0 || ioptions.lods > 8 || (ioptions.lods > 0 && (ioptions.hull || ioptions.noMesh))) {
+        error = "lods must be 0 to 8, coarser levels come from the TSDF (no hull preview) and are meshes (no nomesh)";
+        return false;
+    }
+    if (ioptions.voxRes <= 0 || ioptions.truncVoxels <= 0 || ioptions.truncDeltaVoxels <= 0) {
+        error = "voxres, trunc and truncdelta must be positive";
+        return false;
+    }
+    if (ioptions.hull && (ioptions.autoBounds != "off" || !ioptions.saveVolume.empty())) {
+        error = "hull previews have no depth to fit autobounds to and no volume to save";
+        return false;
+    }
+    if (ioptions.incremental && (ioptions.sparse || ioptions.autoBounds != "off" || ioptions.smooth > 0 || ioptions.hull)) {
+        error = "incremental needs the dense fixed cube without smoothing (and no hull preview)";
+        return false;
+    }
+    if (ioptions.incremental && ioptions.extractor != "mc") {
+        error = "incremental keeps marching cubes meshes per brick, use extractor mc";
+        return false;
+    }
+    if (ioptions.incremental && (ioptions.changeTile <= 0 || ioptions.changeDepth < 0)) {
+        error = "changetile must be positive and changedepth not negative";
+        return false;
+    }
+    ioptions.renderCamList.clear();
+    ioptions.renderLookAtPoints.clear();
+    if (!ioptions.render.empty() && (ioptions.hull || !ParseNumberList(ioptions.renderCams, ioptions.renderCamList) || !ParseNumberList(ioptions.renderLookAt, ioptions.renderLookAtPoints))) {
+        error = "render needs a TSDF (no hull preview), rendercams camera indices and renderlookat ex,ey,ez,tx,ty,tz";
+        return false;
+    }
+    if (ioptions.render.empty() && (!ioptions.renderCams.empty() || !ioptions.renderLookAt.empty())) {
+        error = "rendercams and renderlookat need --render";
+        return false;
+    }
+    if (!ioptions.renderLookAtPoints.empty() && (ioptions.renderLookAtPoints.size() != 6 ||
+        (Eigen::Map<Eigen::Vector3f>(&ioptions.renderLookAtPoints[3]) - Eigen::Map<Eigen::Vector3f>(&ioptions.renderLookAtPoints[0])).norm() == 0)) {
+        error = "renderlookat must be ex,ey,ez,tx,ty,tz with the target away from the eye";
+        return false;
+    }
+    if (ioptions.noMesh && (ioptions.hull || ioptions.incremental || (ioptions.render.empty() && ioptions.saveVolume.empty()))) {
+        error = "nomesh needs --render or --savevolume and keeps nothing else (no hull, incremental keeps its brick meshes)";
+        return false;
+    }
+    int num = ioptions.intrinsicsPaths.size();
+    for (int CID : ioptions.renderCamList) {
+        if (CID < 0 || CID >= num) {
+            error = "rendercams: no camera " + std::to_string(CID);
+            return false;
+        }
+    }
+    if (!ioptions.render.empty() && ioptions.renderCams.empty() && ioptions.renderLookAtPoints.empty()) {
+        for (int CID = 0; CID < num; CID++) ioptions.renderCamList.push_back(CID);
+    }
+    ExpandCameraTemplates(ioptions.rgbPaths, num);
+    ExpandCameraTemplates(ioptions.depthPaths, num);
+    ExpandCameraTemplates(ioptions.mattePaths, num);
+    int numRGB = ioptions.rgbPaths.size();
+    int numDepth = ioptions.depthPaths.size();
+    int numMatte = ioptions.mattePaths.size();
+    if (num==0 || num != numRGB || num != numDepth || num != numMatte) {
+        error = "need to specify all Intrinsics|RGB|Depth|Matte paths for each camera";
+        return false;
+    }
+    return true;
+}
+
 void PrintOptionsSelected() {
+    std::string error;
+    if (!ValidateOptions(error)) {
+        std::cout << "ERROR: " << error << std::endl;
+        exit(1);
+    }
     std::cout << "===============================================================" << std::endl;
     std::cout << "SimpleTSDF:" << std::endl;
     std::cout << "---------------------------------------------------------------" << std::endl;
     std::cout << "Running with Options:" << std::endl;
     std::cout << "- Extrinsics: " + ioptions.extrinsicsLogFilename << std::endl;
     std::cout << "- Output PLY filename: " + ioptions.outputPlyFilename << std::endl;
-    std::cout << "- Voxel Resolution: " + ioptions.voxRes << std::endl;
-    int num = ioptions.intrinsicsPaths.size();
-    int numRGB = ioptions.rgbPaths.size();
-    int numDepth = ioptions.depthPaths.size();
-    int numMatte = ioptions.mattePaths.size();
-    if (num==0 || num != numRGB || num != numDepth || num != numMatte) {
-        std::cout << "ERROR: need to specify all Intrinsics|RGB|Depth|Matte paths for each camera" << std::endl;
-        exit(1);
+    std::cout << "- Voxel Resolution: " << ioptions.voxRes << std::endl;
+    std::cout << "- Truncation: " << ioptions.truncVoxels << " voxels, delta " << ioptions.truncDeltaVoxels << " voxels" << std::endl;
+    std::cout << "- Storage: " << (ioptions.sparse ? "sparse" : "dense") << std::endl;
+    std::cout << "- Volume bounds: " << (ioptions.autoBounds == "off" ? "fixed 2m cube" : "fitted to silhouettes, constant voxel " + ioptions.autoBounds.substr(5)) << std::endl;
+    std::cout << "- Silhouette carving: " << (ioptions.hull ? "visual hull preview only (1 bit grid, no TSDF)" : ioptions.carve ? "on" : "off") << std::endl;
+    if (ioptions.incremental) std::cout << "- Incremental: " << ioptions.changeTile << "px tiles, depth changes over " << ioptions.changeDepth << "mm" << std::endl;
+    std::cout << "- Smoothing: radius " << ioptions.smooth << " x " << ioptions.smoothPasses << " passes" << std::endl;
+    std::cout << "- Depth registration: " << ioptions.registration << std::endl;
+    if (!ioptions.saveVolume.empty()) std::cout << "- Save volumes: " << ioptions.saveVolume << (ioptions.volumeBlocks || ioptions.sparse ? " (blocks)" : " (grid)") << std::endl;
+    std::cout << "- Mesh: " << (ioptions.extractor == "nets" ? "surface nets, " : "marching cubes, ") << (ioptions.indexed ? "indexed" : "triangle soup") << (ioptions.indexed && ioptions.normals ? " with normals" : "")
+        << (ioptions.vertexColor ? ", coloured from the images" : ", voxel colours") << std::endl;
+    if (ioptions.decimate > 0 || ioptions.decimateError > 0) {
+        std::cout << "- Decimation: " << (ioptions.decimate > 0 ? "down to " + std::to_string(ioptions.decimate) + " faces" : "no face target")
+            << (ioptions.decimateError > 0 ? ", error under " + std::to_string(ioptions.decimateError) + "m" : "") << std::endl;
     }
+    if (ioptions.lods > 0) std::cout << "- Levels of detail: " << ioptions.lods << " below the full resolution, down to " << (ioptions.voxRes >> ioptions.lods) << " voxels" << std::endl;
+    if (!ioptions.render.empty()) {
+        std::cout << "- Render: " << ioptions.render << " (" << ioptions.renderCamList.size() << " cameras" << (ioptions.renderLookAtPoints.empty() ? "" : " + look-at") << ")"
+            << (ioptions.noMesh ? ", no meshes" : "") << std::endl;
+    }
+    std::cout << "- Frames in flight: " << (ioptions.incremental ? "1 (incremental)" : ioptions.inFlight > 0 ? std::to_string(ioptions.inFlight) : "fit to " + std::to_string(ioptions.memoryMB) + "MB") << std::endl;
+    std::cout << "- Frames: " << ioptions.frameList.front() << " to " << ioptions.frameList.back() << " (" << ioptions.frameList.size() << " frames)" << std::endl;
+    int num = ioptions.intrinsicsPaths.size();
     std::cout << " - Num Cameras Specifed: " + std::to_string(num) << std::endl;
     for (int i = 0; i < num; i++)
     {
@@ -96,7 +387,9 @@ void PrintOptionsSelected() {
         std::cout << " - rgbPath   :" + ioptions.rgbPaths[i] << std::endl;
         std::cout << " - depthPath :" + ioptions.depthPaths[i] << std::endl;
         std::cout << " - mattePath :" + ioptions.mattePaths[i] << std::endl;
-
+        if (ioptions.frameList.size() > 1 && ioptions.rgbPaths[i].find("{frame") == std::string::npos) {
+            std::cout << "WARNING: camera " << i << " paths have no {frame}, every frame reads the same images" << std::endl;
+        }
     }
     std::cout << "===============================================================" << std::endl;
 }
@@ -132,139 +425,58 @@ Viewer viewer;
 std::map<int, Eigen::Matrix4d> extrinsics;
 std::map<int, Eigen::Matrix3d> intrinsics;
 std::map<int, k4a_calibration_t> k4aCalibrations;
+std::map<int, DepthRegistration> registrations; // ray tables of k4aCalibrations, only built for --registration native/compare
 
 std::vector<TRIANGLE> g_tris;
-std::vector<k4a_transformation_t> g_transforms;
 
-void WritePLY(std::string filename, std::string filepath, std::vector<TRIANGLE> mesh)
+/* filepath/filename, creating filepath if needed */
+std::string MeshOutputPath(const std::string& filename, const std::string& filepath)
 {
-    std::ofstream writer;
+    if (filepath == "") return filename;
+    std::filesystem::create_directories(filepath);
+    return filepath + "/" + filename;
+}
 
-    if (filepath != "")
-    {
-        std::filesystem::create_directories(filepath);
+/* mesh output goes through MeshIO.h (buffered, binary little endian PLY unless --ascii) */
+bool WritePLY(std::string filename, std::string filepath, const std::vector<TRIANGLE>& mesh)
+{
+    bool ok = WriteMeshPLY(MeshOutputPath(filename, filepath), mesh, !ioptions.asciiPly);
+#ifdef _VERBOSE
+    std::cout << "wrote:" << mesh.size() * 3 << " verts" << std::endl;
+    std::cout << "wrote: " << mesh.size() << " tris" << std::endl;
+#endif
+    return ok;
+}
 
-        writer.open(filepath + "/" + filename);
-    }
-    else
-    {
-        writer.open(filename);
-    }
-    int numVerts = mesh.size() * 3;
-    int numTris = mesh.size();
-    // write the header
-
-    writer << "ply\n";
-    writer << "format ascii 1.0\n";
-    writer << "comment author: hogue\n";
-    writer << "element vertex " << numVerts << "\n";
-    writer << "property float x\n";
-    writer << "property float y\n";
-    writer << "property float z\n";
-    writer << "property uchar red\n";
-    writer << "property uchar green\n";
-    writer << "property uchar blue\n";
-    writer << "element face " << numTris << "\n";
-    writer << "property list uchar int vertex_indices\n";
-    //writer << "property uchar red\n";
-    //writer << "property uchar green\n";
-    //writer << "property uchar blue\n";
-    writer << "end_header\n";
-
-
-
-    // vertices
-    int numV = 0;
-    for (int i = 0; i < numTris; ++i)
-    {
-        auto TRI = mesh[i];
-        auto v0 = TRI.p[0];
-        auto v1 = TRI.p[1];
-        auto v2 = TRI.p[2];
-        auto c0 = TRI.c;
-        int  r, g, b;
-        r = (int)(255.f * c0.x());
-        g = (int)(255.f * c0.y());
-        b = (int)(255.f * c0.z());
-       writer << v0.x() << " " << v0.y() << " " << v0.z() <<  " " << r<< " " << g << " " << b << "\n";
-        writer << v1.x() << " " << v1.y() << " " << v1.z() << " " << r << " " << g << " " << b << "\n";
-        writer << v2.x() << " " << v2.y() << " " << v2.z() << " " << r << " " << g << " " << b << "\n";
-        numV += 3;
-       /* writer << "v " << v0.x() << " " << v0.y() << " " << v0.z() << "\n";
-        writer << "v " << v1.x() << " " << v1.y() << " " << v1.z() << "\n";
-        writer << "v " << v2.x() << " " << v2.y() << " " << v2.z() << "\n";*/
-    }
-
-    // face indices
-    int numT = 0;
-    for (int i = 0; i < numTris; ++i)
-    {
-        auto TRI = mesh[i];
-        int i0 = 3 * i + 0;
-        int i1 = 3 * i + 1;
-        int i2 = 3 * i + 2; 
-        auto c0 = TRI.c;
-        int  r, g, b;
-        r = (int)(255.f * c0.x());
-        g = (int)(255.f * c0.y());
-        b = (int)(255.f * c0.z());
-
-        writer << "3 " << (i0) << " " << (i1) << " " << (i2) << "\n";
-//        writer << "3 " << (i0) << " " << (i1) << " " << (i2) << " " << r << " " << g << " " << b << "\n";
-        numT++;
-    }
-    writer.close();
+/* indexed mesh: one vertex per surface edge crossing, normals written if the mesh has them */
+bool WritePLY(std::string filename, std::string filepath, const INDEXEDMESH& mesh)
+{
+    bool ok = WriteMeshPLY(MeshOutputPath(filename, filepath), mesh, !ioptions.asciiPly);
 #ifdef _VERBOSE
-    std::cout << "wrote:" << numV << " verts" << std::endl;
-    std::cout << "wrote: " << numT << " tris" << std::endl;
+    std::cout << "wrote:" << mesh.verts.size() / 3 << " verts" << std::endl;
+    std::cout << "wrote: " << mesh.indices.size() / 3 << " tris" << std::endl;
 #endif
+    return ok;
 }
 
-void WriteOBJ(std::string filename, std::string filepath, std::vector<TRIANGLE> mesh)
+bool WriteOBJ(std::string filename, std::string filepath, const std::vector<TRIANGLE>& mesh)
 {
-    std::ofstream writer;
+    return WriteMeshOBJ(MeshOutputPath(filename, filepath), mesh);
+}
 
-    if (filepath != "")
-    {
-        std::filesystem::create_directories(filepath);
+bool WriteOBJ(std::string filename, std::string filepath, const INDEXEDMESH& mesh)
+{
+    return WriteMeshOBJ(MeshOutputPath(filename, filepath), mesh);
+}
 
-        writer.open(filepath + "/" + filename);
-    }
+/* .obj output filenames get an OBJ, anything else a PLY, false if the file could not be written */
+template <typename MESH>
+bool WriteMesh(std::string filename, std::string filepath, const MESH& mesh)
+{
+    if (filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".obj") == 0)
+        return WriteOBJ(filename, filepath, mesh);
     else
-    {
-        writer.open(filename);
-    }
-    int numVerts = mesh.size() * 3;
-    int numTris = mesh.size();
-
-    for (int i = 0; i < numTris; ++i)
-    {
-        auto TRI = mesh[i];
-        auto v0 = TRI.p[0];
-        auto v1 = TRI.p[1];
-        auto v2 = TRI.p[2];
-
-        writer << "v " << v0.x() << " " << v0.y() << " " << v0.z() << "\n";
-        writer << "v " << v1.x() << " " << v1.y() << " " << v1.z() << "\n";
-        writer << "v " << v2.x() << " " << v2.y() << " " << v2.z() << "\n";
-    }
-
-   
-
-    for (int i = 0; i < numTris; ++i)
-    {
-        auto TRI = mesh[i];
-        int i0 = 3 * i + 0;
-        int i1 = 3 * i + 1;
-        int i2 = 3 * i + 2;
-
-        writer << "f " <<
-            (i0+ 1) << " " <<
-            (i1+ 1) << " " <<
-            (i2+ 1) << "\n";
-    }
-
-    writer.close();
+        return WritePLY(filename, filepath, mesh);
 }
 
 void AddMeshToViewer() {
@@ -517,13 +729,13 @@ void ProjectAllPoints(std::vector<Eigen::Vector3d>& pts, Eigen::Matrix3d& intrin
         ccOut.push_back(cc);
     }
 }
-void CreateAndAddMesh(Eigen::Matrix3d& in, Eigen::Matrix4d& ex, cv::Mat& imRGB, cv::Mat& imMATTE, cv::Mat& imDepth, k4a_image_t& k4a_pointcloud) {
+void CreateAndAddMesh(Eigen::Matrix3d& in, Eigen::Matrix4d& ex, cv::Mat& imRGB, cv::Mat& imMATTE, cv::Mat& imDepth, cv::Mat& pointcloud) {
     // go through and make a triangle mesh from the passed in point cloud
 #define IND_IM(i,j,w,h) (((j)*(w)) + (i))
     int w, h;
     w = imMATTE.cols;
     h = imMATTE.rows;
-    int16_t* pcData = (int16_t*)k4a_image_get_buffer(k4a_pointcloud);
+    int16_t* pcData = (int16_t*)pointcloud.data;
     for (int j = 1; j < imMATTE.rows; j++) {
         for (int i = 0; i < imMATTE.cols-1; i++) {
             int ind[4];
@@ -610,120 +822,77 @@ void CreateAndAddMesh(Eigen::Matrix3d& in, Eigen::Matrix4d& ex, cv::Mat& imRGB,
 NOTES: learned proper settings of tsdf calc by reading "variational level set evolution for non-rigid 3d reconstruction from a single depth camera" by Slavcheva, Baust, Ilic.
 - this implements just the simplest voxel carving and tsdf computation, non-rigid level set coming later
 */
-void CarveWithSilhouette(TSDFVolume *vol, Eigen::Matrix3d &in, Eigen::Matrix4d &ex, cv::Mat &imRGB, cv::Mat &imMATTE, cv::Mat &imDepth, k4a_image_t &k4a_pointcloud) {
-    /* ok, so the standard simplest way  */
-#ifdef _VERBOSE
-    std::cout << "extrinsics:" << std::endl;
-    std::cout << ex << std::endl;
-#endif
+/* wrap one camera's images for TSDFVolume::Integrate()
+   - the images (and the point cloud) must stay alive until the integration is done
+*/
+TSDFCameraView MakeCameraView(Eigen::Matrix3d& in, Eigen::Matrix4d& ex, cv::Mat& imRGB, cv::Mat& imMATTE, cv::Mat& pointcloud) {
     /* extrinsics passed in convert from camera to wold
        - i.e. multiplying by camera origin (0,0,0) gives the position of the camera in the world to draw
        - we need the transform to convert world coordinates (voxel coords) to be relative to the camera
-       -  
     */
-    auto ExInv = ex;
-    auto R = ex.block<3, 3>(0, 0);
-    auto T = ex.block<3, 1>(0, 3);
-    auto Rt = R.transpose();
-    auto T2 = -Rt * T;
+    Eigen::Matrix4d ExInv = ex;
+    Eigen::Matrix3d Rt = ex.block<3, 3>(0, 0).transpose();
     ExInv.block<3, 3>(0, 0) = Rt;
-    ExInv.block<3, 1>(0, 3) = T2;
+    ExInv.block<3, 1>(0, 3) = -Rt * ex.block<3, 1>(0, 3);
+
+    TSDFCameraView view;
+    view.in = in;
+    view.exInv = ExInv;
+    view.width = imRGB.cols;
+    view.height = imRGB.rows;
+    view.bgr = imRGB.data;
+    view.bgrStep = imRGB.step[0];
+    view.matte = imMATTE.data;
+    view.matteStep = imMATTE.step[0];
+    view.matteChannels = imMATTE.channels();
+    view.pointcloud = (int16_t*)pointcloud.data;
+    return view;
+}
 
+/* single camera integration, kept for oldmain(), main() fuses all cameras at once with TSDFVolume::Integrate()
+   - projection: optional per take table of this camera, built on first use (dense volumes only)
+*/
+void CarveWithSilhouette(TSDFVolume *vol, Eigen::Matrix3d &in, Eigen::Matrix4d &ex, cv::Mat &imRGB, cv::Mat &imMATTE, cv::Mat &imDepth, cv::Mat &pointcloud, TSDFCameraProjection* projection = nullptr) {
 #ifdef _VERBOSE
-    std::cout << "Ex:" << ex << std::endl;
-    std::cout << "R:" << R << std::endl;
-    std::cout << "T:" << T << std::endl;
-    std::cout << "ExInv:" << ExInv << std::endl;
+    std::cout << "extrinsics:" << std::endl;
+    std::cout << ex << std::endl;
 #endif
-
     float trunc_margin = vol->vSize[0]* _VOXEL_TRUNC;// vol->vSize[0] * 6;
     float delta = vol->vSize[0] * _VOXEL_TRUNC_DELTA;
-#pragma omp parallel for
-    for (int k = 0; k < vol->res[2]; k++) {
-#pragma omp parallel for
-        for (int j = 0; j < vol->res[1]; j++) {
-#pragma omp parallel for
-            for (int i = 0; i < vol->res[0]; i++) {
-                Voxel& vx = vol->get(i, j, k);
-                // if the current voxel is already carved in any image then it should be empty for sure
-                if (vx.flag != VOXEL_EMPTY)
-                {
-                    Eigen::Vector3d c;
-                    vol->GetVoxelCoordsFromIndex(i, j, k, c);
-                    std::vector<Eigen::Vector3d> allcorners;
-                    // project voxel center on to image
-                    Eigen::Vector4d pRotExInv;
-                    Eigen::Vector3d proj = ProjectPoint(c, in, ExInv, pRotExInv);
-
-                    /* now look in image */
-                    int u, v;
-                    u = (int)proj(0);
-                    v = (int)proj(1);
-                    float uvz = proj(2); // this is the depth of the voxel from the camera
-
-                    if (u > 0 && u < imRGB.cols && v > 0 && v < imRGB.rows ) { // is the projected voxel center in the image?
-                        cv::Vec3b m   = imMATTE.at<cv::Vec3b>(v,u);  // get matte pixel value
-                        cv::Vec3b col = imRGB.at<cv::Vec3b>(v, u); // get colour
-                        ushort depth  = imDepth.at<ushort>(v, u); // get depth image value            
-                       
-                        int16_t* pcData = (int16_t*)k4a_image_get_buffer(k4a_pointcloud);
-                        int pcIndex = 3 * (u + v * imRGB.cols);
-                        float PCX = (float)(pcData[pcIndex + 0]) /1000.f;
-                        float PCY = (float)(pcData[pcIndex + 1]) / 1000.f;
-                        float PCZ = (float)(pcData[pcIndex + 2]) / 1000.f;
-
-                        float depthMeasurement = PCZ;// (float)depth / 1000.f; // convert to meters
-                        int matte = (int)m[0];
-                        if (matte > 200 && depthMeasurement > 0 && depthMeasurement < 3) // does it have a depth value and is it in the foreground?
-                        {                          
-                           float voxelDepthProjected = uvz;
-                           float distFromVoxelToSurfaceSample =  depthMeasurement - voxelDepthProjected;
-                           
-                          
-                           // std::cout << "depthMeasurement:" << depthMeasurement << " (u,v):"<<"("<<u<<","<<v<<"), ushort:"<< depth<<" m:"<<matte<<std::endl;
-                           if (distFromVoxelToSurfaceSample > -trunc_margin)
-                           {
-                               float sdf;
-                               float abDist = fabs(distFromVoxelToSurfaceSample);
-                               if (abDist >= delta) {
-                                   sdf = distFromVoxelToSurfaceSample;
-                               }
-                               else
-                               {
-                                   sdf = fminf(1.f, distFromVoxelToSurfaceSample / trunc_margin);
-                               }
-                               float oldweight = vx.weight;
-                               float newweight = oldweight + 1;
-                               float weightSum = oldweight + newweight;
-                               
-                               float d_old = vx.sdf;
-                               float d_new = sdf;
-                               float d =(d_old * oldweight + d_new) / newweight;
-
-                               vx.sdf = d;// (d < -1) ? -1 : (d > 1) ? 1 : d;// d_old + (1.0 / weightSum) * (d_new - d_old);// fmin(d_old, d_new);// d;
-                               vx.weight = newweight;
-
-                               vx.r = (oldweight * vx.r + newweight * col[2]) / weightSum;
-                               vx.g = (oldweight * vx.g + newweight * col[1]) / weightSum;
-                               vx.b = (oldweight * vx.b + newweight * col[0]) / weightSum;
-                               vx.flag = VOXEL_FULL;
-                           }
-                        }
-                        //else {
-                        //    // the voxel projected to a pixel that didn't have a valid depth OR matte 
-                        //    vx.weight = 0;
-                        //    vx.sdf = trunc_margin;
-                        //    vx.flag = VOXEL_EMPTY;  // carve voxel
-                        //}
-                    }
-                }
-            }
+    std::vector<TSDFCameraView> views(1, MakeCameraView(in, ex, imRGB, imMATTE, pointcloud));
+    if (projection && vol->storage == TSDF_DENSE) {
+        if (projection->res[0] == 0) vol->BuildProjection(views[0], *projection);
+        views[0].projection = projection;
+    }
+    vol->Integrate(views, trunc_margin, delta);
+}
+
+/* sparse volumes only: allocate the blocks around every foreground depth sample of this camera
+   - must run before CarveWithSilhouette since block allocation is not thread safe
+   - bandVoxels: half width of the band, the larger of the truncation distance and delta
+*/
+void AllocateTruncationBand(TSDFVolume* vol, Eigen::Matrix4d& ex, cv::Mat& imMATTE, cv::Mat& pointcloud, int bandVoxels) {
+    float margin = vol->vSize[0] * bandVoxels;
+    int16_t* pcData = (int16_t*)pointcloud.data;
+    for (int v = 1; v < imMATTE.rows; v++) {
+        for (int u = 1; u < imMATTE.cols; u++) {
+            cv::Vec3b m = imMATTE.at<cv::Vec3b>(v, u);
+            if ((int)m[0] <= 200) continue;
+            int pcIndex = 3 * (u + v * imMATTE.cols);
+            float PCZ = (float)(pcData[pcIndex + 2]) / 1000.f;
+            if (PCZ <= 0 || PCZ >= 3) continue;
+            float PCX = (float)(pcData[pcIndex + 0]) / 1000.f;
+            float PCY = (float)(pcData[pcIndex + 1]) / 1000.f;
+            Eigen::Vector4d w = ex * Eigen::Vector4d(PCX, PCY, PCZ, 1);
+            vol->AllocateBlocksAroundPoint(Eigen::Vector3d(w(0), w(1), w(2)), margin);
         }
     }
-  
 }
 
-void TransformDepth(int cam, cv::Mat &old_depth, cv::Mat&new_depth, k4a_calibration_t& calibration, k4a_image_t &k4a_pointcloud) {
+/* register a depth image to the color camera, and compute its point cloud (CV_16SC3, x,y,z mm per color pixel)
+   - transform: created from the calibration on first use, a handle must not be used by two threads at once
+*/
+void TransformDepth(k4a_transformation_t& transform, cv::Mat &old_depth, cv::Mat&new_depth, k4a_calibration_t& calibration, cv::Mat &pointcloud) {
     k4a_image_t k4a_transformed_depth = nullptr;
     k4a_image_t k4a_depth = nullptr;
 //    k4a_image_t k4a_pointcloud = nullptr;
@@ -757,99 +926,1060 @@ void TransformDepth(int cam, cv::Mat &old_depth, cv::Mat&new_depth, k4a_calibrat
             &k4a_transformed_depth);*/
  
     
-    k4a_transformation_t transform = g_transforms[cam];
     if (transform == 0) {
         transform = k4a_transformation_create(&calibration);
-        g_transforms[cam] = transform;
     }
 
     if (K4A_RESULT_SUCCEEDED != k4a_transformation_depth_image_to_color_camera(transform, k4a_depth, k4a_transformed_depth)) 
     {
         std::cout << "error transforming depth to rgb" << std::endl;
     }
-    if (k4a_pointcloud == NULL)
+    pointcloud.create(new_depth.rows, new_depth.cols, CV_16SC3);
+    k4a_image_t k4a_pointcloud = nullptr;
+    if (K4A_RESULT_SUCCEEDED !=
+        k4a_image_create_from_buffer(K4A_IMAGE_FORMAT_CUSTOM, pointcloud.cols, pointcloud.rows, (int)pointcloud.step[0],
+        pointcloud.data, pointcloud.step[0] * pointcloud.rows, nullptr, nullptr, &k4a_pointcloud))
     {
-        k4a_image_create(K4A_IMAGE_FORMAT_CUSTOM, new_depth.cols, new_depth.rows, new_depth.cols * 3 * (int)sizeof(int16_t), &k4a_pointcloud);
+        std::cout << "error k4a_image_create_from_buffer" << std::endl;
     }
     k4a_transformation_depth_image_to_point_cloud(transform, k4a_transformed_depth, K4A_CALIBRATION_TYPE_COLOR, k4a_pointcloud);
     
     
-    // release memory
+    // release memory (the wrappers only, the buffers belong to the cv::Mats)
     k4a_image_release(k4a_depth);
     k4a_image_release(k4a_transformed_depth);
+    k4a_image_release(k4a_pointcloud);
     //k4a_transformation_destroy(transform);
 }
 
+/* the input files of one frame, one entry per camera */
+struct FramePaths {
+    std::vector<std::string> rgb, matte, depth;
+};
+
+/* one frame of every camera, decoded and registered to the color cameras by LoadFrame() */
+struct FrameData {
+    int frame = 0;
+    bool ok = false;
+    double loadSeconds = 0; // read and depth registration
+    std::vector<cv::Mat> imRGB, imMATTE;
+    std::vector<cv::Mat> imDEPTH; // depth transformed to the color camera
+    std::vector<cv::Mat> pointclouds; // CV_16SC3, x,y,z mm per color pixel
+
+    ~FrameData() { Release(); }
+    void Release() {
+        imRGB.clear();
+        imMATTE.clear();
+        imDEPTH.clear();
+        pointclouds.clear();
+    }
+};
+
+void DestroyTransforms(std::vector<k4a_transformation_t>& transforms) {
+    for (k4a_transformation_t& t : transforms) {
+        if (t) k4a_transformation_destroy(t);
+    }
+    transforms.clear();
+}
+
+/* ray tables of every camera for --registration native/compare, built once per calibration (about 2s per camera) */
+void PrepareRegistrations(int numCameras) {
+    if (ioptions.registration == "k4a") return;
+    std::vector<int> missing;
+    for (int CID = 0; CID < numCameras; CID++) {
+        if (!registrations.count(CID)) missing.push_back(CID);
+    }
+    if (missing.empty()) return;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    std::vector<DepthRegistration> built(missing.size());
+#pragma omp parallel for
+    for (int m = 0; m < (int)missing.size(); m++) {
+        built[m].Build(k4aCalibrations.at(missing[m]));
+    }
+    for (size_t m = 0; m < missing.size(); m++) registrations[missing[m]] = std::move(built[m]);
+    std::cout << "depth registration tables of " << missing.size() << " cameras built in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() << "s" << std::endl;
+}
+
+/* --registration compare: how far the native registration is from the k4a one (k4a is kept for the frame) */
+void CompareRegistration(int frame, int CID, const cv::Mat& depthK4A, const cv::Mat& pcK4A, const cv::Mat& depthNative, const cv::Mat& pcNative) {
+    size_t onlyK4A = 0, onlyNative = 0, both = 0;
+    double sumDZ = 0, sumDP = 0;
+    int maxDZ = 0;
+    for (int v = 0; v < depthK4A.rows; v++) {
+        const ushort* zk = depthK4A.ptr<ushort>(v);
+        const ushort* zn = depthNative.ptr<ushort>(v);
+        const int16_t* pk = pcK4A.ptr<int16_t>(v);
+        const int16_t* pn = pcNative.ptr<int16_t>(v);
+        for (int u = 0; u < depthK4A.cols; u++) {
+            if (zk[u] == 0 && zn[u] == 0) continue;
+            if (zn[u] == 0) { onlyK4A++; continue; }
+            if (zk[u] == 0) { onlyNative++; continue; }
+            both++;
+            int dz = std::abs((int)zk[u] - (int)zn[u]);
+            sumDZ += dz;
+            maxDZ = std::max(maxDZ, dz);
+            const int16_t* a = &pk[3 * u];
+            const int16_t* b = &pn[3 * u];
+            sumDP += std::sqrt((double)(a[0] - b[0]) * (a[0] - b[0]) + (double)(a[1] - b[1]) * (a[1] - b[1]) + (double)(a[2] - b[2]) * (a[2] - b[2]));
+        }
+    }
+    std::cout << "frame " << frame << " camera " << CID << " registration: " << both << " px in both, " << onlyK4A << " k4a only, " << onlyNative << " native only, |dz| mean "
+        << (both ? sumDZ / both : 0) << " max " << maxDZ << " mm, point distance mean " << (both ? sumDP / both : 0) << " mm" << std::endl;
+}
+
+/* read and depth register all cameras of a frame (camera i uses k4aCalibrations[i], or registrations[i] with --registration native)
+   - --hull reads the mattes only
+   - transforms: one k4a transformation per camera, owned by the calling thread (unused with native registration)
+   - returns false (and says which file) if an image could not be read
+*/
+bool LoadFrame(const FramePaths& paths, std::vector<k4a_transformation_t>& transforms, FrameData& fd) {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    int numCameras = (int)paths.rgb.size();
+    fd.imRGB.assign(numCameras, cv::Mat());
+    fd.imMATTE.assign(numCameras, cv::Mat());
+    fd.imDEPTH.assign(numCameras, cv::Mat());
+    fd.pointclouds.assign(numCameras, cv::Mat());
+    fd.ok = false;
+    for (int CID = 0; CID < numCameras; CID++) {
+        if (ioptions.hull) { // the preview only needs the silhouettes
+            fd.imMATTE[CID] = cv::imread(paths.matte[CID]);
+            if (fd.imMATTE[CID].empty()) {
+                std::cout << "could not read frame " << fd.frame << " camera " << CID << ": " << paths.matte[CID] << std::endl;
+                return false;
+            }
+            continue;
+        }
+        fd.imRGB[CID] = cv::imread(paths.rgb[CID]);
+        fd.imMATTE[CID] = cv::imread(paths.matte[CID]);
+        cv::Mat imDEPTH16 = cv::imread(paths.depth[CID], cv::IMREAD_ANYDEPTH); // 16bit short
+        if (fd.imRGB[CID].empty() || fd.imMATTE[CID].empty() || imDEPTH16.empty()) {
+            std::cout << "could not read frame " << fd.frame << " camera " << CID << ": " << paths.rgb[CID] << " | " << paths.matte[CID] << " | " << paths.depth[CID] << std::endl;
+            return false;
+        }
+        /* transform depth to RGB size */
+        cv::Mat nativeDepth, nativePC;
+        if (ioptions.registration != "k4a") {
+            const DepthRegistration& reg = registrations.at(CID);
+            if (imDEPTH16.type() != CV_16UC1 || imDEPTH16.cols != reg.DepthWidth() || imDEPTH16.rows != reg.DepthHeight()) {
+                std::cout << "frame " << fd.frame << " camera " << CID << ": depth image is not " << reg.DepthWidth() << "x" << reg.DepthHeight() << " 16bit, as in the calibration" << std::endl;
+                return false;
+            }
+            nativeDepth.create(reg.ColorHeight(), reg.ColorWidth(), CV_16UC1);
+            nativePC.create(reg.ColorHeight(), reg.ColorWidth(), CV_16SC3);
+            reg.DepthToColor((const uint16_t*)imDEPTH16.data, imDEPTH16.step[0], (uint16_t*)nativeDepth.data, nativeDepth.step[0]);
+            reg.PointCloud((const uint16_t*)nativeDepth.data, nativeDepth.step[0], (int16_t*)nativePC.data);
+        }
+        if (ioptions.registration == "native") {
+            fd.imDEPTH[CID] = nativeDepth;
+            fd.pointclouds[CID] = nativePC;
+            continue;
+        }
+        fd.imDEPTH[CID] = cv::Mat::zeros(fd.imRGB[CID].rows, fd.imRGB[CID].cols, CV_16UC1);
+        TransformDepth(transforms[CID], imDEPTH16, fd.imDEPTH[CID], k4aCalibrations.at(CID), fd.pointclouds[CID]);
+        if (ioptions.registration == "compare") CompareRegistration(fd.frame, CID, fd.imDEPTH[CID], fd.pointclouds[CID], nativeDepth, nativePC);
+    }
+    fd.ok = true;
+    fd.loadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return true;
+}
+
+/* a coarser level of detail of a frame's mesh (--lods) */
+struct LodMesh {
+    std::string filename;
+    std::vector<TRIANGLE> tris;
+    INDEXEDMESH mesh;
+};
+
+/* what the integration hands to the writer thread */
+struct FrameMesh {
+    int frame = 0;
+    std::string filename, filepath;
+    std::string volumePath; // save the volume here (optional)
+    std::string renderPath; // raycast the volume to this png, {cam} template (optional)
+    bool indexed = false;
+    std::vector<TRIANGLE> tris;
+    INDEXEDMESH mesh;
+    std::vector<LodMesh> lods; // written after the mesh, to the same filepath
+};
+
+/* what happened to the frames of a RunFramePipeline() call */
+struct FramePipelineStats {
+    int written = 0;
+    int failed = 0; // unreadable, skipped or not written
+    double waitDecode = 0, waitWrite = 0;
+};
+
+/* multi frame loop with I/O, decode and compute overlapped (see FramePipeline.h)
+   - ioptions.decodeThreads workers read and depth register the next frames while the current ones are reconstructed,
+     at most ioptions.prefetch decoded frames wait (about 45MB per camera at 2048x1536 each)
+   - inFlight threads run processFrame, each takes the next frame in order and fills in its mesh (return false to skip it),
+     processFrame must be re-entrant when inFlight > 1, the OpenMP threads are split between them
+   - the meshes are written by one writer thread, at most ioptions.writeQueue wait to be written,
+     written (optional) is then called on that thread with the mesh, whether it was written and how long that took
+   - decodeTransforms (optional): k4a transformations of each decode worker kept for the next call (server),
+     otherwise every worker creates its own and destroys them when done
+*/
+FramePipelineStats RunFramePipeline(const std::vector<int>& frames, std::function<FramePaths(int)> framePaths, std::function<bool(FrameData&, FrameMesh&)> processFrame, int inFlight = 1,
+    std::function<void(const FrameMesh&, bool, double)> written = nullptr, std::vector<std::vector<k4a_transformation_t>>* decodeTransforms = nullptr) {
+    int numFrames = (int)frames.size();
+    int numWorkers = std::max(1, std::min(ioptions.decodeThreads, numFrames));
+    int numProcessors = std::max(1, std::min(inFlight, numFrames));
+    ReorderQueue<std::unique_ptr<FrameData>> decoded(ioptions.prefetch);
+    BoundedQueue<std::unique_ptr<FrameMesh>> toWrite(ioptions.writeQueue);
+    if (decodeTransforms && (int)decodeTransforms->size() < numWorkers) decodeTransforms->resize(numWorkers);
+
+    std::atomic<int> nextFrame(0), workersLeft(numWorkers), failed(0);
+    std::vector<std::thread> workers;
+    for (int w = 0; w < numWorkers; w++) {
+        workers.emplace_back([&, w]() {
+            std::vector<k4a_transformation_t> ownTransforms;
+            std::vector<k4a_transformation_t>& transforms = decodeTransforms ? (*decodeTransforms)[w] : ownTransforms;
+            for (int seq = nextFrame++; seq < numFrames; seq = nextFrame++) {
+                std::unique_ptr<FrameData> fd(new FrameData);
+                fd->frame = frames[seq];
+                FramePaths paths = framePaths(fd->frame);
+                transforms.resize(paths.rgb.size(), 0);
+                if (!LoadFrame(paths, transforms, *fd)) fd->Release();
+                decoded.Push(seq, std::move(fd));
+            }
+            DestroyTransforms(ownTransforms);
+            if (--workersLeft == 0) decoded.Close(); // every frame is pushed, the processors drain the rest
+        });
+    }
+    FramePipelineStats stats;
+    std::thread writer([&]() {
+        std::unique_ptr<FrameMesh> m;
+        while (toWrite.Pop(m)) {
+            std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            bool ok = m->filename.empty() || (m->indexed ? WriteMesh(m->filename, m->filepath, m->mesh) : WriteMesh(m->filename, m->filepath, m->tris));
+            for (const LodMesh& lod : m->lods) {
+                ok = (m->indexed ? WriteMesh(lod.filename, m->filepath, lod.mesh) : WriteMesh(lod.filename, m->filepath, lod.tris)) && ok;
+            }
+            if (ok) stats.written++;
+            else failed++;
+            if (written) written(*m, ok, std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+        }
+    });
+
+    std::mutex statsLock;
+    auto process = [&]() {
+#ifdef _OPENMP
+        int ompThreads = omp_get_max_threads(); // per thread setting, restored for the caller's next run
+        if (numProcessors > 1) omp_set_num_threads(std::max(1, omp_get_num_procs() / numProcessors));
+#endif
+        double myWaitDecode = 0, myWaitWrite = 0;
+        for (;;) {
+            std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            std::unique_ptr<FrameData> fd;
+            if (!decoded.Pop(fd)) break;
+            std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+            myWaitDecode += std::chrono::duration<double>(t1 - t0).count();
+            if (!fd->ok) { failed++; continue; }
+            std::unique_ptr<FrameMesh> m(new FrameMesh);
+            m->frame = fd->frame;
+            bool keep = processFrame(*fd, *m);
+            fd.reset();
+            if (!keep) { failed++; continue; }
+            t0 = std::chrono::steady_clock::now();
+            toWrite.Push(std::move(m));
+            myWaitWrite += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        }
+#ifdef _OPENMP
+        omp_set_num_threads(ompThreads);
+#endif
+        std::lock_guard<std::mutex> lock(statsLock);
+        stats.waitDecode += myWaitDecode;
+        stats.waitWrite += myWaitWrite;
+    };
+    std::vector<std::thread> processors;
+    for (int p = 1; p < numProcessors; p++) processors.emplace_back(process);
+    process();
+    for (std::thread& p : processors) p.join();
+    for (std::thread& w : workers) w.join();
+    toWrite.Close();
+    writer.join();
+    stats.failed = failed;
+    std::cout << "pipeline: " << numProcessors << " frame(s) in flight waited " << stats.waitDecode << "s for decoding and " << stats.waitWrite << "s for writing" << std::endl;
+    return stats;
+}
+
+
+
+/* size the volume to the silhouettes of this frame (see SilhouetteBounds)
+   - "voxelsize": keeps the voxel size of the default cube at voxRes, the resolution follows the box
+   - "voxelcount": keeps about voxRes^3 voxels, the voxel size follows the box
+   - the box is padded by the truncation band (bandVoxels) plus one voxel and rounded out to whole cubic voxels
+   - returns false (center/size/res untouched) if the silhouettes give no box
+*/
+bool FitVolumeBounds(std::vector<TSDFCameraView>& views, std::string mode, int voxRes, int bandVoxels, Eigen::Vector3d& center, Eigen::Vector3d& size, int res[3])
+{
+    Eigen::Vector3d lo, hi;
+    if (!SilhouetteBounds(views, lo, hi)) return false;
+    int padVoxels = bandVoxels + 1;
+    Eigen::Vector3d extent = hi - lo;
+    double voxelSize = size[0] / voxRes;
+    if (mode == "voxelcount") {
+        // the padding depends on the voxel size, a few fixed point steps settle it
+        voxelSize = cbrt(extent.prod()) / voxRes;
+        for (int it = 0; it < 4; it++) {
+            voxelSize = cbrt((extent.array() + 2 * padVoxels * voxelSize).prod()) / voxRes;
+        }
+    }
+    for (int a = 0; a < 3; a++) {
+        res[a] = (int)ceil(extent[a] / voxelSize) + 2 * padVoxels;
+        size[a] = res[a] * voxelSize;
+    }
+    center = (lo + hi) / 2;
+    return true;
+}
+
+/* everything the reconstruction of a frame needs that stays fixed for a take
+   - read only while frames are in flight, apart from the volume pool and the projection tables
+   - several frames can be reconstructed at once with the same context (see ReconstructFrame)
+*/
+struct ReconstructionContext {
+    std::vector<Eigen::Matrix3d> in;
+    std::vector<Eigen::Matrix4d> ex;
+    Eigen::Vector3d center, size; // default volume box (autobounds off)
+    int res[3];
+    int storage;
+    std::string autoBounds;
+    int voxRes;
+    int truncVoxels, truncDeltaVoxels;
+    bool carve;
+    int smooth, smoothPasses;
+    bool indexed, normals;
+    float isoLevel;
+    std::string extractor;
+    int decimate;
+    float decimateError;
+    int lods;
+    std::vector<int> renderCams;
+    std::vector<float> renderLookAt; // eye, target
+    bool noMesh;
+    bool volumeBlocks;
+    bool vertexColor; // volumes without colour, the mesh is coloured from the frame's images
+    bool hull;        // visual hull preview instead of the TSDF
+    // --incremental: one volume kept from frame to frame (created by the first frame, frames one at a time and in order)
+    bool incremental;
+    int changeTile;
+    float changeDepth;
+    std::unique_ptr<IncrementalVolume> incrementalVolume;
+    // dense fixed grid over several frames: voxel projections of every camera, built by the first frame
+    bool cacheProjections;
+    std::vector<TSDFCameraProjection> projections;
+    std::unique_ptr<std::once_flag[]> projectionsBuilt;
+    std::unique_ptr<VolumePool> pool;
+};
+
+/* the options that do not touch the grid, the calibration or the projection tables (a server job may change them) */
+void SetReconstructionOptions(ReconstructionContext& ctx) {
+    ctx.truncVoxels = ioptions.truncVoxels;
+    ctx.truncDeltaVoxels = ioptions.truncDeltaVoxels;
+    ctx.carve = ioptions.carve;
+    ctx.smooth = ioptions.smooth;
+    ctx.smoothPasses = ioptions.smoothPasses;
+    ctx.indexed = ioptions.indexed;
+    ctx.normals = ioptions.normals;
+    ctx.isoLevel = ioptions.isoLevel;
+    ctx.extractor = ioptions.extractor;
+    ctx.decimate = ioptions.decimate;
+    ctx.decimateError = ioptions.decimateError;
+    ctx.lods = ioptions.lods;
+    ctx.renderCams = ioptions.renderCamList;
+    ctx.renderLookAt = ioptions.renderLookAtPoints;
+    ctx.noMesh = ioptions.noMesh;
+    ctx.volumeBlocks = ioptions.volumeBlocks;
+    ctx.vertexColor = ioptions.vertexColor;
+    ctx.hull = ioptions.hull;
+    ctx.incremental = ioptions.incremental;
+    ctx.changeTile = ioptions.changeTile;
+    ctx.changeDepth = ioptions.changeDepth;
+}
+
+/* isolevel of the surface extracted from vol (--isolevel) */
+double ExtractionIsoLevel(const TSDFVolume& vol, float isoLevel) {
+    if (std::isnan(isoLevel)) return 1.0f / vol.res[0] / 2;
+    return isoLevel;
+}
+
+/* mesh of vol with the --extractor, indexed or as a triangle soup */
+void ExtractMesh(TSDFVolume& vol, const std::string& extractor, double isolevel, INDEXEDMESH& mesh, bool withColors, bool withNormals) {
+    if (extractor == "nets") vol.PolygoniseSurfaceNets(isolevel, mesh, withColors, withNormals);
+    else vol.PolygoniseMCIndexed(isolevel, mesh, withColors, withNormals);
+}
+void ExtractMesh(TSDFVolume& vol, const std::string& extractor, double isolevel, std::vector<TRIANGLE>& tris) {
+    if (extractor == "nets") vol.PolygoniseSurfaceNets(isolevel, tris);
+    else vol.PolygoniseMC(isolevel, tris);
+}
+
+/* --decimate / --decimateerror on an indexed mesh, before it is coloured from the images (fewer vertices to colour) */
+void DecimateMesh(INDEXEDMESH& mesh, int targetFaces, float maxError, int frame) {
+    if (targetFaces <= 0 && maxError <= 0) return;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    MeshDecimator::Stats stats = MeshDecimator::Decimate(mesh, targetFaces, maxError);
+    std::cout << "frame " << frame << " decimated " << stats.facesBefore << " to " << stats.facesAfter << " faces in " << stats.passes << " passes, "
+        << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count() << "ms" << std::endl;
+    // the decimator stops within 1% of the target, beyond that a collapse would have changed the topology (small pieces, handles) or passed the error bound
+    if (targetFaces > 0 && stats.facesAfter > targetFaces + targetFaces / 100)
+        std::cout << "frame " << frame << ": decimation stopped at " << stats.facesAfter << " faces, short of the --decimate target of " << targetFaces
+            << (maxError > 0 ? " (--decimateerror bound or mesh topology)" : " (mesh topology: pieces and handles cannot be collapsed away)") << std::endl;
+}
+
+/* mesh file of level of detail l: {lod} replaced by l, otherwise name_lod<l>.ext (level 0 keeps the name) */
+std::string LodOutputPath(const std::string& output, int level) {
+    if (output.find("{lod") != std::string::npos) return ExpandPathTemplate(output, "lod", level);
+    if (level == 0) return output;
+    size_t slash = output.find_last_of("/\\");
+    size_t dot = output.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = output.size();
+    return output.substr(0, dot) + "_lod" + std::to_string(level) + output.substr(dot);
+}
+
+/* --lods: mesh the coarser levels of vol's mip pyramid (see VolumePyramid.h) like the full resolution mesh, one integration for all of them
+   - every level at the isolevel of the full resolution mesh, so they all describe the same surface
+   - the --decimate face target shrinks 4x per level with the grid, --decimateerror stays
+   - views: colour the vertices from the frame's images (--vertexcolor), nullptr for the voxel colours
+*/
+void ExtractLods(TSDFVolume& vol, int numLevels, const std::string& extractor, double isolevel, bool indexed, bool normals, int decimate, float decimateError,
+    const std::vector<TSDFCameraView>* views, const std::string& output, int frame, std::vector<LodMesh>& lods) {
+    if (numLevels <= 0) return;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    VolumePyramid pyramid;
+    pyramid.Build(vol, numLevels);
+    double pyramidMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::string faces;
+    for (int l = 1; l <= pyramid.NumLevels(); l++) {
+        TSDFVolume& level = pyramid.Level(l);
+        lods.emplace_back();
+        LodMesh& lod = lods.back();
+        lod.filename = LodOutputPath(output, l);
+        if (indexed) {
+            ExtractMesh(level, extractor, isolevel, lod.mesh, !views, normals || views);
+            DecimateMesh(lod.mesh, decimate > 0 ? std::max(1, decimate >> (2 * l)) : 0, decimateError, frame);
+            if (views) level.ColorVertices(*views, lod.mesh);
+            if (!normals) lod.mesh.normals.clear();
+            faces += " " + std::to_string(lod.mesh.indices.size() / 3);
+        }
+        else {
+            ExtractMesh(level, extractor, isolevel, lod.tris);
+            if (views) level.ColorTriangles(*views, lod.tris);
+            faces += " " + std::to_string(lod.tris.size());
+        }
+    }
+    std::cout << "frame " << frame << " lods: " << pyramid.NumLevels() << " levels (faces" << faces << "), pyramid in " << pyramidMs << "ms, meshed in "
+        << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count() - pyramidMs << "ms" << std::endl;
+}
+
+/* png of one rendered camera: {cam} replaced by its index (or "lookat"), otherwise name_cam<index>.ext when several cameras share the name */
+std::string RenderOutputPath(const std::string& path, const std::string& cam, bool multiCamera) {
+    size_t p = path.find("{cam");
+    if (p != std::string::npos) {
+        if (cam != "lookat") return ExpandPathTemplate(path, "cam", atoi(cam.c_str()));
+        size_t e = path.find('}', p);
+        return e == std::string::npos ? path : path.substr(0, p) + cam + path.substr(e + 1);
+    }
+    if (!multiCamera) return path;
+    size_t slash = path.find_last_of("/\\");
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = path.size();
+    return path.substr(0, dot) + (cam == "lookat" ? "_lookat" : "_cam" + cam) + path.substr(dot);
+}
+
+/* --render: raycast the (smoothed) volume the mesh is extracted from, without extracting it (see VolumeRaycast.h)
+   - the rig cameras of ctx.renderCams at their image size, then the --renderlookat camera with the intrinsics, size
+     and up direction of the first of them (camera 0 without any)
+   - the rig cameras also report their rendered depth against the captured one, views must still hold the frame's images
+*/
+void RenderFrame(const ReconstructionContext& ctx, TSDFVolume& vol, float isolevel, const std::vector<TSDFCameraView>& views, const std::string& path, int frame) {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    VolumeRaycaster raycaster(vol, isolevel);
+    bool multiCamera = ctx.renderCams.size() + (ctx.renderLookAt.empty() ? 0 : 1) > 1;
+    auto write = [&](const RaycastImage& img, const std::string& cam) {
+        std::string file = RenderOutputPath(path, cam, multiCamera);
+        std::filesystem::path dir = std::filesystem::path(file).parent_path();
+        if (!dir.empty()) std::filesystem::create_directories(dir);
+        cv::Mat im(img.height, img.width, CV_8UC3, (void*)img.bgr.data());
+        if (!cv::imwrite(file, im)) std::cout << "frame " << frame << ": could not write " << file << std::endl;
+    };
+    for (int CID : ctx.renderCams) {
+        RaycastImage img;
+        raycaster.Render(views[CID], img);
+        write(img, std::to_string(CID));
+        RaycastResidual r = VolumeRaycaster::Residual(img, views[CID]);
+        int64_t captured = r.both + r.captureOnly;
+        std::cout << "frame " << frame << " cam " << CID << " render residual: mean " << 1000 * r.mean << "mm, mean abs " << 1000 * r.meanAbs << "mm, rms " << 1000 * r.rms
+            << "mm, " << (captured > 0 ? 100.0 * r.both / captured : 0.0) << "% of the captured foreground rendered, " << r.renderOnly << " pixels rendered outside it" << std::endl;
+    }
+    if (!ctx.renderLookAt.empty()) {
+        int ref = ctx.renderCams.empty() ? 0 : ctx.renderCams[0];
+        Eigen::Vector3d eye(ctx.renderLookAt[0], ctx.renderLookAt[1], ctx.renderLookAt[2]);
+        Eigen::Vector3d target(ctx.renderLookAt[3], ctx.renderLookAt[4], ctx.renderLookAt[5]);
+        // camera axes x right, y down, z forward, the y of the reference camera kept as far as the view direction allows
+        Eigen::Vector3d z = (target - eye).normalized();
+        Eigen::Vector3d x = ctx.ex[ref].block<3, 1>(0, 1).cross(z);
+        if (x.norm() < 1e-6) x = ctx.ex[ref].block<3, 1>(0, 0); // looking straight along it
+        x.normalize();
+        Eigen::Vector3d y = z.cross(x);
+        Eigen::Matrix4d exInv = Eigen::Matrix4d::Identity();
+        exInv.block<1, 3>(0, 0) = x.transpose();
+        exInv.block<1, 3>(1, 0) = y.transpose();
+        exInv.block<1, 3>(2, 0) = z.transpose();
+        exInv.block<3, 1>(0, 3) = -exInv.block<3, 3>(0, 0) * eye;
+        RaycastImage img;
+        raycaster.Render(ctx.in[ref], exInv, views[ref].width, views[ref].height, img);
+        write(img, "lookat");
+    }
+    std::cout << "frame " << frame << " rendered " << ctx.renderCams.size() + (ctx.renderLookAt.empty() ? 0 : 1) << " cameras in "
+        << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count() << "ms" << std::endl;
+}
+
+/* save the volume of a frame (see VolumeFile.h), creating its directory if needed */
+bool SaveFrameVolume(const std::string& path, TSDFVolume& vol, bool blocks) {
+    std::filesystem::path dir = std::filesystem::path(path).parent_path();
+    if (!dir.empty()) std::filesystem::create_directories(dir);
+    return SaveVolume(path, vol, blocks || vol.storage == TSDF_SPARSE);
+}
+
+/* take setup from the options and the loaded calibration (the volume pool is sized by the caller)
+   - numFrames: frames the context will reconstruct, all the jobs of a server
+*/
+void InitReconstructionContext(ReconstructionContext& ctx, int numCameras, int numFrames) {
+    for (int CID = 0; CID < numCameras; CID++) {
+        ctx.in.push_back(intrinsics[CID]);
+        ctx.ex.push_back(extrinsics[CID]);
+    }
+    ctx.center = Eigen::Vector3d(0, 0, 0);
+    ctx.size = Eigen::Vector3d(2, 2, 2);
+    for (int a = 0; a < 3; a++) ctx.res[a] = ioptions.voxRes;
+    ctx.storage = ioptions.sparse ? TSDF_SPARSE : TSDF_DENSE;
+    ctx.autoBounds = ioptions.autoBounds;
+    ctx.voxRes = ioptions.voxRes;
+    SetReconstructionOptions(ctx);
+    // a single frame would spend more on the tables than they save
+    ctx.cacheProjections = (numFrames > 1 && ctx.storage == TSDF_DENSE && ctx.autoBounds == "off" && !ctx.incremental);
+    ctx.projections.assign(numCameras, TSDFCameraProjection());
+    ctx.projectionsBuilt.reset(new std::once_flag[numCameras]);
+}
+
+/* frames to reconstruct at once: as many as fit in ioptions.memoryMB, at most one per core
+   - each frame holds its decoded images (about 14 bytes per color pixel and camera), a volume
+     (8 bytes per voxel, 10 while smoothing, 3 less without voxel colours, 1 bit for --hull) and its mesh until the writer takes it
+   - the decode and write queues and the shared projection tables (about 28 bytes per voxel) come off the budget first
+*/
+int FramesInFlight(const ReconstructionContext& ctx, int numCameras) {
+    double frameBytes = 0;
+    for (int CID = 0; CID < numCameras; CID++) {
+        const k4a_calibration_camera_t& color = k4aCalibrations.at(CID).color_camera_calibration;
+        frameBytes += 14.0 * color.resolution_width * color.resolution_height;
+    }
+    double voxels = (double)ctx.res[0] * ctx.res[1] * ctx.res[2];
+    double volumeBytes = ctx.hull ? voxels / 8 : voxels * ((ctx.smooth > 0 ? 10 : 8) - (ctx.vertexColor ? 3 : 0));
+    if (ctx.lods > 0) volumeBytes += volumeBytes / 7; // the levels of the pyramid, 1/8 + 1/64 + ...
+    if (ctx.storage == TSDF_SPARSE) volumeBytes /= 4; // rough share of allocated blocks
+    double meshBytes = 4.0 * ctx.res[0] * ctx.res[1] * sizeof(TRIANGLE);
+    if (ctx.lods > 0) meshBytes += meshBytes / 3;
+    double budget = ioptions.memoryMB * 1024.0 * 1024.0;
+    budget -= (ioptions.prefetch + ioptions.decodeThreads) * frameBytes + ioptions.writeQueue * meshBytes;
+    if (ctx.cacheProjections && !ctx.hull) budget -= 28 * voxels;
+    int inFlight = (int)(budget / (frameBytes + volumeBytes + meshBytes));
+    return std::max(1, std::min(inFlight, (int)std::thread::hardware_concurrency()));
+}
+
+/* --hull: carve the mattes into a 1 bit grid over the default volume and mesh it right away (no depth, sdf or colour) */
+bool ReconstructHull(ReconstructionContext& ctx, FrameData& fd, std::vector<TSDFCameraView>& views, FrameMesh& out) {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    VisualHull hull(ctx.res[0], ctx.res[1], ctx.res[2], ctx.center, ctx.size);
+    int64_t carved = hull.Carve(views);
+    fd.Release();
+    out.indexed = ctx.indexed;
+    if (ctx.indexed) {
+        hull.PolygoniseIndexed(out.mesh, ctx.normals);
+        DecimateMesh(out.mesh, ctx.decimate, ctx.decimateError, fd.frame);
+    }
+    else {
+        hull.Polygonise(out.tris);
+    }
+    std::cout << "frame " << fd.frame << " hull: carved " << (100.0 * carved / hull.NumVoxels()) << "% of the volume, meshed in "
+        << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count() << "ms" << std::endl;
+    return true;
+}
+
+/* --incremental: bring the volume kept in ctx up to date with this frame and mesh it (see IncrementalVolume.h)
+   - not re-entrant, the frames must come one at a time and in order
+*/
+bool ReconstructIncremental(ReconstructionContext& ctx, FrameData& fd, std::vector<TSDFCameraView>& views, FrameMesh& out) {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    if (!ctx.incrementalVolume || !ctx.incrementalVolume->Matches(ctx.res, !ctx.vertexColor)) {
+        ctx.incrementalVolume.reset(new IncrementalVolume(ctx.res, ctx.center, ctx.size, !ctx.vertexColor, ctx.changeTile, ctx.changeDepth));
+    }
+    TSDFVolume* vol = ctx.incrementalVolume->Volume();
+    IncrementalVolume::Stats stats = ctx.incrementalVolume->Integrate(views, vol->vSize[0] * ctx.truncVoxels, vol->vSize[0] * ctx.truncDeltaVoxels, ctx.carve);
+    if (!ctx.vertexColor && out.renderPath.empty()) fd.Release();
+    if (!out.volumePath.empty() && !SaveFrameVolume(out.volumePath, *vol, ctx.volumeBlocks)) {
+        std::cout << "frame " << fd.frame << ": could not save the volume to " << out.volumePath << std::endl;
+    }
+    double isolevel = ExtractionIsoLevel(*vol, ctx.isoLevel);
+    if (!out.renderPath.empty()) {
+        RenderFrame(ctx, *vol, (float)isolevel, views, out.renderPath, fd.frame);
+        if (!ctx.vertexColor) fd.Release();
+    }
+    out.indexed = ctx.indexed;
+    if (ctx.indexed) {
+        ctx.incrementalVolume->Extract((float)isolevel, out.mesh, !ctx.vertexColor, ctx.normals || ctx.vertexColor);
+        DecimateMesh(out.mesh, ctx.decimate, ctx.decimateError, fd.frame);
+        if (ctx.vertexColor) vol->ColorVertices(views, out.mesh);
+        if (!ctx.normals) out.mesh.normals.clear();
+    }
+    else {
+        ctx.incrementalVolume->Extract((float)isolevel, out.tris);
+        if (ctx.vertexColor) vol->ColorTriangles(views, out.tris);
+    }
+    ExtractLods(*vol, ctx.lods, ctx.extractor, isolevel, ctx.indexed, ctx.normals, ctx.decimate, ctx.decimateError, ctx.vertexColor ? &views : nullptr, out.filename, fd.frame, out.lods);
+    fd.Release();
+    std::cout << "frame " << fd.frame << " incremental: " << (100.0 * stats.changedTiles) << "% of the tiles changed, "
+        << stats.dirtyBricks << "/" << stats.numBricks << " bricks integrated, " << stats.remeshedBricks << " meshed, in "
+        << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count() << "ms" << std::endl;
+    return true;
+}
+
+/* reconstruct one frame into out (re-entrant, see ReconstructionContext)
+   - the images of the frame are released as soon as they are integrated, or after the extraction when the mesh is coloured from them
+*/
+bool ReconstructFrame(ReconstructionContext& ctx, FrameData& fd, FrameMesh& out) {
+    int numCameras = (int)fd.imRGB.size();
+    std::vector<TSDFCameraView> views;
+    for (int CID = 0; CID < numCameras; CID++) {
+        views.push_back(MakeCameraView(ctx.in[CID], ctx.ex[CID], fd.imRGB[CID], fd.imMATTE[CID], fd.pointclouds[CID]));
+    }
+    if (ctx.hull) {
+        for (int CID = 0; CID < numCameras; CID++) { // no colour image was read, the matte has its size
+            views[CID].width = fd.imMATTE[CID].cols;
+            views[CID].height = fd.imMATTE[CID].rows;
+        }
+        return ReconstructHull(ctx, fd, views, out);
+    }
+    if (ctx.incremental) return ReconstructIncremental(ctx, fd, views, out);
+
+    /* the volume is sized once the silhouettes are known */
+    Eigen::Vector3d center = ctx.center, size = ctx.size;
+    int res[3] = { ctx.res[0], ctx.res[1], ctx.res[2] };
+    if (ctx.autoBounds != "off") {
+        if (FitVolumeBounds(views, ctx.autoBounds, ctx.voxRes, std::max(ctx.truncVoxels, ctx.truncDeltaVoxels), center, size, res)) {
+            std::cout << "frame " << fd.frame << " volume: center (" << center.transpose() << ") size (" << size.transpose() << ") res " << res[0] << "x" << res[1] << "x" << res[2] << std::endl;
+        }
+        else {
+            std::cout << "frame " << fd.frame << " autobounds: no foreground in the mattes, using the default cube" << std::endl;
+        }
+    }
+    TSDFVolume* vol = ctx.pool->Acquire(res, center, size, ctx.storage, !ctx.vertexColor);
+    if (vol->storage == TSDF_SPARSE) {
+        for (int CID = 0; CID < numCameras; CID++) {
+            AllocateTruncationBand(vol, ctx.ex[CID], fd.imMATTE[CID], fd.pointclouds[CID], std::max(ctx.truncVoxels, ctx.truncDeltaVoxels));
+        }
+    }
+    if (ctx.cacheProjections) {
+        for (int CID = 0; CID < numCameras; CID++) {
+            std::call_once(ctx.projectionsBuilt[CID], [&]() { vol->BuildProjection(views[CID], ctx.projections[CID]); });
+            views[CID].projection = &ctx.projections[CID];
+        }
+    }
+    if (ctx.carve) {
+        int64_t carved = vol->CarveSilhouettes(views);
+        int64_t stored = vol->NumStoredVoxels(); // a sparse volume without blocks (empty mattes) has nothing to carve
+        std::cout << "frame " << fd.frame << " carved " << (stored > 0 ? 100.0 * carved / stored : 0.0) << "% of the volume" << std::endl;
+    }
+    vol->Integrate(views, vol->vSize[0] * ctx.truncVoxels, vol->vSize[0] * ctx.truncDeltaVoxels);
 
+    // clean up memory!!!!!! (the rendered cameras compare against the captured depth first)
+    if (!ctx.vertexColor && out.renderPath.empty()) fd.Release();
+    if (!out.volumePath.empty() && !SaveFrameVolume(out.volumePath, *vol, ctx.volumeBlocks)) {
+        std::cout << "frame " << fd.frame << ": could not save the volume to " << out.volumePath << std::endl;
+    }
+    if (ctx.smooth > 0) vol->Smooth(ctx.smooth, ctx.smoothPasses);
+    double isolevel = ExtractionIsoLevel(*vol, ctx.isoLevel);
+    if (!out.renderPath.empty()) {
+        RenderFrame(ctx, *vol, (float)isolevel, views, out.renderPath, fd.frame);
+        if (!ctx.vertexColor) fd.Release();
+    }
+    out.indexed = ctx.indexed;
+    if (ctx.noMesh) {
+        out.filename.clear(); // nothing for the writer
+    }
+    else if (ctx.indexed) {
+        ExtractMesh(*vol, ctx.extractor, isolevel, out.mesh, !ctx.vertexColor, ctx.normals || ctx.vertexColor);
+        DecimateMesh(out.mesh, ctx.decimate, ctx.decimateError, fd.frame);
+        if (ctx.vertexColor) vol->ColorVertices(views, out.mesh);
+        if (!ctx.normals) out.mesh.normals.clear();
+    }
+    else {
+        ExtractMesh(*vol, ctx.extractor, isolevel, out.tris);
+        if (ctx.vertexColor) vol->ColorTriangles(views, out.tris);
+    }
+    if (!ctx.noMesh) {
+        ExtractLods(*vol, ctx.lods, ctx.extractor, isolevel, ctx.indexed, ctx.normals, ctx.decimate, ctx.decimateError, ctx.vertexColor ? &views : nullptr, out.filename, fd.frame, out.lods);
+    }
+    fd.Release();
+    ctx.pool->Release(vol);
+    return true;
+}
+
+/* one JSON object per line for the server events, built key by key */
+class JsonLine {
+public:
+    JsonLine(const char* event) { s << "{\"event\":"; String(event); }
+    JsonLine& Add(const char* key, const std::string& v) { Key(key); String(v); return *this; }
+    JsonLine& Add(const char* key, const char* v) { Key(key); String(v); return *this; }
+    JsonLine& Add(const char* key, int v) { Key(key); s << v; return *this; }
+    JsonLine& Add(const char* key, double v) { Key(key); s << v; return *this; }
+    JsonLine& Add(const char* key, bool v) { Key(key); s << (v ? "true" : "false"); return *this; }
+    std::string str() const { return s.str() + "}"; }
+
+private:
+    void Key(const char* key) { s << ','; String(key); s << ':'; }
+    void String(const std::string& v) {
+        s << '"';
+        for (unsigned char c : v) {
+            if (c == '"' || c == '\\') s << '\\' << c;
+            else if (c < 0x20) { char esc[8]; snprintf(esc, sizeof(esc), "\\u%04x", c); s << esc; }
+            else s << c;
+        }
+        s << '"';
+    }
+    std::ostringstream s;
+};
+
+/* server job values, a key that is missing (or has the wrong type) keeps the current option */
+void JobValue(const cv::FileNode& n, std::string& v) {
+    if (n.isString()) v = (std::string)n;
+    else if (n.isInt()) v = std::to_string((int)n);
+}
+void JobValue(const cv::FileNode& n, std::vector<std::string>& v) {
+    if (n.isString()) v.assign(1, (std::string)n);
+    else if (n.isSeq()) {
+        v.clear();
+        for (cv::FileNodeIterator it = n.begin(); it != n.end(); ++it) v.push_back((std::string)*it);
+    }
+}
+void JobValue(const cv::FileNode& n, int& v) {
+    if (n.isInt() || n.isReal()) v = (int)n;
+}
+void JobValue(const cv::FileNode& n, float& v) {
+    if (n.isInt() || n.isReal()) v = (float)n;
+}
+void JobValue(const cv::FileNode& n, bool& v) {
+    if (n.isInt()) v = ((int)n != 0);
+    else if (n.isString()) v = ((std::string)n == "true");
+}
+
+/* parse one server job into ioptions (see Serve), false with the reason in error if it is not a JSON object */
+bool ReadJob(const std::string& line, std::string& id, std::string& cmd, std::string& error) {
+    cv::FileStorage fs;
+    try {
+        if (!fs.open(line, cv::FileStorage::READ | cv::FileStorage::MEMORY | cv::FileStorage::FORMAT_JSON)) {
+            error = "job is not valid JSON";
+            return false;
+        }
+    }
+    catch (const cv::Exception& e) {
+        error = "job is not valid JSON: " + e.msg;
+        return false;
+    }
+    cv::FileNode job = fs.root();
+    if (!job.isMap()) {
+        error = "job must be a JSON object";
+        return false;
+    }
+    JobValue(job["id"], id);
+    cmd = "reconstruct";
+    JobValue(job["cmd"], cmd);
+    JobValue(job["extrinsics"], ioptions.extrinsicsLogFilename);
+    JobValue(job["intrinsics"], ioptions.intrinsicsPaths);
+    JobValue(job["rgb"], ioptions.rgbPaths);
+    JobValue(job["depth"], ioptions.depthPaths);
+    JobValue(job["matte"], ioptions.mattePaths);
+    JobValue(job["frames"], ioptions.frames);
+    JobValue(job["output"], ioptions.outputPlyFilename);
+    JobValue(job["ascii"], ioptions.asciiPly);
+    JobValue(job["voxres"], ioptions.voxRes);
+    JobValue(job["trunc"], ioptions.truncVoxels);
+    JobValue(job["truncdelta"], ioptions.truncDeltaVoxels);
+    JobValue(job["sparse"], ioptions.sparse);
+    JobValue(job["autobounds"], ioptions.autoBounds);
+    JobValue(job["carve"], ioptions.carve);
+    JobValue(job["smooth"], ioptions.smooth);
+    JobValue(job["smoothpasses"], ioptions.smoothPasses);
+    JobValue(job["indexed"], ioptions.indexed);
+    JobValue(job["normals"], ioptions.normals);
+    JobValue(job["registration"], ioptions.registration);
+    JobValue(job["savevolume"], ioptions.saveVolume);
+    JobValue(job["volumeblocks"], ioptions.volumeBlocks);
+    JobValue(job["isolevel"], ioptions.isoLevel);
+    JobValue(job["extractor"], ioptions.extractor);
+    JobValue(job["decimate"], ioptions.decimate);
+    JobValue(job["decimateerror"], ioptions.decimateError);
+    JobValue(job["lods"], ioptions.lods);
+    JobValue(job["render"], ioptions.render);
+    JobValue(job["rendercams"], ioptions.renderCams);
+    JobValue(job["renderlookat"], ioptions.renderLookAt);
+    JobValue(job["nomesh"], ioptions.noMesh);
+    JobValue(job["vertexcolor"], ioptions.vertexColor);
+    JobValue(job["hull"], ioptions.hull);
+    JobValue(job["incremental"], ioptions.incremental);
+    JobValue(job["changetile"], ioptions.changeTile);
+    JobValue(job["changedepth"], ioptions.changeDepth);
+    JobValue(job["inflight"], ioptions.inFlight);
+    return true;
+}
+
+/* --extract: mesh saved volumes again, no calibration or images needed
+   - one volume per frame of --frames ({frame} in the path), the meshes go to -o like the reconstructed ones
+   - --smooth, --isolevel and the mesh options apply, the volume is mapped so only the pages the extraction reads are loaded
+*/
+int ExtractSavedVolumes() {
+    if (!ParseFrameRange(ioptions.frames, ioptions.frameList)) {
+        std::cout << "ERROR: frames must be start[:end[:step]] with end >= start and step > 0" << std::endl;
+        return 1;
+    }
+    if (ioptions.extractor != "mc" && ioptions.extractor != "nets") {
+        std::cout << "ERROR: extractor must be mc or nets" << std::endl;
+        return 1;
+    }
+    if (ioptions.decimate < 0 || ioptions.decimateError < 0 || ((ioptions.decimate > 0 || ioptions.decimateError > 0) && !ioptions.indexed)) {
+        std::cout << "ERROR: decimate and decimateerror must not be negative and need --indexed" << std::endl;
+        return 1;
+    }
+    if (ioptions.lods < 0 || ioptions.lods > 8) {
+        std::cout << "ERROR: lods must be 0 to 8" << std::endl;
+        return 1;
+    }
+    const std::vector<int>& frames = ioptions.frameList;
+    int failed = 0;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (int F : frames) {
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        std::string path = ExpandPathTemplate(ioptions.extractVolume, "frame", F);
+        std::unique_ptr<TSDFVolume> vol = LoadVolume(path);
+        if (!vol) {
+            failed++;
+            continue;
+        }
+        std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+        if (ioptions.smooth > 0) vol->Smooth(ioptions.smooth, ioptions.smoothPasses);
+        double isolevel = ExtractionIsoLevel(*vol, ioptions.isoLevel);
+        std::string output = FrameOutputPath(ioptions.outputPlyFilename, F, frames.size() > 1);
+        bool ok;
+        if (ioptions.indexed) {
+            INDEXEDMESH mesh;
+            ExtractMesh(*vol, ioptions.extractor, isolevel, mesh, true, ioptions.normals);
+            DecimateMesh(mesh, ioptions.decimate, ioptions.decimateError, F);
+            ok = WriteMesh(LodOutputPath(output, 0), "", mesh);
+        }
+        else {
+            std::vector<TRIANGLE> tris;
+            ExtractMesh(*vol, ioptions.extractor, isolevel, tris);
+            ok = WriteMesh(LodOutputPath(output, 0), "", tris);
+        }
+        std::vector<LodMesh> lods;
+        ExtractLods(*vol, ioptions.lods, ioptions.extractor, isolevel, ioptions.indexed, ioptions.normals, ioptions.decimate, ioptions.decimateError, nullptr, output, F, lods);
+        for (const LodMesh& lod : lods) {
+            ok = (ioptions.indexed ? WriteMesh(lod.filename, "", lod.mesh) : WriteMesh(lod.filename, "", lod.tris)) && ok;
+        }
+        if (!ok) failed++;
+        std::cout << path << ": " << vol->res[0] << "x" << vol->res[1] << "x" << vol->res[2] << (vol->storage == TSDF_SPARSE ? " blocks" : " grid")
+            << " opened in " << std::chrono::duration<double>(t1 - t0).count() << "s, meshed to " << output << " in "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count() << "s" << std::endl;
+    }
+    if (frames.size() > 1) {
+        std::cout << "Extracted " << frames.size() - failed << " of " << frames.size() << " volumes in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() << "s" << std::endl;
+    }
+    return failed ? 1 : 0;
+}
+
+/* persistent worker for VolNodes (--serve): one reconstruction job per line of stdin, progress as JSON lines on stdout
+   - a job is a JSON object with the long option names as keys, anything it leaves out comes from the server's command line:
+     {"id":"12","extrinsics":"extrinsics.log","intrinsics":["i0.json","i1.json"],"rgb":"client_{cam}/Color_12.jpg",
+      "depth":"client_{cam}/Depth_12.tiff","matte":"client_{cam}/Color_12.matte.png","output":"out/output_12.ply","voxres":256,"trunc":3}
+     flags are 0/1, {"cmd":"quit"} or the end of stdin stops the server
+   - events: "ready" once, then per job "calibration" (only when it was loaded), "frame" (reconstructed),
+     "written" and finally "done" or "error", all with the job id and their timings in seconds
+   - kept warm between jobs: the calibration, the decode threads' k4a transformations and the native registration tables
+     (until a job names other calibration files), the reconstruction context with its volume pool and projection tables (until the grid changes)
+   - the log output moves to stderr so that stdout only carries events
+*/
+int Serve() {
+    _ioptions defaults = ioptions;
+    std::ostream events(std::cout.rdbuf());
+    std::cout.rdbuf(std::cerr.rdbuf());
+    std::mutex eventLock;
+    auto emit = [&](const JsonLine& e) {
+        std::lock_guard<std::mutex> lock(eventLock);
+        events << e.str() << std::endl;
+    };
+    auto secondsSince = [](std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+    };
+
+    bool calibrated = false;
+    std::string loadedExtrinsics;
+    std::vector<std::string> loadedIntrinsics;
+    std::vector<std::vector<k4a_transformation_t>> decodeTransforms;
+    std::unique_ptr<ReconstructionContext> ctx;
+    std::string gridKey;
+    int poolSize = 0;
+
+    emit(JsonLine("ready"));
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        ioptions = defaults;
+        std::string id, cmd, error;
+        if (!ReadJob(line, id, cmd, error)) {
+            emit(JsonLine("error").Add("id", id).Add("message", error));
+            continue;
+        }
+        if (cmd == "quit") break;
+        if (cmd != "reconstruct") error = "unknown cmd " + cmd;
+        else ValidateOptions(error);
+        if (!error.empty()) {
+            emit(JsonLine("error").Add("id", id).Add("message", error));
+            continue;
+        }
+        int numCameras = (int)ioptions.intrinsicsPaths.size();
+        try {
+            /* calibration, only when the job names other files */
+            if (!calibrated || ioptions.extrinsicsLogFilename != loadedExtrinsics || ioptions.intrinsicsPaths != loadedIntrinsics) {
+                calibrated = false;
+                ctx.reset();
+                for (std::vector<k4a_transformation_t>& t : decodeTransforms) DestroyTransforms(t);
+                std::vector<std::string> files = ioptions.intrinsicsPaths;
+                files.push_back(ioptions.extrinsicsLogFilename);
+                for (const std::string& f : files) {
+                    if (!std::filesystem::exists(f)) error = "calibration file not found: " + f;
+                }
+                if (!error.empty()) {
+                    emit(JsonLine("error").Add("id", id).Add("message", error));
+                    continue;
+                }
+                extrinsics.clear();
+                intrinsics.clear();
+                k4aCalibrations.clear();
+                registrations.clear();
+                LoadExtrinsics(ioptions.extrinsicsLogFilename);
+                for (int i = 0; i < numCameras; i++) {
+                    LoadIntrinsics(ioptions.intrinsicsPaths[i], i);
+                }
+                calibrated = true;
+                loadedExtrinsics = ioptions.extrinsicsLogFilename;
+                loadedIntrinsics = ioptions.intrinsicsPaths;
+                emit(JsonLine("calibration").Add("id", id).Add("cameras", numCameras).Add("seconds", secondsSince(begin)));
+            }
+            PrepareRegistrations(numCameras); // kept with the calibration, built by the first job that asks for them
+
+            /* a new context (volumes, projection tables) only when the grid changes */
+            std::string key = std::to_string(ioptions.voxRes) + (ioptions.sparse ? " sparse " : " dense ") + ioptions.autoBounds;
+            if (!ctx || key != gridKey) {
+                ctx.reset(new ReconstructionContext);
+                InitReconstructionContext(*ctx, numCameras, INT_MAX); // the tables pay off over the jobs to come
+                gridKey = key;
+                poolSize = 0;
+            }
+            else {
+                SetReconstructionOptions(*ctx);
+            }
+            if (ctx->incrementalVolume) ctx->incrementalVolume->Invalidate(); // a job is a take of its own
+            int inFlight = ctx->incremental ? 1 : (ioptions.inFlight > 0) ? ioptions.inFlight : FramesInFlight(*ctx, numCameras);
+            if (inFlight != poolSize) {
+                ctx->pool.reset(new VolumePool(inFlight));
+                poolSize = inFlight;
+            }
+
+            const std::vector<int> frames = ioptions.frameList;
+            auto framePaths = [&](int F) {
+                FramePaths paths;
+                for (int CID = 0; CID < numCameras; CID++) {
+                    paths.rgb.push_back(ExpandPathTemplate(ioptions.rgbPaths[CID], "frame", F));
+                    paths.matte.push_back(ExpandPathTemplate(ioptions.mattePaths[CID], "frame", F));
+                    paths.depth.push_back(ExpandPathTemplate(ioptions.depthPaths[CID], "frame", F));
+                }
+                return paths;
+            };
+            FramePipelineStats stats = RunFramePipeline(frames, framePaths, [&](FrameData& fd, FrameMesh& out) -> bool {
+                std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+                double loadSeconds = fd.loadSeconds;
+                out.filename = LodOutputPath(FrameOutputPath(ioptions.outputPlyFilename, fd.frame, frames.size() > 1), 0);
+                if (!ioptions.saveVolume.empty()) out.volumePath = FrameOutputPath(ioptions.saveVolume, fd.frame, frames.size() > 1);
+                if (!ioptions.render.empty()) out.renderPath = FrameOutputPath(ioptions.render, fd.frame, frames.size() > 1);
+                bool ok = ReconstructFrame(*ctx, fd, out);
+                emit(JsonLine("frame").Add("id", id).Add("frame", out.frame).Add("loadSeconds", loadSeconds).Add("reconstructSeconds", secondsSince(t0)));
+                return ok;
+            }, inFlight, [&](const FrameMesh& m, bool ok, double seconds) {
+                emit(JsonLine("written").Add("id", id).Add("frame", m.frame).Add("output", m.filename).Add("ok", ok).Add("seconds", seconds));
+            }, &decodeTransforms);
+            emit(JsonLine("done").Add("id", id).Add("frames", (int)frames.size()).Add("written", stats.written).Add("failed", stats.failed)
+                .Add("seconds", secondsSince(begin)).Add("waitDecode", stats.waitDecode).Add("waitWrite", stats.waitWrite));
+        }
+        catch (const std::exception& e) {
+            emit(JsonLine("error").Add("id", id).Add("message", std::string(e.what())));
+        }
+    }
+    for (std::vector<k4a_transformation_t>& t : decodeTransforms) DestroyTransforms(t);
+    std::cout.rdbuf(events.rdbuf());
+    return 0;
+}
 
 // new main for connecting with VolNodes
 // all needed values should be passed in with arguments
 // processing only, no visuals
-// ALSO should only be 1 frame for now, expand later, let's do simplest single frame extraction solution
+// one frame, or a whole frame range in batch mode (--frames and {frame} path templates),
+// or many jobs in one process with --serve
 int main(int argc, char** argv) {
     auto result = parse(argc, argv);
     auto arguments = result.arguments();
+    if (ioptions.serve) return Serve();
+    if (!ioptions.extractVolume.empty()) return ExtractSavedVolumes();
     PrintOptionsSelected();
     
-    k4a_image_t k4a_pc=nullptr;
-    
-    Eigen::Vector3d theCenter(0, 0, 0);
-    float sz =2;
-    Eigen::Vector3d theSize(sz,sz,sz);
-
-    int res = ioptions.voxRes;
-    theVolume = new TSDFVolume(res,res,res, theCenter, theSize);
-    theVolume->SetAllVoxels(VOXEL_UNSEEN, VOXEL_MAXDIST, 0);
-    theVolume->ComputeAllVoxelCenters();   
-
     std::string fnameExtrinsics = ioptions.extrinsicsLogFilename;
 
     std::vector<std::string> pathsINTRINSICS = ioptions.intrinsicsPaths; // set from inputs
-    //std::vector<int>cameraIDS; //??
-    for (int i = 0; i < pathsINTRINSICS.size(); i++)
-    {
-        k4a_transformation_t transform = 0;
-        g_transforms.push_back(transform);
-    }
-    
+    int numCameras = (int)pathsINTRINSICS.size();
+
     LoadExtrinsics(fnameExtrinsics);
-    for (int i = 0; i < 6; i++) {
+    for (int i = 0; i < numCameras; i++) {
         LoadIntrinsics(pathsINTRINSICS[i], i);
     }
-    g_tris.erase(g_tris.begin(), g_tris.end());
-    g_tris.shrink_to_fit();
+    PrepareRegistrations(numCameras);
+
+    std::vector<int>& frames = ioptions.frameList;
+    auto framePaths = [&](int F) {
+        FramePaths paths; // set from inputs (depth: TIFF)
+        for (int CID = 0; CID < numCameras; CID++) {
+            paths.rgb.push_back(ExpandPathTemplate(ioptions.rgbPaths[CID], "frame", F));
+            paths.matte.push_back(ExpandPathTemplate(ioptions.mattePaths[CID], "frame", F));
+            paths.depth.push_back(ExpandPathTemplate(ioptions.depthPaths[CID], "frame", F));
+        }
+        return paths;
+    };
 
-    theVolume->reset();
-    
-    std::vector<std::string> pathsRGB = ioptions.rgbPaths; // set from inputs
-    std::vector<std::string> pathsMATTE = ioptions.mattePaths; // set from inputs
-    std::vector<std::string> pathsDEPTH = ioptions.depthPaths; // set from inputs (TIFF)
-    
-    /* load in all of the files */
-    for (int CAMERA = 0; CAMERA < pathsRGB.size(); CAMERA++)
-    {
-        int CID = CAMERA;
-        cv::Mat imRGB, imMATTE, imDEPTH16, imDEPTH16_transformed;
-        imRGB = cv::imread(pathsRGB[CAMERA]);
-        imMATTE = cv::imread(pathsMATTE[CAMERA]);
-        imDEPTH16 = cv::imread(pathsDEPTH[CAMERA], cv::IMREAD_ANYDEPTH); // 16bit short
-
-       /* transform depth to RGB size */
-        imDEPTH16_transformed = cv::Mat::zeros(imRGB.rows, imRGB.cols, CV_16UC1);
-      
-        TransformDepth(CAMERA,imDEPTH16, imDEPTH16_transformed, k4aCalibrations[CID], k4a_pc);
-
-        CarveWithSilhouette(theVolume, intrinsics[CID], extrinsics[CID], imRGB, imMATTE, imDEPTH16_transformed, k4a_pc);
-        
-        // clean up memory!!!!!!
-        imRGB.release();
-        imMATTE.release();
-        imDEPTH16.release();
-        imDEPTH16_transformed.release();
-    }
-    double isolevel = 1.0f / theVolume->res[0] / 2;
-    int n = theVolume->PolygoniseMC(isolevel, g_tris);
-    WritePLY(ioptions.outputPlyFilename, "", g_tris);
+    /* per take setup once, then the frames go through the decode -> reconstruct -> write pipeline */
+    ReconstructionContext ctx;
+    InitReconstructionContext(ctx, numCameras, (int)frames.size());
+    int inFlight = ctx.incremental ? 1 : (ioptions.inFlight > 0) ? ioptions.inFlight : FramesInFlight(ctx, numCameras);
+    ctx.pool.reset(new VolumePool(inFlight));
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    RunFramePipeline(frames, framePaths, [&](FrameData& fd, FrameMesh& out) -> bool {
+        out.filename = LodOutputPath(FrameOutputPath(ioptions.outputPlyFilename, fd.frame, frames.size() > 1), 0);
+        if (!ioptions.saveVolume.empty()) out.volumePath = FrameOutputPath(ioptions.saveVolume, fd.frame, frames.size() > 1);
+        if (!ioptions.render.empty()) out.renderPath = FrameOutputPath(ioptions.render, fd.frame, frames.size() > 1);
+        return ReconstructFrame(ctx, fd, out);
+    }, inFlight);
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    if (frames.size() > 1) {
+        double seconds = std::chrono::duration<double>(end - begin).count();
+        std::cout << "Processed " << frames.size() << " frames in " << seconds << "[s] (" << frames.size() / seconds << " frames/s)" << std::endl;
+    }
 }
 
 
@@ -860,14 +1990,12 @@ int oldmain(int argc, char** argv) {
 
 
 
-    k4a_image_t k4a_pc = nullptr;
     Eigen::Vector3d theCenter(0, 0, 0);
     float sz = 2;
     Eigen::Vector3d theSize(sz, sz, sz);
     int res = VOXRES;
     theVolume = new TSDFVolume(res, res, res, theCenter, theSize);
     theVolume->SetAllVoxels(VOXEL_UNSEEN, VOXEL_MAXDIST, 0);
-    theVolume->ComputeAllVoxelCenters();
 
     viewer.draw_axes = true;
     viewer.light_pos = Vector3f(3, 3, 0);
@@ -915,142 +2043,67 @@ int oldmain(int argc, char** argv) {
     pathsINTRINSICS.push_back(path + fnameIntrinsics5);
     cameraIDS.push_back(camID5);
 
-    k4a_transformation_t transform0 = 0;
-    k4a_transformation_t transform1 = 0;
-    k4a_transformation_t transform2 = 0;
-    k4a_transformation_t transform3 = 0;
-    k4a_transformation_t transform4 = 0;
-    k4a_transformation_t transform5 = 0;
-    g_transforms.push_back(transform0);
-    g_transforms.push_back(transform1);
-    g_transforms.push_back(transform2);
-    g_transforms.push_back(transform3);
-    g_transforms.push_back(transform4);
-    g_transforms.push_back(transform5);
-
     LoadExtrinsics(fnameExtrinsics);
     for (int i = 0; i < 6; i++) {
         LoadIntrinsics(pathsINTRINSICS[i], i);
     }
     float percentage = 0;
     std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    // the rig and the grid are fixed for the take, every camera's voxel projections are computed on the first frame only
+    std::vector<TSDFCameraProjection> projections(cameraIDS.size());
+
+    /* files of frame F: client_<camera>\Color_F.jpg, Color_F.matte.png, Depth_F.tiff */
+    auto framePaths = [&](int F) {
+        FramePaths paths;
+        for (int CAMERA = 0; CAMERA < cameraIDS.size(); CAMERA++) {
+            std::string client = path + "client_" + std::to_string(cameraIDS[CAMERA]) + "\\";
+            paths.rgb.push_back(client + "Color_" + std::to_string(F) + ".jpg");
+            paths.matte.push_back(client + "Color_" + std::to_string(F) + ".matte.png");
+            paths.depth.push_back(client + "Depth_" + std::to_string(F) + ".tiff");
+        }
+        return paths;
+    };
+    std::vector<int> frames;
+    for (int F = startFRAME; F <= endFRAME; F++) frames.push_back(F);
 
-    for (int F = startFRAME; F <= endFRAME; F++) {
+    /* frames are decoded ahead and written behind on other threads, only the integration runs here */
+    RunFramePipeline(frames, framePaths, [&](FrameData& fd, FrameMesh& out) -> bool {
+        int F = fd.frame;
         percentage = ((float)(F - startFRAME) / (float)(endFRAME - startFRAME)) * 100.f;
         std::cout << percentage << "%" << std::endl;
         // reset things for this frame
-        //g_tris.resize(0);
         g_tris.erase(g_tris.begin(), g_tris.end());
         g_tris.shrink_to_fit();
 
         theVolume->reset();
 
-
-
-        std::string fnameRGB0 = "client_0\\Color_" + std::to_string(F) + ".jpg";
-        std::string fnameMATTE0 = "client_0\\Color_" + std::to_string(F) + ".matte.png";
-        std::string fnameDEPTH0 = "client_0\\Depth_" + std::to_string(F) + ".tiff";// 
-
-        std::string fnameRGB1 = "client_1\\Color_" + std::to_string(F) + ".jpg";
-        std::string fnameMATTE1 = "client_1\\Color_" + std::to_string(F) + ".matte.png";
-        std::string fnameDEPTH1 = "client_1\\Depth_" + std::to_string(F) + ".tiff";// 
-
-        std::string fnameRGB2 = "client_2\\Color_" + std::to_string(F) + ".jpg";
-        std::string fnameMATTE2 = "client_2\\Color_" + std::to_string(F) + ".matte.png";
-        std::string fnameDEPTH2 = "client_2\\Depth_" + std::to_string(F) + ".tiff";// 
-
-        std::string fnameRGB3 = "client_3\\Color_" + std::to_string(F) + ".jpg";
-        std::string fnameMATTE3 = "client_3\\Color_" + std::to_string(F) + ".matte.png";
-        std::string fnameDEPTH3 = "client_3\\Depth_" + std::to_string(F) + ".tiff";// 
-
-        std::string fnameRGB4 = "client_4\\Color_" + std::to_string(F) + ".jpg";
-        std::string fnameMATTE4 = "client_4\\Color_" + std::to_string(F) + ".matte.png";
-        std::string fnameDEPTH4 = "client_4\\Depth_" + std::to_string(F) + ".tiff";// 
-
-        std::string fnameRGB5 = "client_5\\Color_" + std::to_string(F) + ".jpg";
-        std::string fnameMATTE5 = "client_5\\Color_" + std::to_string(F) + ".matte.png";
-        std::string fnameDEPTH5 = "client_5\\Depth_" + std::to_string(F) + ".tiff";// 
-
-        std::vector<std::string> pathsRGB;
-        std::vector<std::string> pathsMATTE;
-        std::vector<std::string> pathsDEPTH;
-
-        pathsRGB.push_back(path + fnameRGB0);
-        pathsMATTE.push_back(path + fnameMATTE0);
-        pathsDEPTH.push_back(path + fnameDEPTH0);
-
-        // front side
-        pathsRGB.push_back(path + fnameRGB1);
-        pathsMATTE.push_back(path + fnameMATTE1);
-        pathsDEPTH.push_back(path + fnameDEPTH1);
-
-        // back angle
-        pathsRGB.push_back(path + fnameRGB2);
-        pathsMATTE.push_back(path + fnameMATTE2);
-        pathsDEPTH.push_back(path + fnameDEPTH2);
-
-        ////
-        pathsRGB.push_back(path + fnameRGB3);
-        pathsMATTE.push_back(path + fnameMATTE3);
-        pathsDEPTH.push_back(path + fnameDEPTH3);
-
-        pathsRGB.push_back(path + fnameRGB4);
-        pathsMATTE.push_back(path + fnameMATTE4);
-        pathsDEPTH.push_back(path + fnameDEPTH4);
-
-        // backside
-        pathsRGB.push_back(path + fnameRGB5);
-        pathsMATTE.push_back(path + fnameMATTE5);
-        pathsDEPTH.push_back(path + fnameDEPTH5);
-
-        /* load in all of the files */
-        for (int CAMERA = 0; CAMERA < pathsRGB.size(); CAMERA++)
+        for (int CAMERA = 0; CAMERA < cameraIDS.size(); CAMERA++)
         {
             int CID = cameraIDS[CAMERA];
 #ifdef _VERBOSE
             std::cout << "CAMERA:" << CAMERA << std::endl;
 #endif
-            cv::Mat imRGB, imMATTE, imDEPTH16, imDEPTH16_transformed;
-            imRGB = cv::imread(pathsRGB[CAMERA]);
-            imMATTE = cv::imread(pathsMATTE[CAMERA]);
-            imDEPTH16 = cv::imread(pathsDEPTH[CAMERA], cv::IMREAD_ANYDEPTH); // 16bit short
-
-           /* transform depth to RGB size */
-            imDEPTH16_transformed = cv::Mat::zeros(imRGB.rows, imRGB.cols, CV_16UC1);
-
-            TransformDepth(CAMERA, imDEPTH16, imDEPTH16_transformed, k4aCalibrations[CID], k4a_pc);
-
 #ifdef _VOXEL_CARVE       
-            CarveWithSilhouette(theVolume, intrinsics[CID], extrinsics[CID], imRGB, imMATTE, imDEPTH16_transformed, k4a_pc);
+            CarveWithSilhouette(theVolume, intrinsics[CID], extrinsics[CID], fd.imRGB[CAMERA], fd.imMATTE[CAMERA], fd.imDEPTH[CAMERA], fd.pointclouds[CAMERA], &projections[CAMERA]);
 #else
             // testing a different approach
             // let's create a simple mesh from each depth map and add them to the viewer
-            CreateAndAddMesh(intrinsics[CID], extrinsics[CID], imRGB, imMATTE, imDEPTH16_transformed, k4a_pc);
+            CreateAndAddMesh(intrinsics[CID], extrinsics[CID], fd.imRGB[CAMERA], fd.imMATTE[CAMERA], fd.imDEPTH[CAMERA], fd.pointclouds[CAMERA]);
 #endif 
-            // clean up memory!!!!!!
-            imRGB.release();
-            imMATTE.release();
-            imDEPTH16.release();
-            imDEPTH16_transformed.release();
-
-
-            //k4a_image_release(k4a_pc);
         }
 #ifdef _VOXEL_CARVE 
         if (VOXSMOOTH > 0)theVolume->Smooth(VOXSMOOTH);
         double isolevel = 1.0f / theVolume->res[0] / 2;
-        int n = theVolume->PolygoniseMC(isolevel, g_tris);
+        int n = theVolume->PolygoniseMC(isolevel, out.tris);
         // AddVolumeToViewer(theVolume);   // lol, this accumulates all frames into the viewer
 #else
+        out.tris = g_tris;
         //AddMeshToViewer();
 #endif
-        int frameNum = F;
-        std::string obj_postfix = std::to_string(frameNum) + ".ply";
-
-        WritePLY(obj_prefix + obj_postfix, obj_filepath, g_tris);
-        //        WriteOBJ(obj_prefix + obj_postfix, obj_filepath, g_tris);
-
-    }
+        out.filename = obj_prefix + std::to_string(F) + ".ply";
+        out.filepath = obj_filepath;
+        return true;
+    });
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
     std::cout << "Processing Time = " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
     // VIEWER STUFF
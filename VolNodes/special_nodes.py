@@ -8,6 +8,9 @@ import sys
 import os
 from os import walk
 import glob
+import re
+import json
+import subprocess
 # open cv 
 import cv2
 import plyfile
@@ -683,6 +686,28 @@ class MatteExtractor(Node):
             print('ready')
             self.doMatteExtract()
             
+class TSDFWorker():
+    # one simpleTSDF --serve process kept between runs, so the calibration, volumes and projection tables stay loaded
+    # jobs go in and events come back as JSON lines, the log of the process goes to its stderr (the console)
+    def __init__(self, exe):
+        self.exe = exe
+        self.proc = None
+        self.nextId = 0
+
+    def run(self, job):
+        if self.proc is None or self.proc.poll() is not None:
+            self.proc = subprocess.Popen([self.exe, '--serve'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True, bufsize=1)
+        self.nextId = self.nextId + 1
+        job['id'] = str(self.nextId)
+        self.proc.stdin.write(json.dumps(job)+'\n')
+        self.proc.stdin.flush()
+        for line in self.proc.stdout:
+            print('tsdf: '+line.strip())
+            event = json.loads(line)
+            if event.get('id') == job['id'] and event['event'] in ('done', 'error'):
+                return event
+        return None  # the worker exited, the next run starts a new one
+
 class VoxelCarveTSDF(_DynamicPorts_Node):
     title = 'VoxelCarveTSDF'
     version = 'v0.1'
@@ -699,26 +724,35 @@ class VoxelCarveTSDF(_DynamicPorts_Node):
         super().__init__(params)
         super().add_inp('Extrinsics')
         super().add_inp('OutputDir')
+        super().add_inp('Frames')  # optional start:end:step, the whole range runs as one job
         super().add_inp('Cam0')
         self.frameNum = 0
         self.numCameras = 1
-        self.lastPinIndex = 2
+        self.lastPinIndex = 3
         self.firstCameraPinIndex = self.lastPinIndex
         self.outputDirName = "."
         self.main_exe = '.\\bin\\simpleTSDF.exe'
-        self.command = self.main_exe
+        self.worker = TSDFWorker(self.main_exe)
+        self.job = {}
         
+    def frameTemplate(self, path):
+        # Color_12.jpg -> Color_{frame}.jpg, only in the file name since the directories can hold numbers too
+        d, f = os.path.split(path)
+        f = re.sub('_'+str(self.frameNum)+r'(?=\.)', '_{frame}', f, count=1)
+        return os.path.join(d, f)
+
     def doVoxelCarveTSDF(self):
         print('doVoxelCarveTSDF')
-        print('running command:'+self.command)
-        os.system(self.command)
+        print('running job:'+json.dumps(self.job))
+        event = self.worker.run(self.job)
+        if event is None or event['event'] == 'error':
+            print('tsdf: job failed')
         
     def doButtonPress(self):
-        print('doButtonPress - make command')
-        self.command = self.main_exe
-        extrinsics = self.input(0)
-        self.command += ' -e '+  extrinsics
+        print('doButtonPress - make job')
+        self.job = {'extrinsics': self.input(0), 'intrinsics': [], 'rgb': [], 'depth': [], 'matte': []}
         self.outputDirName = self.input(1)
+        frames = self.input(2)
         for i in range(self.firstCameraPinIndex,self.lastPinIndex,1) :
             print('pin(index)='+str(i))
             print(self.input(i))
@@ -729,11 +763,20 @@ class VoxelCarveTSDF(_DynamicPorts_Node):
             matte = cDict['matte']
             self.frameNum = cDict['frame']
             outputPlyName = self.outputDirName+'\\output_'+str(self.frameNum)+'.ply'
-            self.command += ' -i '+intrin 
-            self.command += ' -r '+rgb
-            self.command += ' -d '+depth
-            self.command += ' -m '+matte
-            self.command += ' -o '+outputPlyName
+            if frames :
+                # batch: the camera's paths become {frame} templates
+                rgb = self.frameTemplate(rgb)
+                depth = self.frameTemplate(depth)
+                matte = self.frameTemplate(matte)
+            self.job['intrinsics'].append(intrin)
+            self.job['rgb'].append(rgb)
+            self.job['depth'].append(depth)
+            self.job['matte'].append(matte)
+        if frames :
+            self.job['frames'] = str(frames)
+            self.job['output'] = self.outputDirName+'\\output_{frame}.ply'
+        else :
+            self.job['output'] = outputPlyName
         self.doVoxelCarveTSDF()
         self.set_output_val(0, outputPlyName)
     
@@ -741,7 +784,7 @@ class VoxelCarveTSDF(_DynamicPorts_Node):
         print('tsdf: update')
         print('inp:'+str(inp))
         if inp == self.lastPinIndex :
-            label = "Cam"+str(inp-1)
+            label = "Cam"+str(inp-self.firstCameraPinIndex+1)
             super().add_inp(label)
             self.numCameras = self.numCameras + 1
             self.lastPinIndex = self.lastPinIndex + 1